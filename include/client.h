@@ -1,6 +1,6 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
-int connect_to_server(pid_t server_pid, const char *username);
+int connect_to_server(pid_t server_pid, const char *username, const char *script);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,47 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "document.h"
+#include "posmap.h"
+
+// Editing commands shared by the server (authoritative copy) and the client
+// (local replica replaying EDIT broadcasts), so both apply them identically.
+typedef enum
+{
+    CMD_NONE,
+    CMD_INSERT,
+    CMD_DELETE,
+    CMD_BOLD,
+    CMD_ITALIC,
+    CMD_HEADING,
+    CMD_LIST,
+    CMD_CODE,
+    CMD_LINK,
+    CMD_NEWLINE,
+    CMD_BLOCKQUOTE,
+    CMD_ORDERED_LIST,
+    CMD_UNORDERED_LIST,
+    CMD_HORIZONTAL_RULE,
+    CMD_COUNT // Not a command: one past the last type
+} command_type_t;
+
+typedef struct
+{
+    command_type_t type;
+    int pos;
+    int len;        // DELETE count, BOLD/ITALIC/CODE/LINK length, LIST line count
+    int level;      // HEADING level
+    char list_type; // LIST 'O' (ordered) or 'U' (unordered)
+    char text[256]; // INSERT text, LINK target
+} command_t;
+
+command_type_t command_type(const char *cmd);
+const char *command_name(command_type_t type);
+bool command_parse(const char *cmd, command_t *out);
+int command_format(const command_t *c, char *buf, size_t size);
+bool command_apply(document_t *doc, posmap_t *map, const command_t *c, char *response, size_t resp_size);
+bool command_rebase(const posmap_t *map, command_t *c, char *response, size_t resp_size);
+
+#endif
@@ -1,23 +1,68 @@
 #ifndef DOCUMENT_H
 #define DOCUMENT_H
 
+#include <stddef.h>
+#include <stdatomic.h>
+
+// The document is a rope: an implicit treap whose nodes each own a
+// contiguous chunk of text, ordered by position. Subtree byte counts let
+// insert/delete find a position in O(log n) without walking the text, and
+// subtree newline counts do the same for line numbers. A document opened
+// with document_map starts out as chunks borrowed from the mapped file;
+// edits copy only the chunks they touch.
 typedef struct doc_node
 {
-    char c;
-    struct doc_node *next;
+    struct doc_node *left;
+    struct doc_node *right;
+    unsigned int prio; // Treap heap priority
+    char *buf;         // Chunk bytes (not NUL-terminated)
+    size_t len;        // Bytes used in this chunk
+    size_t cap;        // Bytes allocated for this chunk; 0 if buf is borrowed
+    size_t size;       // Total bytes in this subtree
+    size_t nl;         // Newlines in this chunk, or DOC_NL_UNKNOWN
+    size_t nl_size;    // Total newlines in this subtree, or DOC_NL_UNKNOWN
 } doc_node_t;
 
+// Newline count of a borrowed chunk not yet scanned; line lookups fill it in
+#define DOC_NL_UNKNOWN ((size_t)-1)
+
+// Serialized text of the document at one revision. Snapshots are shared
+// read-only between the document cache and any number of readers; the last
+// document_snapshot_release frees it.
+typedef struct
+{
+    atomic_int refs;
+    unsigned long revision; // document_t.revision this text matches
+    size_t len;
+    size_t cap;  // 0 if data is the mapped file rather than our own copy
+    char *data;  // len bytes plus a NUL terminator
+} doc_snapshot_t;
+
 typedef struct
 {
-    doc_node_t *head;
+    doc_node_t *root;
     size_t length;
     unsigned long version;
+    unsigned long revision;  // Bumped on every successful edit
+    doc_snapshot_t *cache;   // Last snapshot, patched or rebuilt lazily
+    size_t cache_moved;      // Bytes patched into the cache since it was last read
+    unsigned int seed;       // Priority generator state
+    void *map;               // File mapped by document_map, or NULL
+    size_t map_len;
 } document_t;
 
 document_t *document_create(void);
+document_t *document_map(const char *path);
 void document_free(document_t *doc);
 int document_insert(document_t *doc, size_t pos, const char *text);
 int document_delete(document_t *doc, size_t pos, size_t n);
+int document_wrap(document_t *doc, size_t start, size_t end, const char *open, const char *close);
+size_t document_read(const document_t *doc, size_t pos, char *buf, size_t n);
+size_t document_line_count(document_t *doc);
+size_t document_line_at(document_t *doc, size_t pos);
+size_t document_line_start(document_t *doc, size_t line);
 void document_serialize(document_t *doc, char **out, size_t *len);
+const doc_snapshot_t *document_snapshot(document_t *doc);
+void document_snapshot_release(const doc_snapshot_t *snap);
 
-#endif
\ No newline at end of file
+#endif
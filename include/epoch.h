@@ -0,0 +1,48 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Epoch-based reclamation for read-mostly structures. Readers bracket their
+// use of a published pointer with epoch_enter/epoch_exit and never block.
+// A writer that unpublishes an object retires it instead of freeing it; the
+// object is freed once every reader inside an epoch has moved past the one
+// it was retired in. Each thread is given a reader slot on its first entry,
+// on a cache line of its own, and the slot passes to another thread once it
+// exits. Entries may nest. Retiring and reclaiming take a mutex, so writers
+// on any thread may use them.
+typedef struct epoch_retired
+{
+    struct epoch_retired *next;
+    unsigned long epoch; // Global epoch when it was retired
+    void (*release)(void *);
+    void *ptr;
+} epoch_retired_t;
+
+typedef struct epoch_reader
+{
+    _Alignas(64) atomic_ulong active; // Epoch its thread entered in, or 0
+    unsigned int depth;               // Nesting; used by its thread only
+    bool owned;                       // Held by a live thread; under the mutex
+    struct epoch *epoch;
+    struct epoch_reader *next;
+} epoch_reader_t;
+
+typedef struct epoch
+{
+    atomic_ulong global;
+    pthread_key_t key;        // This thread's reader slot
+    pthread_mutex_t mutex;    // Guards the lists below
+    epoch_reader_t *readers;  // Every slot ever made; slots are reused, not freed
+    epoch_retired_t *retired;
+} epoch_t;
+
+int epoch_init(epoch_t *e);
+void epoch_enter(epoch_t *e);
+void epoch_exit(epoch_t *e);
+void epoch_retire(epoch_t *e, void *ptr, void (*release)(void *));
+void epoch_reclaim(epoch_t *e);
+
+#endif
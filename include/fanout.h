@@ -0,0 +1,22 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stddef.h>
+
+// Broadcast fan-out. A payload is copied once into a private staging pipe
+// and tee(2)'d from there into each client FIFO, so every extra client costs
+// a reference to the staged pipe pages instead of another copy.
+typedef struct
+{
+    int pipe_fd[2]; // Staging pipe: [0] read end, [1] write end
+    int null_fd;    // /dev/null, used to drain the staging pipe
+    size_t chunk;   // Bytes staged per round
+    size_t tee_min; // Smaller payloads are written to each client directly
+} fanout_t;
+
+int fanout_init(fanout_t *f);
+void fanout_destroy(fanout_t *f);
+int fanout_send(fanout_t *f, const int *fds, int nfds, const char *buf, size_t len, size_t *sent);
+int fanout_send_copy(const int *fds, int nfds, const char *buf, size_t len, size_t *sent);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+// Log-linear histogram of non-negative values (latencies in ns, sizes in
+// bytes). Values under 16 get a bucket each; above that every power of two
+// is split into 16 buckets, so a quantile is within about 3% of the value
+// recorded, across the whole 64-bit range, in a fixed 8 KiB.
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+void hist_add(hist_t *h, uint64_t v);
+void hist_merge(hist_t *into, const hist_t *from);
+uint64_t hist_quantile(const hist_t *h, double q);
+
+#endif
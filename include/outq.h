@@ -0,0 +1,55 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Outbound queue for one non-blocking client FIFO. Messages are written
+// straight to the FIFO while nothing is queued; whatever the FIFO cannot
+// take is copied into the queue and flushed once it has room again.
+// Messages are kept whole so a backlog can be cut without tearing one.
+// A reply too long to copy in whole is queued as a stream: a placeholder
+// its owner fills a piece at a time, once it reaches the head of the queue.
+typedef enum
+{
+    OUTQ_REPLY,    // Answer to the client's own command
+    OUTQ_BLOCK,    // VERSION block broadcast to everyone
+    OUTQ_SNAPSHOT, // Full document; supersedes every block before it
+    OUTQ_STREAM    // Placeholder for a reply produced piece by piece
+} outq_kind_t;
+
+typedef struct outq_msg
+{
+    struct outq_msg *next;
+    outq_kind_t kind;
+    unsigned long version; // Version a block or snapshot brings the client to
+    size_t len;
+    size_t sent;           // Bytes already written to the FIFO
+    void *stream;          // OUTQ_STREAM: the producer's state
+    void (*release)(void *);
+    char data[];
+} outq_msg_t;
+
+typedef struct
+{
+    outq_msg_t *head;
+    outq_msg_t *tail;
+    size_t bytes;   // Unsent bytes queued
+    size_t backlog; // Unsent bytes of blocks, the part a snapshot can replace
+    size_t streams; // Stream placeholders queued
+} outq_t;
+
+void outq_init(outq_t *q);
+void outq_free(outq_t *q);
+int outq_push(outq_t *q, outq_kind_t kind, unsigned long version, const struct iovec *iov, int iovcnt,
+              size_t sent);
+int outq_write(outq_t *q, int fd, outq_kind_t kind, unsigned long version, const struct iovec *iov,
+               int iovcnt, unsigned long *done_version);
+int outq_flush(outq_t *q, int fd, unsigned long *done_version);
+size_t outq_drop_stale(outq_t *q);
+int outq_push_stream(outq_t *q, void *stream, void (*release)(void *));
+void *outq_stream(const outq_t *q);
+int outq_push_piece(outq_t *q, const char *data, size_t len);
+void outq_end_stream(outq_t *q);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef POSMAP_H
+#define POSMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Position map for one version. Every edit in a version targets the document
+// as it was broadcast (the base), so positions have to be translated past the
+// edits already applied in the same version. The map describes the current
+// text as an ordered list of pieces: runs of surviving base text, and text
+// inserted since the base, each tied to the base cursor it was inserted at.
+typedef enum
+{
+    PIECE_BASE,   // Base text [base, base + len)
+    PIECE_TEXT,   // INSERTed text; survives deletion of the text around it
+    PIECE_PREFIX, // Formatting marker belonging to the base char at base
+    PIECE_SUFFIX  // Formatting marker belonging to the base char at base - 1
+} piece_kind_t;
+
+// The pieces are kept in an implicit treap, ordered as in the document, in a
+// node pool reused from version to version. Subtree lengths give current
+// offsets, so an edit costs O(log k) in the k pieces of the version instead
+// of moving every later piece. Subtree ranges of base keys locate the base
+// text deleted around a cursor, so no separate list of deletions is kept.
+typedef struct
+{
+    piece_kind_t kind;
+    size_t base;       // Base offset of the run, or base cursor of the insertion
+    size_t len;
+    size_t size;       // Total length of the subtree
+    size_t first_base; // Base offset of the subtree's first PIECE_BASE, or POSMAP_NONE
+    size_t last_base;  // Base offset of its last PIECE_BASE, or POSMAP_NONE
+    unsigned int prio; // Treap heap priority
+    size_t left;       // Child node indices; 0 is none
+    size_t right;
+} posmap_node_t;
+
+#define POSMAP_NONE ((size_t)-1)
+
+// A half-open range [start, end) of current offsets
+typedef struct
+{
+    size_t start;
+    size_t end;
+} posmap_span_t;
+
+typedef struct
+{
+    posmap_node_t *nodes; // Pool; node 0 is unused so that 0 can mean none
+    size_t count;
+    size_t cap;
+    size_t root;
+    unsigned int seed;    // Priority generator state
+    posmap_span_t *cuts;  // Current ranges removed by the last posmap_delete
+    size_t ncuts;
+    size_t cuts_cap;
+    size_t base_len;      // Document length at the base version
+    size_t length;        // Current document length
+} posmap_t;
+
+void posmap_init(posmap_t *m);
+void posmap_free(posmap_t *m);
+void posmap_reset(posmap_t *m, size_t base_len);
+size_t posmap_translate(const posmap_t *m, size_t pos);
+bool posmap_deleted(const posmap_t *m, size_t pos, size_t *start, size_t *end);
+size_t posmap_anchor(const posmap_t *m, size_t cur);
+void posmap_insert(posmap_t *m, size_t cur, size_t len, piece_kind_t kind, size_t anchor);
+void posmap_delete(posmap_t *m, size_t start, size_t end);
+
+#endif
@@ -1,6 +1,57 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
-int send_document(int fd, const char *role, unsigned long version, const char *doc, size_t len);
+#include <stddef.h>
+#include <sys/types.h>
 
-#endif
\ No newline at end of file
+// Longest command a client may send, its newline included. Commands are
+// printable ASCII (32-126) apart from that newline.
+#define COMMAND_MAX 256
+
+int document_header(char *buf, size_t size, const char *role, unsigned long version, size_t len);
+
+// Messages the server sends to a client
+typedef enum
+{
+    MSG_SNAPSHOT,    // "role\nversion\nlen\n<len bytes>"
+    MSG_VERSION,     // "VERSION n\n...END\n" broadcast block
+    MSG_DOC_REPLY,   // "VERSION n\nDOCUMENT (len bytes):\n<len bytes>" answer to DOC?
+    MSG_LOG_REPLY,   // "LOG (len bytes):\n<len bytes>" answer to LOG?
+    MSG_STATS_REPLY, // "STATS (len bytes):\n<len bytes>" answer to STATS?
+    MSG_REPLY        // Any other single line (command replies, rejects)
+} msg_type_t;
+
+typedef struct
+{
+    msg_type_t type;
+    unsigned long version;
+    char role[10];
+    char *text;   // VERSION block or reply line, or the body for SNAPSHOT/DOC_REPLY;
+    size_t len;   // NUL-terminated and valid until the next framer_next call
+} frame_t;
+
+// Incremental decoder for the server-to-client stream. Raw reads land in a
+// ring buffer; framer_next scans each byte once, carrying partial messages
+// across reads, and grows the message buffer to fit bodies of any size.
+typedef struct
+{
+    char *ring;
+    size_t cap;  // Ring capacity, a power of two
+    size_t rpos; // Total bytes consumed from the ring
+    size_t wpos; // Total bytes written into the ring
+    int state;
+    frame_t frame;     // Message being assembled
+    char *msg;         // Bytes of the message being assembled
+    size_t msg_len;
+    size_t msg_cap;
+    size_t line_start; // Offset in msg of the current header line
+    size_t body_start; // Offset in msg of the body
+    size_t body_left;  // Body bytes still to come
+} framer_t;
+
+int framer_init(framer_t *f, size_t cap);
+void framer_free(framer_t *f);
+ssize_t framer_fill(framer_t *f, int fd);
+int framer_next(framer_t *f, frame_t *out);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef ROLES_H
+#define ROLES_H
+
+// User roles from roles.txt: one "<username> <role>" per line, role being
+// "read" or "write". Leading, trailing and separating spaces and tabs are
+// ignored, as are blank lines; a malformed line is skipped with a warning.
+// The file is loaded into an open-addressing hash table that is rebuilt and
+// republished whenever the file changes, so lookups never take a lock and
+// never see a half-loaded table.
+int roles_init(const char *path);
+const char *roles_lookup(const char *username);
+
+#endif
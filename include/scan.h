@@ -0,0 +1,14 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+// Byte-scanning kernels for the hot loops over text: command validation
+// and newline counting and lookup in document chunks. Each has AVX2 and
+// SSE2 versions on x86, picked once at startup from what the CPU supports,
+// and a portable fallback.
+size_t scan_newlines(const char *p, size_t n);
+const char *scan_nth_newline(const char *p, size_t n, size_t k);
+size_t scan_printable(const char *p, size_t n);
+
+#endif
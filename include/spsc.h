@@ -0,0 +1,24 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Bounded lock-free single-producer/single-consumer queue of pointers.
+// One thread may push and one other thread may peek/pop concurrently.
+typedef struct
+{
+    _Atomic size_t head; // Next slot to pop (owned by the consumer)
+    _Atomic size_t tail; // Next slot to fill (owned by the producer)
+    size_t mask;         // Capacity - 1; capacity is a power of two
+    void **slots;
+} spsc_queue_t;
+
+int spsc_init(spsc_queue_t *q, size_t capacity);
+void spsc_destroy(spsc_queue_t *q);
+bool spsc_push(spsc_queue_t *q, void *item);
+void *spsc_peek(spsc_queue_t *q);
+void spsc_pop(spsc_queue_t *q);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hist.h"
+
+// Hot-path histograms, one per metric, each a hist_t of nanoseconds or
+// bytes. Every thread records into a block of its own, so recording shares
+// no cache line and takes no lock other threads want; readers merge all the
+// blocks. A block's histograms are allocated on first use, so a thread pays
+// only for the metrics it records, and the block of a thread that exits is
+// taken over, counts and all, by the next thread to record.
+typedef struct
+{
+    const char *name;
+    const char *unit; // Printed after each value: "ns" or "B"
+} stats_metric_t;
+
+int stats_init(const stats_metric_t *metrics, int count);
+void stats_record(int metric, uint64_t value);
+void stats_merge(int metric, hist_t *out);
+char *stats_report(size_t *len);
+int stats_dump(const char *path);
+
+#endif
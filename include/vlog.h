@@ -0,0 +1,71 @@
+#ifndef VLOG_H
+#define VLOG_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only history of every version's edits. Each version with edits is
+// one compact binary record (varint lengths, no text framing) appended to a
+// chain of fixed-size chunks, and indexed by version and offset. Heartbeats
+// only advance the last version, so an idle server's log does not grow.
+// Once more than a set number of bytes are resident, the oldest full chunks
+// are written to an unlinked spill file and freed; reads fetch them back
+// with pread. One thread appends; any number may read concurrently.
+typedef struct
+{
+    unsigned long version;
+    uint64_t offset; // Where its record starts
+    uint64_t text;   // Formatted bytes of the versions indexed up to this one
+} vlog_entry_t;
+
+typedef struct
+{
+    pthread_rwlock_t lock;  // Guards the chunk table and index, not the bytes
+    char **chunks;          // Chunk i holds log bytes [i * chunk, (i + 1) * chunk)
+    size_t nchunks;
+    size_t chunks_cap;
+    size_t spilled;         // Chunks [0, spilled) live only in the spill file
+    vlog_entry_t *index;    // Versions with edits, in order
+    size_t count;
+    size_t index_cap;
+    uint64_t end;           // Log bytes written
+    unsigned long first;    // First version logged
+    unsigned long last;     // Last version logged, or first - 1 if none yet
+    size_t memory_limit;    // Resident chunk bytes allowed before spilling
+    int spill_fd;
+} vlog_t;
+
+// One version's edits, built up before it is appended
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} vlog_record_t;
+
+// A reader's scratch space; reuse it across calls to avoid reallocating
+typedef struct
+{
+    char *raw;
+    size_t raw_cap;
+    char *text;       // Formatted block, valid until the next vlog_format
+    size_t text_len;
+    size_t text_cap;
+    size_t edits;     // EDIT lines in the block; 0 for a heartbeat
+} vlog_reader_t;
+
+int vlog_init(vlog_t *log, unsigned long first, size_t memory_limit);
+void vlog_destroy(vlog_t *log);
+void vlog_record_reset(vlog_record_t *rec);
+void vlog_record_add(vlog_record_t *rec, const char *user, const char *cmd, const char *result);
+void vlog_record_free(vlog_record_t *rec);
+void vlog_append(vlog_t *log, const vlog_record_t *rec, size_t length);
+unsigned long vlog_last(vlog_t *log);
+bool vlog_next(vlog_t *log, unsigned long *version);
+uint64_t vlog_text_size(vlog_t *log, unsigned long from, unsigned long to);
+bool vlog_format(vlog_t *log, unsigned long version, vlog_reader_t *r);
+void vlog_reader_free(vlog_reader_t *r);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "document.h"
+
+// Write-ahead log of applied edits. Each version that changed the document
+// becomes one record: the version number and its successful commands as
+// broadcast, so replaying a record is replaying the version block. Records
+// are framed by length and CRC-32, and a version's record is written and
+// fdatasync'd in one go before the version is broadcast.
+//
+// A checkpoint writes the whole document to a snapshot file and then empties
+// the log, so recovery loads the snapshot and replays only what came after.
+typedef struct
+{
+    int fd;
+    char *buf;        // Record being built for the current version
+    size_t len;
+    size_t cap;
+    size_t edits;     // Commands in the record being built
+    size_t size;      // Bytes in the log file
+    bool failed;      // A failed commit could not be rolled back
+    const char *path;
+    const char *checkpoint_path;
+} wal_t;
+
+int wal_recover(const char *path, const char *checkpoint_path, document_t *doc, unsigned long *version);
+int wal_open(wal_t *w, const char *path, const char *checkpoint_path);
+void wal_close(wal_t *w);
+void wal_add(wal_t *w, const char *cmd);
+int wal_commit(wal_t *w, unsigned long version);
+int wal_checkpoint(wal_t *w, unsigned long version, const char *data, size_t len);
+int wal_clear(wal_t *w);
+int wal_save(const char *path, const char *data, size_t len);
+
+#endif
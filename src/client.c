@@ -5,147 +5,499 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
-#include <pthread.h>
+#include <poll.h>
 #include <errno.h>
+#include <time.h>
 #include "client.h"
+#include "document.h"
+#include "command.h"
+#include "protocol.h"
+#include "scan.h"
 
 // Define real-time signals if not available
 #ifndef SIGRTMIN
 #define SIGRTMIN 34
 #endif
 
-// Structure to share data between threads
+// Connection state for the client event loop
 typedef struct
 {
     int fd_s2c;            // Server to client file descriptor
     int fd_c2s;            // Client to server file descriptor
-    int should_exit;       // Flag to indicate reader thread should exit
     char username[64];     // Username for this client
     char role[10];         // Role (read/write)
-    char document[4096];   // Current document content
+    document_t *doc;       // Local replica, kept current by replaying EDITs
     unsigned long version; // Current document version
+    int resyncing;         // Waiting for a full snapshot after divergence
+    framer_t framer;       // Decoder for the server-to-client stream
+    posmap_t map;          // Positions of the version block being replayed
 } client_data_t;
 
-// Reader thread function declaration
-void *reader_thread(void *arg);
+// Clear the screen and show the replica under a banner line
+static void show_document(client_data_t *data, const char *banner)
+{
+    const doc_snapshot_t *snap = document_snapshot(data->doc);
+    printf("\033[2J\033[H"); // Clear screen and move cursor to top-left
+    printf("--- %s ---\n", banner);
+    printf("%s\n", snap->data);
+    printf("> "); // Reprint prompt
+    fflush(stdout);
+    document_snapshot_release(snap);
+}
+
+// Ask the server for a full snapshot once the replica can no longer be trusted
+static void request_sync(client_data_t *data)
+{
+    if (data->resyncing)
+        return;
+    data->resyncing = 1;
+    write(data->fd_c2s, "SYNC?\n", 6);
+}
 
-#define MAX_CLIENTS 10
+// Replace the replica with a full snapshot from the server
+static void load_snapshot(client_data_t *data, const frame_t *frame)
+{
+    strncpy(data->role, frame->role, sizeof(data->role) - 1);
+    document_free(data->doc);
+    data->doc = document_create();
+    document_insert(data->doc, 0, frame->text);
+    data->version = frame->version;
+    data->resyncing = 0;
+}
 
-// Reader thread function that continuously checks for messages from the server
-void *reader_thread(void *arg)
+// Replay one "EDIT <user> <command> <result>" line against the replica.
+// Returns 0 if it applied (or was a rejected edit), -1 if the replica diverged.
+static int replay_edit(client_data_t *data, const char *line)
 {
-    client_data_t *data = (client_data_t *)arg;
-    char buf[4096];
+    const char *command = strchr(line + 5, ' '); // Skip "EDIT <user>"
+    if (!command)
+        return -1;
+    command++;
+
+    const char *result = strrchr(command, ' ');
+    if (!result || strcmp(result, " SUCCESS") != 0)
+        return 0;
+
+    char cmd[256];
+    size_t cmd_len = result - command;
+    if (cmd_len >= sizeof(cmd))
+        return -1;
+    memcpy(cmd, command, cmd_len);
+    cmd[cmd_len] = '\0';
+
+    command_t edit;
+    char response[128];
+    if (!command_parse(cmd, &edit) || !command_apply(data->doc, &data->map, &edit, response, sizeof(response)))
+        return -1;
+    return 0;
+}
 
-    // Set the file descriptor to non-blocking mode
-    int flags = fcntl(data->fd_s2c, F_GETFL, 0);
-    fcntl(data->fd_s2c, F_SETFL, flags | O_NONBLOCK);
+// Apply a NUL-terminated "VERSION n\n...END\n" block to the replica
+static void apply_version_block(client_data_t *data, char *block)
+{
+    unsigned long new_version = 0;
+    sscanf(block, "VERSION %lu", &new_version);
 
-    while (!data->should_exit)
+    // Stale, or superseded by the snapshot already requested
+    if (data->resyncing || new_version <= data->version)
+        return;
+    if (new_version != data->version + 1)
     {
-        ssize_t n = read(data->fd_s2c, buf, sizeof(buf) - 1);
+        request_sync(data);
+        return;
+    }
+
+    // Every EDIT in the block targets the version before it
+    posmap_reset(&data->map, data->doc->length);
 
-        if (n > 0)
+    char banner[300] = "";
+    int diverged = 0;
+    int edits = 0;
+    size_t length;
+    char *saveptr;
+    for (char *line = strtok_r(block, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr))
+    {
+        if (strncmp(line, "EDIT ", 5) == 0)
+        {
+            if (replay_edit(data, line) < 0)
+                diverged = 1;
+            // A version may batch several edits; name the edit only when alone
+            if (++edits == 1)
+                snprintf(banner, sizeof(banner), "Document updated: %s", line);
+            else
+                snprintf(banner, sizeof(banner), "Document updated: %d edits (Version %lu)", edits, new_version);
+        }
+        else if (sscanf(line, "LENGTH %zu", &length) == 1 && length != data->doc->length)
         {
-            buf[n] = '\0';
+            diverged = 1;
+        }
+    }
+
+    if (diverged)
+    {
+        request_sync(data);
+        return;
+    }
+    data->version = new_version;
+
+    // A bare heartbeat only moves the version on; nothing to redraw
+    if (edits > 0)
+        show_document(data, banner);
+}
+
+// Handle one decoded message from the server
+static void handle_frame(client_data_t *data, frame_t *frame)
+{
+    switch (frame->type)
+    {
+    case MSG_VERSION:
+        apply_version_block(data, frame->text);
+        break;
+
+    case MSG_SNAPSHOT:
+    {
+        // Full snapshot answering SYNC?
+        load_snapshot(data, frame);
+        char banner[64];
+        snprintf(banner, sizeof(banner), "Resynchronised (Version %lu)", data->version);
+        show_document(data, banner);
+        break;
+    }
 
-            // Check if this is an auto update
-            if (strstr(buf, "AUTO_UPDATE") != NULL)
+    case MSG_DOC_REPLY:
+        printf("\nVERSION %lu\nDOCUMENT (%zu bytes):\n%s\n> ", frame->version, frame->len, frame->text);
+        fflush(stdout);
+        break;
+
+    case MSG_LOG_REPLY:
+        // Version history: the blocks as they were broadcast
+        printf("\nLOG (%zu bytes):\n%s\n> ", frame->len, frame->text);
+        fflush(stdout);
+        break;
+
+    case MSG_STATS_REPLY:
+        // Server counters and latency histograms
+        printf("\nSTATS (%zu bytes):\n%s\n> ", frame->len, frame->text);
+        fflush(stdout);
+        break;
+
+    case MSG_REPLY:
+        // Regular response to a command
+        printf("\n%s\n> ", frame->text);
+        fflush(stdout);
+        break;
+    }
+}
+
+// Decode and handle every complete message buffered so far
+static int drain_frames(client_data_t *data)
+{
+    frame_t frame;
+    int r;
+    while ((r = framer_next(&data->framer, &frame)) == 1)
+        handle_frame(data, &frame);
+    return r;
+}
+
+// Send every complete line buffered from stdin as its own command.
+// Returns -1 once the user asks to quit.
+static int send_input_lines(client_data_t *data, char *input, size_t *input_len)
+{
+    size_t start = 0;
+    while (start < *input_len)
+    {
+        char *nl = memchr(input + start, '\n', *input_len - start);
+        size_t len;
+        if (nl)
+            len = nl - (input + start) + 1;
+        else if (*input_len - start >= COMMAND_MAX - 1)
+            len = COMMAND_MAX - 1; // Overlong line: sent in pieces, refused whole
+        else
+            break;
+
+        char *cmd = input + start;
+        start += len;
+
+        // Check for quit command
+        if (cmd[0] == 'q' && (len == 1 || cmd[1] == '\n'))
+            return -1;
+
+        // Send command to server
+        write(data->fd_c2s, cmd, len);
+        printf("> ");
+        fflush(stdout);
+    }
+    memmove(input, input + start, *input_len - start);
+    *input_len -= start;
+    return 0;
+}
+
+// Wait on the server FIFO and stdin together and handle whichever is ready,
+// so updates render as soon as they arrive and input is sent immediately
+static void event_loop(client_data_t *data)
+{
+    char input[4096];
+    size_t input_len = 0;
+    struct pollfd fds[2] = {
+        {.fd = data->fd_s2c, .events = POLLIN},
+        {.fd = STDIN_FILENO, .events = POLLIN},
+    };
+
+    while (1)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t n = framer_fill(&data->framer, data->fd_s2c);
+            if (n <= 0)
             {
-                // Parse version and document
-                char *version_str = strstr(buf, "VERSION ");
-                unsigned long new_version = 0;
+                if (n < 0)
+                    perror("Error reading from server");
+                else
+                    printf("\nServer closed the connection.\n");
+                return;
+            }
+            if (drain_frames(data) < 0)
+            {
+                perror("Failed to decode server message");
+                return;
+            }
+        }
 
-                if (version_str)
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t n = read(STDIN_FILENO, input + input_len, sizeof(input) - input_len);
+            if (n <= 0)
+            {
+                // End of input: flush a final unterminated line, then quit
+                if (input_len > 0 && input_len < sizeof(input))
                 {
-                    sscanf(version_str, "VERSION %lu", &new_version);
-
-                    // Only process if this is a newer version
-                    if (new_version > data->version)
-                    {
-                        data->version = new_version;
-
-                        // Extract document
-                        char *doc_start = strstr(buf, "\nEND\n");
-                        if (doc_start)
-                        {
-                            // Skip past "END" to get to document content
-                            doc_start += 5;
-
-                            // Clear screen and show updated document
-                            printf("\033[2J\033[H"); // Clear screen and move cursor to top-left
-                            printf("--- Automatic update received (Version %lu) ---\n", new_version);
-                            printf("%s\n", doc_start);
-                            printf("> "); // Reprint prompt
-                            fflush(stdout);
-                        }
-                    }
+                    input[input_len++] = '\n';
+                    send_input_lines(data, input, &input_len);
                 }
+                return;
             }
-            else if (strstr(buf, "EDIT") != NULL)
+            input_len += n;
+            if (send_input_lines(data, input, &input_len) < 0)
+                return;
+        }
+    }
+}
+
+// Batch mode: a script of commands streamed to the server in large writes,
+// for bulk imports. The server takes any number of commands per read, so
+// the script goes out as it is read, in BATCH_CHUNK pieces cut after the
+// last newline so that commands can be counted. The server's output is read
+// meanwhile, so neither side waits on a full FIFO. A PERM? after the script
+// marks its end: once its reply is in, every command in the script has been
+// executed, and two versions later every edit in it has been applied.
+#define BATCH_CHUNK 65536
+
+typedef struct
+{
+    size_t commands;       // Lines sent from the script
+    size_t bytes;          // Bytes sent from the script
+    size_t perms;          // PERM? lines among them, each with its own reply
+    size_t perm_replies;   // PERMISSIONS replies seen so far
+    int versions_after;    // Versions since the reply to the closing PERM?
+    size_t rejected;       // Replies and own edits that were refused
+    unsigned long version; // Last version seen
+} batch_t;
+
+// Count the script's commands in a chunk of whole lines
+static void batch_count(batch_t *b, const char *p, size_t n)
+{
+    b->commands += scan_newlines(p, n);
+    b->bytes += n;
+    for (const char *end = p + n, *nl; p < end && (nl = memchr(p, '\n', end - p)); p = nl + 1)
+        if (nl - p == 5 && memcmp(p, "PERM?", 5) == 0)
+            b->perms++;
+}
+
+// Tally one message from the server; nothing is displayed but refusals
+static void batch_frame(client_data_t *data, batch_t *b, frame_t *frame)
+{
+    if (frame->type == MSG_VERSION)
+    {
+        sscanf(frame->text, "VERSION %lu", &b->version);
+        if (b->perm_replies > b->perms)
+            b->versions_after++;
+        // Own edits the server refused: "EDIT <user> <command> Reject ..."
+        char prefix[80];
+        int prefix_len = snprintf(prefix, sizeof(prefix), "EDIT %s ", data->username);
+        char *saveptr;
+        for (char *line = strtok_r(frame->text, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr))
+        {
+            size_t len = strlen(line);
+            if (strncmp(line, prefix, prefix_len) == 0 && (len < 8 || strcmp(line + len - 8, " SUCCESS") != 0))
             {
-                // This is an edit broadcast
-                char *version_str = strstr(buf, "VERSION ");
-                unsigned long new_version = 0;
+                printf("%s\n", line);
+                b->rejected++;
+            }
+        }
+    }
+    else if (frame->type == MSG_SNAPSHOT)
+    {
+        b->version = frame->version;
+    }
+    else if (frame->type == MSG_REPLY)
+    {
+        if (strncmp(frame->text, "PERMISSIONS ", 12) == 0)
+        {
+            b->perm_replies++;
+        }
+        else
+        {
+            printf("%s\n", frame->text);
+            if (strncmp(frame->text, "Reject", 6) == 0)
+                b->rejected++;
+        }
+    }
+}
 
-                if (version_str)
-                {
-                    sscanf(version_str, "VERSION %lu", &new_version);
-
-                    // Extract edit info and document
-                    char *edit_info = strstr(buf, "EDIT ");
-                    char *doc_start = strstr(buf, "\nEND\n");
-
-                    if (edit_info && doc_start && new_version > data->version)
-                    {
-                        data->version = new_version;
-
-                        // Skip past "END" to get to document content
-                        doc_start += 5;
-
-                        // Calculate length of edit info
-                        size_t edit_len = (doc_start - edit_info) - 5; // -5 for "\nEND\n"
-                        char edit_details[256] = {0};
-                        strncpy(edit_details, edit_info, edit_len > 255 ? 255 : edit_len);
-
-                        // Clear screen and show updated document
-                        printf("\033[2J\033[H"); // Clear screen and move cursor to top-left
-                        printf("--- Document updated: %s ---\n", edit_details);
-                        printf("%s\n", doc_start);
-                        printf("> "); // Reprint prompt
-                        fflush(stdout);
-                    }
-                }
+static double monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int batch_run(client_data_t *data, const char *path)
+{
+    int script = open(path, O_RDONLY | O_CLOEXEC);
+    if (script < 0)
+    {
+        perror("Failed to open script");
+        return -1;
+    }
+    fcntl(data->fd_c2s, F_SETFL, fcntl(data->fd_c2s, F_GETFL) | O_NONBLOCK);
+
+    static char chunk[BATCH_CHUNK];
+    size_t fill = 0;  // Bytes in chunk
+    size_t ready = 0; // Bytes of those that are whole lines, to send
+    size_t off = 0;   // Bytes of those sent
+    bool script_done = false, marked = false;
+    batch_t b = {.version = data->version};
+    struct pollfd fds[2] = {
+        {.fd = data->fd_s2c, .events = POLLIN},
+        {.fd = data->fd_c2s, .events = POLLOUT},
+    };
+    double start = monotonic_seconds();
+    int rc = 0;
+
+    while (b.versions_after < 2)
+    {
+        // Refill once the last chunk has gone, carrying its partial line
+        while (off == ready && !marked)
+        {
+            memmove(chunk, chunk + ready, fill - ready);
+            fill -= ready;
+            off = ready = 0;
+            if (script_done)
+            {
+                // Led by a newline, which the server skips, in case the
+                // script ended in a line too long to terminate
+                memcpy(chunk, "\nPERM?\n", 7);
+                fill = ready = 7;
+                marked = true;
+                break;
+            }
+            ssize_t n = read(script, chunk + fill, sizeof(chunk) - fill);
+            if (n < 0)
+            {
+                perror("Failed to read script");
+                rc = -1;
+                goto done;
+            }
+            fill += n;
+            if (n == 0)
+            {
+                // A final unterminated line is still a command
+                script_done = true;
+                if (fill > 0 && fill < sizeof(chunk))
+                    chunk[fill++] = '\n';
+                ready = fill;
             }
             else
             {
-                // Regular response to a command
-                printf("\n%s\n> ", buf);
-                fflush(stdout);
+                // A line longer than a chunk goes out as is, to be refused
+                const char *nl = memrchr(chunk, '\n', fill);
+                ready = nl ? (size_t)(nl - chunk) + 1 : fill == sizeof(chunk) ? fill : 0;
             }
+            batch_count(&b, chunk, ready);
         }
-        else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+
+        fds[1].fd = off < ready ? data->fd_c2s : -1; // Nothing to send: poll skips it
+        if (poll(fds, 2, -1) < 0)
         {
-            // Real error occurred
-            perror("Error reading from server");
-            data->should_exit = 1;
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            rc = -1;
+            goto done;
         }
 
-        // Sleep briefly to avoid busy waiting
-        usleep(100000); // 100ms
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t n = framer_fill(&data->framer, data->fd_s2c);
+            if (n <= 0)
+            {
+                printf("\nServer closed the connection.\n");
+                rc = -1;
+                goto done;
+            }
+            frame_t frame;
+            int r;
+            while ((r = framer_next(&data->framer, &frame)) == 1)
+                batch_frame(data, &b, &frame);
+            if (r < 0)
+            {
+                perror("Failed to decode server message");
+                rc = -1;
+                goto done;
+            }
+        }
+
+        if (fds[1].revents & (POLLOUT | POLLERR | POLLHUP))
+        {
+            ssize_t n = write(data->fd_c2s, chunk + off, ready - off);
+            if (n < 0 && errno != EAGAIN)
+            {
+                perror("Failed to send commands");
+                rc = -1;
+                goto done;
+            }
+            if (n > 0)
+                off += n;
+        }
     }
 
-    return NULL;
+    double elapsed = monotonic_seconds() - start;
+    printf("Sent %zu commands (%zu bytes) in %.3f s: %.0f commands/s, %zu refused, now at version %lu\n",
+           b.commands, b.bytes, elapsed, b.commands / elapsed, b.rejected, b.version);
+done:
+    close(script);
+    return rc;
 }
 
-int connect_to_server(pid_t server_pid, const char *username)
+int connect_to_server(pid_t server_pid, const char *username, const char *script)
 {
     printf("Client PID from client app: %d\n", getpid());
-    kill(server_pid, SIGRTMIN);
+
+    // Block SIGRTMIN+1 before asking to connect: the server may answer
+    // before kill returns, and the default action would end the process
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGRTMIN + 1);
-    sigprocmask(SIG_BLOCK, &set, NULL); // Block SIGRTMIN+1 before sigwait
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    kill(server_pid, SIGRTMIN);
     int sig;
     sigwait(&set, &sig);
 
@@ -155,8 +507,8 @@ int connect_to_server(pid_t server_pid, const char *username)
 
     printf("Client PID: %d\n", getpid());
 
-    // Give the server some time to create the FIFOs
-    // Add retry mechanism with timeout to open the FIFOs
+    // The server creates the FIFOs before signalling, so the first open
+    // normally succeeds; retry in case they are not there yet
     int retry = 0;
     const int max_retries = 5;
     int fd_s2c = -1;
@@ -190,103 +542,98 @@ int connect_to_server(pid_t server_pid, const char *username)
     client_data_t client_data = {0};
     client_data.fd_s2c = fd_s2c;
     client_data.fd_c2s = fd_c2s;
-    client_data.should_exit = 0;
     client_data.version = 0;
+    client_data.doc = document_create();
+    posmap_init(&client_data.map);
+    if (framer_init(&client_data.framer, 65536) < 0)
+    {
+        perror("Failed to allocate receive buffer");
+        close(fd_c2s);
+        close(fd_s2c);
+        return -1;
+    }
     strncpy(client_data.username, username, sizeof(client_data.username) - 1);
 
-    write(fd_c2s, username, strlen(username));
-    write(fd_c2s, "\n", 1);
+    // Username and newline in one write, so the server reads them together
+    char hello[80];
+    int hello_len = snprintf(hello, sizeof(hello), "%s\n", username);
+    write(fd_c2s, hello, hello_len);
+
+    // Wait for the first complete message: a snapshot, or a rejection
+    frame_t frame;
+    int got = 0, rc = 0;
+    while (got == 0 && framer_fill(&client_data.framer, fd_s2c) > 0)
+        got = framer_next(&client_data.framer, &frame);
 
-    char buf[4096];
-    ssize_t n = read(fd_s2c, buf, sizeof(buf) - 1);
-    if (n > 0)
+    if (got != 1)
+    {
+        printf("Failed to read from server.\n");
+    }
+    else if (frame.type != MSG_SNAPSHOT)
     {
-        buf[n] = '\0';
         // Parse the server response
-        if (strncmp(buf, "Reject", 6) == 0)
+        printf("Server response: %s\n", frame.text);
+    }
+    else
+    {
+        load_snapshot(&client_data, &frame);
+
+        // Print initial document info
+        printf("Connected as: %s\n", username);
+        printf("Role: %s\n", client_data.role);
+        printf("Document version: %lu\n", client_data.version);
+        if (script)
         {
-            printf("Server response: %s", buf);
+            // Anything that arrived behind the snapshot is tallied with the rest
+            printf("Document: %zu bytes\n", frame.len);
+            rc = batch_run(&client_data, script);
         }
         else
         {
-            // Expecting: role\nversion\ndoclen\ndocument
-            char *saveptr;
-            char *role = strtok_r(buf, "\n", &saveptr);
-            char *version_str = strtok_r(NULL, "\n", &saveptr);
-            char *doclen = strtok_r(NULL, "\n", &saveptr);
-            char *document = saveptr;
-            if (role && version_str && doclen && document)
-            {
-                // Store initial document info
-                strncpy(client_data.role, role, sizeof(client_data.role) - 1);
-                client_data.version = strtol(version_str, NULL, 10);
-                strncpy(client_data.document, document, sizeof(client_data.document) - 1);
-
-                // Print initial document info
-                printf("Connected as: %s\n", username);
-                printf("Role: %s\n", role);
-                printf("Document version: %s\n", version_str);
-                printf("Document (%s bytes):\n%s\n", doclen, document);
-
-                // Start reader thread to handle automatic updates
-                pthread_t reader_tid;
-                if (pthread_create(&reader_tid, NULL, reader_thread, &client_data) != 0)
-                {
-                    perror("Failed to create reader thread");
-                    close(fd_c2s);
-                    close(fd_s2c);
-                    return -1;
-                }
-
-                // Start command processing loop
-                char cmd[256];
-                printf("\nEnter commands (q to quit):\n> ");
-                while (fgets(cmd, sizeof(cmd), stdin))
-                {
-                    // Check for quit command
-                    if (cmd[0] == 'q' && (cmd[1] == '\n' || cmd[1] == '\0'))
-                        break;
-
-                    // Send command to server
-                    write(fd_c2s, cmd, strlen(cmd));
+            printf("Document (%zu bytes):\n%s\n", frame.len, frame.text);
 
-                    // Brief pause to let the reader thread receive the response
-                    usleep(100000); // 100ms
+            // Anything that arrived behind the snapshot
+            drain_frames(&client_data);
 
-                    printf("> ");
-                }
-
-                // Signal reader thread to exit and wait for it
-                client_data.should_exit = 1;
-                pthread_join(reader_tid, NULL);
-            }
-            else
-            {
-                // Fallback: print raw
-                printf("%s", buf);
-            }
+            // Start command processing loop
+            printf("\nEnter commands (q to quit):\n> ");
+            fflush(stdout);
+            event_loop(&client_data);
         }
     }
-    else
-    {
-        printf("Failed to read from server.\n");
-    }
 
     // Close connection
+    framer_free(&client_data.framer);
+    posmap_free(&client_data.map);
+    document_free(client_data.doc);
     close(fd_c2s);
     close(fd_s2c);
     unlink(fifo_c2s);
     unlink(fifo_s2c);
-    return 0;
+    return rc;
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 3)
+    // -b SCRIPT sends the commands in SCRIPT instead of reading stdin
+    const char *script = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:")) != -1)
     {
-        fprintf(stderr, "Usage: %s <server_pid> <username>\n", argv[0]);
+        if (opt == 'b')
+        {
+            script = optarg;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-b SCRIPT] <server_pid> <username>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        fprintf(stderr, "Usage: %s [-b SCRIPT] <server_pid> <username>\n", argv[0]);
         exit(1);
     }
-    connect_to_server(atoi(argv[1]), argv[2]);
-    return 0;
+    return connect_to_server(atoi(argv[optind]), argv[optind + 1], script) < 0 ? 1 : 0;
 }
\ No newline at end of file
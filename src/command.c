@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <string.h>
+#include "command.h"
+
+// Classify a command line by its keyword alone
+command_type_t command_type(const char *cmd)
+{
+    if (strncmp(cmd, "i ", 2) == 0)
+        return CMD_INSERT;
+    if (strncmp(cmd, "d ", 2) == 0)
+        return CMD_DELETE;
+    if (strncmp(cmd, "BOLD ", 5) == 0)
+        return CMD_BOLD;
+    if (strncmp(cmd, "ITALIC ", 7) == 0)
+        return CMD_ITALIC;
+    if (strncmp(cmd, "HEADING ", 8) == 0)
+        return CMD_HEADING;
+    if (strncmp(cmd, "LIST ", 5) == 0)
+        return CMD_LIST;
+    if (strncmp(cmd, "CODE ", 5) == 0)
+        return CMD_CODE;
+    if (strncmp(cmd, "LINK ", 5) == 0)
+        return CMD_LINK;
+    if (strncmp(cmd, "NEWLINE ", 8) == 0)
+        return CMD_NEWLINE;
+    if (strncmp(cmd, "BLOCKQUOTE ", 11) == 0)
+        return CMD_BLOCKQUOTE;
+    if (strncmp(cmd, "ORDERED_LIST ", 13) == 0)
+        return CMD_ORDERED_LIST;
+    if (strncmp(cmd, "UNORDERED_LIST ", 15) == 0)
+        return CMD_UNORDERED_LIST;
+    if (strncmp(cmd, "HORIZONTAL_RULE ", 16) == 0)
+        return CMD_HORIZONTAL_RULE;
+    return CMD_NONE;
+}
+
+// Name used in Reject messages
+const char *command_name(command_type_t type)
+{
+    switch (type)
+    {
+    case CMD_INSERT:
+        return "INSERT";
+    case CMD_DELETE:
+        return "DELETE";
+    case CMD_BOLD:
+        return "BOLD";
+    case CMD_ITALIC:
+        return "ITALIC";
+    case CMD_HEADING:
+        return "HEADING";
+    case CMD_LIST:
+        return "LIST";
+    case CMD_CODE:
+        return "CODE";
+    case CMD_LINK:
+        return "LINK";
+    case CMD_NEWLINE:
+        return "NEWLINE";
+    case CMD_BLOCKQUOTE:
+        return "BLOCKQUOTE";
+    case CMD_ORDERED_LIST:
+        return "ORDERED_LIST";
+    case CMD_UNORDERED_LIST:
+        return "UNORDERED_LIST";
+    case CMD_HORIZONTAL_RULE:
+        return "HORIZONTAL_RULE";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+// Parse an editing command; false if it is not one or its arguments are malformed
+bool command_parse(const char *cmd, command_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->type = command_type(cmd);
+    switch (out->type)
+    {
+    case CMD_INSERT:
+        return sscanf(cmd, "i %d %255[^\n]", &out->pos, out->text) == 2;
+    case CMD_DELETE:
+        return sscanf(cmd, "d %d %d", &out->pos, &out->len) == 2;
+    case CMD_BOLD:
+        return sscanf(cmd, "BOLD %d %d", &out->pos, &out->len) == 2;
+    case CMD_ITALIC:
+        return sscanf(cmd, "ITALIC %d %d", &out->pos, &out->len) == 2;
+    case CMD_HEADING:
+        // A trailing length from the older range form is accepted and ignored
+        return sscanf(cmd, "HEADING %d %d %d", &out->level, &out->pos, &out->len) >= 2;
+    case CMD_LIST:
+        return sscanf(cmd, "LIST %c %d %d", &out->list_type, &out->pos, &out->len) == 3;
+    case CMD_CODE:
+        return sscanf(cmd, "CODE %d %d", &out->pos, &out->len) == 2;
+    case CMD_LINK:
+        return sscanf(cmd, "LINK %d %d %255s", &out->pos, &out->len, out->text) == 3;
+    case CMD_NEWLINE:
+        return sscanf(cmd, "NEWLINE %d", &out->pos) == 1;
+    case CMD_BLOCKQUOTE:
+        return sscanf(cmd, "BLOCKQUOTE %d", &out->pos) == 1;
+    case CMD_ORDERED_LIST:
+        return sscanf(cmd, "ORDERED_LIST %d", &out->pos) == 1;
+    case CMD_UNORDERED_LIST:
+        return sscanf(cmd, "UNORDERED_LIST %d", &out->pos) == 1;
+    case CMD_HORIZONTAL_RULE:
+        return sscanf(cmd, "HORIZONTAL_RULE %d", &out->pos) == 1;
+    default:
+        return false;
+    }
+}
+
+// Write an editing command back out in the form command_parse reads
+int command_format(const command_t *c, char *buf, size_t size)
+{
+    switch (c->type)
+    {
+    case CMD_INSERT:
+        return snprintf(buf, size, "i %d %s", c->pos, c->text);
+    case CMD_DELETE:
+        return snprintf(buf, size, "d %d %d", c->pos, c->len);
+    case CMD_BOLD:
+        return snprintf(buf, size, "BOLD %d %d", c->pos, c->len);
+    case CMD_ITALIC:
+        return snprintf(buf, size, "ITALIC %d %d", c->pos, c->len);
+    case CMD_HEADING:
+        return snprintf(buf, size, "HEADING %d %d", c->level, c->pos);
+    case CMD_LIST:
+        return snprintf(buf, size, "LIST %c %d %d", c->list_type, c->pos, c->len);
+    case CMD_CODE:
+        return snprintf(buf, size, "CODE %d %d", c->pos, c->len);
+    case CMD_LINK:
+        return snprintf(buf, size, "LINK %d %d %s", c->pos, c->len, c->text);
+    case CMD_NEWLINE:
+    case CMD_BLOCKQUOTE:
+    case CMD_ORDERED_LIST:
+    case CMD_UNORDERED_LIST:
+    case CMD_HORIZONTAL_RULE:
+        return snprintf(buf, size, "%s %d", command_name(c->type), c->pos);
+    default:
+        return snprintf(buf, size, "%s", "");
+    }
+}
+
+// Check c's positions against the base document. Single-cursor commands may
+// sit at the end; ranges must lie within it.
+static bool check_bounds(const posmap_t *map, const command_t *c)
+{
+    int base_len = (int)map->base_len;
+    switch (c->type)
+    {
+    case CMD_INSERT:
+    case CMD_HEADING:
+    case CMD_NEWLINE:
+    case CMD_BLOCKQUOTE:
+    case CMD_ORDERED_LIST:
+    case CMD_UNORDERED_LIST:
+    case CMD_HORIZONTAL_RULE:
+        return c->pos >= 0 && c->pos <= base_len;
+    case CMD_DELETE:
+        return c->pos >= 0 && c->pos < base_len && c->len >= 0;
+    case CMD_LIST:
+        return c->pos >= 0 && c->pos < base_len;
+    default:
+        return c->pos >= 0 && c->pos < base_len && c->len >= 0 && c->pos + c->len <= base_len;
+    }
+}
+
+// A single base cursor inside deleted text moves to where the deletion began
+static size_t resolve_cursor(const posmap_t *map, size_t pos)
+{
+    size_t start, end;
+    if (posmap_deleted(map, pos, &start, &end))
+        return start;
+    return pos;
+}
+
+// Resolve the base cursor range [*from, *to) against text already deleted in
+// this version: an end inside deleted text snaps to the deleted edge nearer
+// the other end, and a range with both ends deleted is rejected.
+static bool resolve_range(const posmap_t *map, size_t *from, size_t *to, char *response, size_t resp_size)
+{
+    size_t from_start, from_end, to_start, to_end;
+    bool from_deleted = posmap_deleted(map, *from, &from_start, &from_end);
+    bool to_deleted = posmap_deleted(map, *to, &to_start, &to_end);
+    if (from_deleted && to_deleted)
+    {
+        snprintf(response, resp_size, "Reject DELETED_POSITION");
+        return false;
+    }
+    if (from_deleted)
+        *from = from_end;
+    if (to_deleted)
+        *to = to_start;
+    return true;
+}
+
+// Insert text at base cursor pos, recording it in the map
+static void insert_at(document_t *doc, posmap_t *map, size_t pos, const char *text, piece_kind_t kind)
+{
+    size_t cur = posmap_translate(map, pos);
+    document_insert(doc, cur, text);
+    posmap_insert(map, cur, strlen(text), kind, pos);
+}
+
+// Wrap the base range [from, to) in prefix and suffix
+static void wrap_range(document_t *doc, posmap_t *map, size_t from, size_t to, const char *prefix, const char *suffix)
+{
+    size_t cur_from = posmap_translate(map, from);
+    size_t cur_to = posmap_translate(map, to);
+    document_wrap(doc, cur_from, cur_to, prefix, suffix);
+    posmap_insert(map, cur_to, strlen(suffix), PIECE_SUFFIX, to);
+    posmap_insert(map, cur_from, strlen(prefix), PIECE_PREFIX, from);
+}
+
+static void delete_range(document_t *doc, posmap_t *map, size_t from, size_t to)
+{
+    posmap_delete(map, from, to);
+    for (size_t i = map->ncuts; i-- > 0;)
+        document_delete(doc, map->cuts[i].start, map->cuts[i].end - map->cuts[i].start);
+}
+
+// Insert a block-level marker at base cursor pos. A newline goes in front
+// unless the cursor already starts a line, and one after it if asked for and
+// the next character is not already one. Returns the current offset of the
+// line the marker starts.
+static size_t insert_block(document_t *doc, posmap_t *map, size_t pos, const char *marker, bool newline_after)
+{
+    size_t cur = posmap_translate(map, pos);
+    char prev = '\n', next = '\0';
+    if (cur > 0)
+        document_read(doc, cur - 1, &prev, 1);
+    document_read(doc, cur, &next, 1);
+
+    char text[32];
+    snprintf(text, sizeof(text), "%s%s%s", prev != '\n' ? "\n" : "", marker,
+             newline_after && next != '\n' ? "\n" : "");
+    document_insert(doc, cur, text);
+    posmap_insert(map, cur, strlen(text), PIECE_PREFIX, pos);
+    return prev != '\n' ? cur + 1 : cur;
+}
+
+// Number of the ordered-list item on a line ("N. ..."), or 0 if it is not one
+static int item_number(document_t *doc, size_t line)
+{
+    char head[16];
+    size_t n = document_read(doc, document_line_start(doc, line), head, sizeof(head) - 1);
+    head[n] = '\0';
+    int number = 0, digits = 0;
+    while (digits < (int)n && head[digits] >= '0' && head[digits] <= '9')
+        number = number * 10 + (head[digits++] - '0');
+    if (digits == 0 || head[digits] != '.' || head[digits + 1] != ' ')
+        return 0;
+    return number;
+}
+
+// Rewrite the number of the item on a line to number, which is never
+// narrower than the current one
+static void set_item_number(document_t *doc, posmap_t *map, size_t line, int old, int number)
+{
+    char digits[16], old_digits[16];
+    int width = snprintf(digits, sizeof(digits), "%d", number);
+    int old_width = snprintf(old_digits, sizeof(old_digits), "%d", old);
+    size_t start = document_line_start(doc, line);
+
+    // Only a change in width moves positions
+    if (width > old_width)
+        posmap_insert(map, start, width - old_width, PIECE_PREFIX, posmap_anchor(map, start));
+    document_delete(doc, start, old_width);
+    document_insert(doc, start, digits);
+}
+
+// Start an ordered-list item at base cursor pos, numbered after the item on
+// the line above, and renumber the rest of the run it joins. A line that is
+// already an item is refused rather than given a second number.
+static bool apply_ordered_list(document_t *doc, posmap_t *map, size_t pos, char *response, size_t resp_size)
+{
+    size_t cur = posmap_translate(map, pos);
+    size_t line = document_line_at(doc, cur);
+    if (cur != document_line_start(doc, line))
+        line++; // The item will start a new line after the cursor
+    else if (item_number(doc, line) > 0)
+    {
+        snprintf(response, resp_size, "Reject ALREADY_LIST_ITEM");
+        return false;
+    }
+    int number = line > 0 ? item_number(doc, line - 1) + 1 : 1;
+
+    char marker[16];
+    snprintf(marker, sizeof(marker), "%d. ", number);
+    insert_block(doc, map, pos, marker, false);
+
+    size_t lines = document_line_count(doc);
+    for (size_t l = line + 1; l < lines; l++)
+    {
+        int old = item_number(doc, l);
+        if (old == 0)
+            break;
+        set_item_number(doc, map, l, old, old + 1);
+    }
+    return true;
+}
+
+// LIST type pos count: mark count lines, starting with the one holding pos
+static bool apply_list(document_t *doc, posmap_t *map, const command_t *c)
+{
+    size_t cur = posmap_translate(map, resolve_cursor(map, c->pos));
+    size_t first = document_line_at(doc, cur);
+    size_t lines = document_line_count(doc);
+    for (size_t i = 0; i < (size_t)(c->len > 0 ? c->len : 1) && first + i < lines; i++)
+    {
+        // Create list marker
+        char marker[24];
+        if (c->list_type == 'O' || c->list_type == 'o') // Ordered list
+            snprintf(marker, sizeof(marker), "%zu. ", i + 1);
+        else // Unordered list
+            strcpy(marker, "- ");
+
+        // Insert marker at line start
+        size_t line_pos = document_line_start(doc, first + i);
+        posmap_insert(map, line_pos, strlen(marker), PIECE_PREFIX, posmap_anchor(map, line_pos));
+        document_insert(doc, line_pos, marker);
+    }
+    return true;
+}
+
+// Apply a parsed editing command to doc. Positions refer to the document at
+// the map's base version and are translated past the edits the map has
+// recorded; the edit is then recorded too. On failure the document is left
+// untouched and response holds the Reject message.
+bool command_apply(document_t *doc, posmap_t *map, const command_t *c, char *response, size_t resp_size)
+{
+    if (c->type == CMD_NONE)
+    {
+        snprintf(response, resp_size, "Reject UNKNOWN_COMMAND");
+        return false;
+    }
+    if (c->type == CMD_HEADING && (c->level < 1 || c->level > 6))
+    {
+        snprintf(response, resp_size, "Reject INVALID_HEADING_LEVEL");
+        return false;
+    }
+    if (!check_bounds(map, c))
+    {
+        snprintf(response, resp_size, "Reject INVALID_POSITION");
+        return false;
+    }
+
+    size_t from = c->pos;
+    size_t to = c->pos + c->len;
+    if (to > map->base_len)
+        to = map->base_len; // DELETE may run past the end
+    switch (c->type)
+    {
+    case CMD_INSERT:
+        insert_at(doc, map, resolve_cursor(map, c->pos), c->text, PIECE_TEXT);
+        return true;
+
+    case CMD_DELETE:
+        if (!resolve_range(map, &from, &to, response, resp_size))
+            return false;
+        delete_range(doc, map, from, to);
+        return true;
+
+    case CMD_BOLD:
+    case CMD_ITALIC:
+    case CMD_CODE:
+        if (!resolve_range(map, &from, &to, response, resp_size))
+            return false;
+        if (c->type == CMD_BOLD)
+            wrap_range(doc, map, from, to, "**", "**");
+        else if (c->type == CMD_ITALIC)
+            wrap_range(doc, map, from, to, "*", "*");
+        else
+            wrap_range(doc, map, from, to, "`", "`");
+        return true;
+
+    case CMD_LINK:
+    {
+        if (!resolve_range(map, &from, &to, response, resp_size))
+            return false;
+        char target[sizeof(c->text) + 3];
+        snprintf(target, sizeof(target), "](%s)", c->text);
+        wrap_range(doc, map, from, to, "[", target);
+        return true;
+    }
+
+    case CMD_HEADING:
+    {
+        // Create heading prefix with # markers
+        char hashes[8] = "###### "; // Max 6 #'s
+        hashes[c->level] = ' ';     // Truncate to required level
+        hashes[c->level + 1] = '\0';
+        insert_block(doc, map, resolve_cursor(map, c->pos), hashes, false);
+        return true;
+    }
+
+    case CMD_LIST:
+        return apply_list(doc, map, c);
+
+    case CMD_NEWLINE:
+        insert_at(doc, map, resolve_cursor(map, c->pos), "\n", PIECE_TEXT);
+        return true;
+
+    case CMD_BLOCKQUOTE:
+        insert_block(doc, map, resolve_cursor(map, c->pos), "> ", false);
+        return true;
+
+    case CMD_UNORDERED_LIST:
+        insert_block(doc, map, resolve_cursor(map, c->pos), "- ", false);
+        return true;
+
+    case CMD_ORDERED_LIST:
+        return apply_ordered_list(doc, map, resolve_cursor(map, c->pos), response, resp_size);
+
+    case CMD_HORIZONTAL_RULE:
+        insert_block(doc, map, resolve_cursor(map, c->pos), "---", true);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// Rewrite c, whose positions refer to the map's base version, in terms of the
+// map's current text, so an edit that raced a version boundary can be applied
+// against the next version. Fails with the Reject message if it cannot be.
+bool command_rebase(const posmap_t *map, command_t *c, char *response, size_t resp_size)
+{
+    if (!check_bounds(map, c))
+    {
+        snprintf(response, resp_size, "Reject INVALID_POSITION");
+        return false;
+    }
+    if (c->type != CMD_DELETE && c->type != CMD_BOLD && c->type != CMD_ITALIC &&
+        c->type != CMD_CODE && c->type != CMD_LINK)
+    {
+        // Single-cursor commands
+        c->pos = (int)posmap_translate(map, resolve_cursor(map, c->pos));
+        return true;
+    }
+
+    size_t from = c->pos;
+    size_t to = c->pos + c->len;
+    if (to > map->base_len)
+        to = map->base_len;
+    if (!resolve_range(map, &from, &to, response, resp_size))
+        return false;
+    c->pos = (int)posmap_translate(map, from);
+    c->len = (int)(posmap_translate(map, to) - c->pos);
+    return true;
+}
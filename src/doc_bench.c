@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "document.h"
+
+// Document engine microbenchmarks. Each workload runs against a document
+// prebuilt to each size, in a child process of its own so that peak RSS is
+// that case's alone. Results are printed as JSON, one case per line inside
+// a single object, for comparing runs before and after a change.
+//
+// Allocations are counted by wrapping malloc, calloc and realloc at link
+// time (see the doc_bench target in the Makefile).
+
+static unsigned long long allocs;
+
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t count, size_t n);
+void *__real_realloc(void *p, size_t n);
+
+void *__wrap_malloc(size_t n)
+{
+    allocs++;
+    return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t count, size_t n)
+{
+    allocs++;
+    return __real_calloc(count, n);
+}
+
+void *__wrap_realloc(void *p, size_t n)
+{
+    allocs++;
+    return __real_realloc(p, n);
+}
+
+#define PASTE_BYTES (64 * 1024)
+#define BUILD_CHUNK (64 * 1024)
+
+typedef struct
+{
+    const char *name;
+    int (*run)(document_t *doc, int ops);
+    int ops; // Operations per case; whole-document workloads scale it down
+} workload_t;
+
+static unsigned long long rng = 88172645463325252ull;
+
+// xorshift64, so every run edits the same positions
+static size_t random_below(size_t n)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return n ? rng % n : 0;
+}
+
+static char paste[PASTE_BYTES + 1];
+
+// One character at a time at a moving cursor, as a user types
+static int run_typing(document_t *doc, int ops)
+{
+    size_t cursor = doc->length / 2;
+    for (int i = 0; i < ops; i++)
+        if (document_insert(doc, cursor++, (i % 64) == 63 ? "\n" : "x") < 0)
+            return -1;
+    return 0;
+}
+
+// Short inserts and deletes at random positions, alternating so the size
+// stays put
+static int run_random(document_t *doc, int ops)
+{
+    for (int i = 0; i < ops; i++)
+    {
+        size_t n = 1 + random_below(16);
+        if (i % 2 == 0)
+        {
+            if (document_insert(doc, random_below(doc->length + 1), paste + PASTE_BYTES - n) < 0)
+                return -1;
+        }
+        else if (doc->length >= n && document_delete(doc, random_below(doc->length - n + 1), n) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Large pastes at random positions
+static int run_paste(document_t *doc, int ops)
+{
+    for (int i = 0; i < ops; i++)
+        if (document_insert(doc, random_below(doc->length + 1), paste) < 0)
+            return -1;
+    return 0;
+}
+
+// Range deletes at random positions, each sized so the run takes out about
+// half the document (between 1 byte and 4 KiB per delete)
+static int run_range_delete(document_t *doc, int ops)
+{
+    size_t n = doc->length / (2 * (size_t)ops);
+    if (n > 4096)
+        n = 4096;
+    if (n == 0)
+        n = 1;
+    for (int i = 0; i < ops && doc->length >= n; i++)
+        if (document_delete(doc, random_below(doc->length - n + 1), n) < 0)
+            return -1;
+    return 0;
+}
+
+// An edit followed by serializing the whole document, as a snapshot for a
+// client sync does
+static int run_serialize(document_t *doc, int ops)
+{
+    for (int i = 0; i < ops; i++)
+    {
+        if (document_insert(doc, random_below(doc->length + 1), "x") < 0)
+            return -1;
+        char *out;
+        size_t len;
+        document_serialize(doc, &out, &len);
+        if (!out)
+            return -1;
+        free(out);
+    }
+    return 0;
+}
+
+// Line lookups at random lines and positions, as LIST and the line-start
+// commands make them
+static int run_lines(document_t *doc, int ops)
+{
+    size_t lines = document_line_count(doc);
+    for (int i = 0; i < ops; i++)
+    {
+        document_line_start(doc, random_below(lines));
+        document_line_at(doc, random_below(doc->length + 1));
+    }
+    return 0;
+}
+
+static const workload_t workloads[] = {
+    {"typing", run_typing, 200000},
+    {"random_edit", run_random, 200000},
+    {"paste_64k", run_paste, 256},
+    {"range_delete", run_range_delete, 1024},
+    {"serialize_after_edit", run_serialize, 2000},
+    {"line_lookup", run_lines, 200000},
+};
+
+static const size_t sizes[] = {
+    1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 100 * 1024 * 1024,
+};
+
+typedef struct
+{
+    int ops;
+    double ns;
+    unsigned long long allocs;
+} result_t;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Markdown-ish filler: lines of words, so line counts are realistic
+static document_t *build_document(size_t size)
+{
+    static char chunk[BUILD_CHUNK + 1];
+    for (size_t i = 0; i < BUILD_CHUNK; i++)
+        chunk[i] = i % 64 == 63 ? '\n' : i % 8 == 7 ? ' ' : 'a' + i % 26;
+
+    document_t *doc = document_create();
+    if (!doc)
+        return NULL;
+    while (doc->length < size)
+    {
+        size_t n = size - doc->length < BUILD_CHUNK ? size - doc->length : BUILD_CHUNK;
+        char saved = chunk[n];
+        chunk[n] = '\0';
+        int r = document_insert(doc, doc->length, chunk);
+        chunk[n] = saved;
+        if (r < 0)
+        {
+            document_free(doc);
+            return NULL;
+        }
+    }
+    return doc;
+}
+
+// Ops for a case: serializing does less on bigger documents so no case
+// takes more than a few seconds
+static int case_ops(const workload_t *w, size_t size)
+{
+    size_t cap = (size_t)4 << 30; // Bytes serialized per case
+    if (w->run != run_serialize || (size_t)w->ops * size <= cap)
+        return w->ops;
+    return cap / size > 3 ? cap / size : 3;
+}
+
+// Child side: build the document, then time the workload alone. Peak RSS
+// still counts the document itself.
+static int run_case(const workload_t *w, size_t size, result_t *r)
+{
+    document_t *doc = build_document(size);
+    if (!doc)
+        return -1;
+    // Start from a cached snapshot, as the server does after each version
+    document_snapshot_release(document_snapshot(doc));
+
+    r->ops = case_ops(w, size);
+    allocs = 0;
+    double start = now_ns();
+    int rc = w->run(doc, r->ops);
+    r->ns = now_ns() - start;
+    r->allocs = allocs;
+    document_free(doc);
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    // Optional filter: only workloads whose name starts with argv[1]
+    const char *only = argc > 1 ? argv[1] : NULL;
+    memset(paste, 'p', PASTE_BYTES);
+
+    printf("{\"benchmarks\": [\n");
+    int first = 1, failed = 0;
+    for (size_t wi = 0; wi < sizeof(workloads) / sizeof(workloads[0]); wi++)
+    {
+        const workload_t *w = &workloads[wi];
+        if (only && strncmp(w->name, only, strlen(only)) != 0)
+            continue;
+        for (size_t si = 0; si < sizeof(sizes) / sizeof(sizes[0]); si++)
+        {
+            int fds[2];
+            if (pipe(fds) < 0)
+            {
+                perror("pipe");
+                return 1;
+            }
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                perror("fork");
+                return 1;
+            }
+            if (pid == 0)
+            {
+                close(fds[0]);
+                result_t r;
+                if (run_case(w, sizes[si], &r) != 0 || write(fds[1], &r, sizeof(r)) != sizeof(r))
+                    _exit(1);
+                _exit(0);
+            }
+
+            close(fds[1]);
+            result_t r;
+            ssize_t got = read(fds[0], &r, sizeof(r));
+            close(fds[0]);
+            int status;
+            struct rusage usage;
+            wait4(pid, &status, 0, &usage);
+            if (got != sizeof(r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                fprintf(stderr, "%s at %zu bytes failed\n", w->name, sizes[si]);
+                failed = 1;
+                continue;
+            }
+
+            printf("%s  {\"name\": \"%s\", \"doc_bytes\": %zu, \"ops\": %d, \"ns_per_op\": %.1f, "
+                   "\"allocs_per_op\": %.3f, \"peak_rss_kib\": %ld}",
+                   first ? "" : ",\n", w->name, sizes[si], r.ops, r.ns / r.ops,
+                   (double)r.allocs / r.ops, usage.ru_maxrss);
+            first = 0;
+        }
+    }
+    printf("\n]}\n");
+    return failed;
+}
@@ -1,23 +1,442 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "document.h"
+#include "scan.h"
+
+// Chunks never grow past this many bytes; larger inserts are spread over
+// several nodes. Small chunks start with a smaller buffer and grow on demand.
+#define DOC_CHUNK_MAX 4096
+#define DOC_CHUNK_MIN 64
+
+// A mapped file is borrowed in chunks of this size, so splitting one to
+// edit it scans a bounded number of bytes
+#define DOC_MAP_CHUNK 65536
+
+static unsigned int next_priority(document_t *doc)
+{
+    // xorshift32
+    unsigned int x = doc->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    doc->seed = x;
+    return x;
+}
+
+static size_t node_size(const doc_node_t *t)
+{
+    return t ? t->size : 0;
+}
+
+static size_t node_lines(const doc_node_t *t)
+{
+    return t ? t->nl_size : 0;
+}
+
+static void node_update(doc_node_t *t)
+{
+    t->size = node_size(t->left) + t->len + node_size(t->right);
+    if (t->nl == DOC_NL_UNKNOWN || node_lines(t->left) == DOC_NL_UNKNOWN ||
+        node_lines(t->right) == DOC_NL_UNKNOWN)
+        t->nl_size = DOC_NL_UNKNOWN;
+    else
+        t->nl_size = node_lines(t->left) + t->nl + node_lines(t->right);
+}
+
+// Adjust a subtree newline total by an edit's newlines, unless still unknown
+static void add_lines(doc_node_t *t, size_t nl, int sign)
+{
+    if (t->nl_size != DOC_NL_UNKNOWN)
+        t->nl_size = sign > 0 ? t->nl_size + nl : t->nl_size - nl;
+}
+
+static size_t chunk_capacity(size_t len)
+{
+    size_t cap = DOC_CHUNK_MIN;
+    while (cap < len)
+        cap *= 2;
+    return cap < DOC_CHUNK_MAX ? cap : (len > DOC_CHUNK_MAX ? len : DOC_CHUNK_MAX);
+}
+
+static doc_node_t *node_new(unsigned int prio, const char *text, size_t len)
+{
+    doc_node_t *t = calloc(1, sizeof(doc_node_t));
+    if (!t)
+        return NULL;
+    t->cap = chunk_capacity(len);
+    t->buf = malloc(t->cap);
+    if (!t->buf)
+    {
+        free(t);
+        return NULL;
+    }
+    memcpy(t->buf, text, len);
+    t->len = len;
+    t->size = len;
+    t->nl = scan_newlines(text, len);
+    t->nl_size = t->nl;
+    t->prio = prio;
+    return t;
+}
+
+// A chunk that points into text it does not own; it is never written to
+static doc_node_t *node_borrow(unsigned int prio, const char *text, size_t len, size_t nl)
+{
+    doc_node_t *t = calloc(1, sizeof(doc_node_t));
+    if (!t)
+        return NULL;
+    t->buf = (char *)text;
+    t->len = len;
+    t->size = len;
+    t->nl = nl;
+    t->nl_size = nl;
+    t->prio = prio;
+    return t;
+}
+
+static void node_free_tree(doc_node_t *t)
+{
+    if (!t)
+        return;
+    node_free_tree(t->left);
+    node_free_tree(t->right);
+    if (t->cap)
+        free(t->buf);
+    free(t);
+}
+
+// Splice text into a single chunk at offset off, if it still fits.
+// Borrowed chunks are read-only; the caller splits around them instead.
+static int chunk_insert(doc_node_t *t, size_t off, const char *text, size_t n)
+{
+    if (t->cap == 0 || t->len + n > DOC_CHUNK_MAX)
+        return 0;
+    if (t->len + n > t->cap)
+    {
+        size_t cap = chunk_capacity(t->len + n);
+        char *buf = realloc(t->buf, cap);
+        if (!buf)
+            return 0;
+        t->buf = buf;
+        t->cap = cap;
+    }
+    memmove(t->buf + off + n, t->buf + off, t->len - off);
+    memcpy(t->buf + off, text, n);
+    t->len += n;
+    t->nl += scan_newlines(text, n);
+    return 1;
+}
+
+// Split t so that *l holds the first pos bytes and *r the rest. A chunk
+// straddling pos is cut in two; the tail inherits the head's priority so
+// the heap order below it is preserved.
+static void split(doc_node_t *t, size_t pos, doc_node_t **l, doc_node_t **r)
+{
+    if (!t)
+    {
+        *l = *r = NULL;
+        return;
+    }
+    size_t ls = node_size(t->left);
+    if (pos <= ls)
+    {
+        split(t->left, pos, l, &t->left);
+        node_update(t);
+        *r = t;
+    }
+    else if (pos >= ls + t->len)
+    {
+        split(t->right, pos - ls - t->len, &t->right, r);
+        node_update(t);
+        *l = t;
+    }
+    else
+    {
+        size_t k = pos - ls;
+        doc_node_t *tail;
+        if (t->cap)
+            tail = node_new(t->prio, t->buf + k, t->len - k);
+        else if (t->nl == DOC_NL_UNKNOWN)
+            tail = node_borrow(t->prio, t->buf + k, t->len - k, DOC_NL_UNKNOWN);
+        else
+            tail = node_borrow(t->prio, t->buf + k, t->len - k, scan_newlines(t->buf + k, t->len - k));
+        if (!tail)
+            abort();
+        t->len = k;
+        if (t->nl != DOC_NL_UNKNOWN)
+            t->nl -= tail->nl;
+        tail->right = t->right;
+        t->right = NULL;
+        node_update(tail);
+        node_update(t);
+        *l = t;
+        *r = tail;
+    }
+}
+
+static doc_node_t *merge(doc_node_t *a, doc_node_t *b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (a->prio > b->prio)
+    {
+        a->right = merge(a->right, b);
+        node_update(a);
+        return a;
+    }
+    b->left = merge(a, b->left);
+    node_update(b);
+    return b;
+}
+
+// Merge two trees, folding the first chunk of b into the last chunk of a
+// when both fit in one chunk. Keeps edit boundaries from fragmenting the rope.
+static doc_node_t *join(doc_node_t *a, doc_node_t *b)
+{
+    if (a && b)
+    {
+        doc_node_t *last = a;
+        while (last->right)
+            last = last->right;
+        doc_node_t *first = b;
+        while (first->left)
+            first = first->left;
+
+        if (last->len + first->len <= DOC_CHUNK_MAX)
+        {
+            size_t n = first->len;
+            doc_node_t *head;
+            split(b, n, &head, &b);
+            size_t nl = scan_newlines(head->buf, n);
+            if (chunk_insert(last, last->len, head->buf, n))
+            {
+                for (doc_node_t *t = a; t; t = t->right)
+                {
+                    t->size += n;
+                    add_lines(t, nl, 1);
+                }
+                node_free_tree(head);
+            }
+            else
+            {
+                b = merge(head, b);
+            }
+        }
+    }
+    return merge(a, b);
+}
+
+// Fast path: the insert lands inside (or at either end of) a chunk with room.
+// Only the sizes along the search path change, so no rebalancing is needed.
+static int insert_in_place(doc_node_t *t, size_t pos, const char *text, size_t n, size_t nl)
+{
+    if (!t)
+        return 0;
+    size_t ls = node_size(t->left);
+    int done;
+    if (t->left && pos <= ls)
+        done = insert_in_place(t->left, pos, text, n, nl);
+    else if (pos <= ls + t->len)
+        done = chunk_insert(t, pos - ls, text, n);
+    else
+        done = insert_in_place(t->right, pos - ls - t->len, text, n, nl);
+    if (done)
+    {
+        t->size += n;
+        add_lines(t, nl, 1);
+    }
+    return done;
+}
+
+// Fast path: the deleted range lies inside one chunk and leaves it non-empty
+static int delete_in_place(doc_node_t *t, size_t pos, size_t n, size_t *nl)
+{
+    if (!t)
+        return 0;
+    size_t ls = node_size(t->left);
+    int done = 0;
+    if (pos < ls)
+    {
+        done = delete_in_place(t->left, pos, n, nl);
+    }
+    else if (pos < ls + t->len)
+    {
+        size_t off = pos - ls;
+        if (off + n < t->len && t->cap)
+        {
+            *nl = scan_newlines(t->buf + off, n);
+            memmove(t->buf + off, t->buf + off + n, t->len - off - n);
+            t->len -= n;
+            t->nl -= *nl;
+            done = 1;
+        }
+    }
+    else
+    {
+        done = delete_in_place(t->right, pos - ls - t->len, n, nl);
+    }
+    if (done)
+    {
+        t->size -= n;
+        add_lines(t, *nl, -1);
+    }
+    return done;
+}
+
+static doc_snapshot_t *snapshot_alloc(size_t len)
+{
+    // Leave headroom so the cache can absorb a run of patches in place
+    size_t cap = len + len / 8 + 256;
+    doc_snapshot_t *s = malloc(sizeof(doc_snapshot_t) + cap);
+    if (!s)
+        return NULL;
+    atomic_init(&s->refs, 1);
+    s->revision = 0;
+    s->len = 0;
+    s->cap = cap;
+    s->data = (char *)(s + 1);
+    s->data[0] = 0;
+    return s;
+}
+
+// Patch the cached snapshot for an edit already applied to the rope; called
+// before doc->revision is bumped. Lets the cache go stale once it is shared
+// or the bytes moved since the last read exceed one full rebuild.
+static void cache_note_edit(document_t *doc, size_t pos, const char *text, size_t ins, size_t del)
+{
+    doc_snapshot_t *s = doc->cache;
+    if (!s)
+        return;
+    if (atomic_load(&s->refs) != 1)
+    {
+        // Readers keep their copy; the document stops sharing it
+        document_snapshot_release(s);
+        doc->cache = NULL;
+        return;
+    }
+    if (s->revision != doc->revision)
+        return;
+
+    size_t tail = s->len - pos - del;
+    size_t new_len = s->len - del + ins;
+    if (new_len + 1 > s->cap || doc->cache_moved + tail + ins > s->len)
+        return;
+    memmove(s->data + pos + ins, s->data + pos + del, tail + 1);
+    if (ins)
+        memcpy(s->data + pos, text, ins);
+    s->len = new_len;
+    s->revision = doc->revision + 1;
+    doc->cache_moved += tail + ins;
+}
+
+static char *serialize_tree(const doc_node_t *t, char *out)
+{
+    if (!t)
+        return out;
+    out = serialize_tree(t->left, out);
+    memcpy(out, t->buf, t->len);
+    out += t->len;
+    return serialize_tree(t->right, out);
+}
 
 document_t *document_create(void)
 {
     document_t *doc = calloc(1, sizeof(document_t));
+    if (doc)
+        doc->seed = 0x9e3779b9u;
     return doc;
 }
 
 void document_free(document_t *doc)
 {
-    doc_node_t *cur = doc->head;
-    while (cur)
+    if (!doc)
+        return;
+    node_free_tree(doc->root);
+    if (doc->cache)
+        document_snapshot_release(doc->cache);
+    if (doc->map)
+        munmap(doc->map, doc->map_len);
+    free(doc);
+}
+
+// Open a file as a document without reading it: the file is mapped and the
+// rope borrows its pages, so opening costs the same for any size. Newlines
+// are counted on the first line lookup, and the first snapshot is the
+// mapping itself. The file may be replaced (renamed over) while mapped, but
+// must not be rewritten in place; borrowed snapshots must be released
+// before document_free. Returns NULL if the file cannot be opened.
+document_t *document_map(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
     {
-        doc_node_t *tmp = cur;
-        cur = cur->next;
-        free(tmp);
+        close(fd);
+        return NULL;
     }
-    free(doc);
+    document_t *doc = document_create();
+    size_t len = st.st_size;
+    if (!doc || len == 0)
+    {
+        close(fd);
+        return doc;
+    }
+
+    // Reserve a byte past the end so the text is NUL-terminated like any
+    // snapshot: it is either past EOF in the file's last page or in the
+    // anonymous page behind it, and reads as zero either way
+    long page = sysconf(_SC_PAGESIZE);
+    size_t map_len = (len / page + 1) * page;
+    char *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED ||
+        mmap(map, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        if (map != MAP_FAILED)
+            munmap(map, map_len);
+        close(fd);
+        document_free(doc);
+        return NULL;
+    }
+    close(fd);
+    doc->map = map;
+    doc->map_len = map_len;
+
+    doc_snapshot_t *s = malloc(sizeof(doc_snapshot_t));
+    if (!s)
+    {
+        document_free(doc);
+        return NULL;
+    }
+    for (size_t off = 0; off < len; off += DOC_MAP_CHUNK)
+    {
+        size_t n = len - off < DOC_MAP_CHUNK ? len - off : DOC_MAP_CHUNK;
+        doc_node_t *t = node_borrow(next_priority(doc), map + off, n, DOC_NL_UNKNOWN);
+        if (!t)
+        {
+            free(s);
+            document_free(doc);
+            return NULL;
+        }
+        doc->root = merge(doc->root, t);
+    }
+    doc->length = len;
+
+    atomic_init(&s->refs, 1);
+    s->revision = doc->revision;
+    s->len = len;
+    s->cap = 0;
+    s->data = map;
+    doc->cache = s;
+    return doc;
 }
 
 int document_insert(document_t *doc, size_t pos, const char *text)
@@ -27,18 +446,30 @@ int document_insert(document_t *doc, size_t pos, const char *text)
     size_t len = strlen(text);
     if (pos > doc->length)
         pos = doc->length;
-    doc_node_t **pp = &doc->head;
-    for (size_t i = 0; i < pos; ++i)
-        pp = &(*pp)->next;
-    for (size_t i = 0; i < len; ++i)
-    {
-        doc_node_t *n = malloc(sizeof(doc_node_t));
-        n->c = text[i];
-        n->next = *pp;
-        *pp = n;
-        pp = &n->next;
-        doc->length++;
+    if (len == 0)
+        return 0;
+
+    if (!insert_in_place(doc->root, pos, text, len, scan_newlines(text, len)))
+    {
+        doc_node_t *l, *r, *mid = NULL;
+        split(doc->root, pos, &l, &r);
+        for (size_t off = 0; off < len; off += DOC_CHUNK_MAX)
+        {
+            size_t n = len - off < DOC_CHUNK_MAX ? len - off : DOC_CHUNK_MAX;
+            doc_node_t *t = node_new(next_priority(doc), text + off, n);
+            if (!t)
+            {
+                node_free_tree(mid);
+                doc->root = merge(l, r);
+                return -1;
+            }
+            mid = merge(mid, t);
+        }
+        doc->root = merge(join(l, mid), r);
     }
+    cache_note_edit(doc, pos, text, len, 0);
+    doc->length += len;
+    doc->revision++;
     return 0;
 }
 
@@ -46,28 +477,186 @@ int document_delete(document_t *doc, size_t pos, size_t n)
 {
     if (!doc || pos >= doc->length)
         return -1;
-    doc_node_t **pp = &doc->head;
-    for (size_t i = 0; i < pos; ++i)
-        pp = &(*pp)->next;
-    for (size_t i = 0; i < n && *pp; ++i)
+    if (n > doc->length - pos)
+        n = doc->length - pos;
+    if (n == 0)
+        return 0;
+
+    size_t nl = 0;
+    if (!delete_in_place(doc->root, pos, n, &nl))
     {
-        doc_node_t *tmp = *pp;
-        *pp = tmp->next;
-        free(tmp);
-        doc->length--;
+        doc_node_t *l, *mid, *r;
+        split(doc->root, pos, &l, &r);
+        split(r, n, &mid, &r);
+        node_free_tree(mid);
+        doc->root = join(l, r);
     }
+    cache_note_edit(doc, pos, NULL, 0, n);
+    doc->length -= n;
+    doc->revision++;
     return 0;
 }
 
+// Surround [start, end) with open and close markers. Each marker is a plain
+// positioned insert, so the range itself is never copied and may be any
+// length. With start == end, open lands before close.
+int document_wrap(document_t *doc, size_t start, size_t end, const char *open, const char *close)
+{
+    if (!doc || !open || !close || start > end || end > doc->length)
+        return -1;
+    if (document_insert(doc, end, close) < 0)
+        return -1;
+    return document_insert(doc, start, open);
+}
+
+static size_t read_tree(const doc_node_t *t, size_t pos, char *buf, size_t n)
+{
+    if (!t || n == 0)
+        return 0;
+    size_t ls = node_size(t->left);
+    size_t got = 0;
+    if (pos < ls)
+    {
+        got = read_tree(t->left, pos, buf, n);
+        pos = ls;
+    }
+    pos -= ls; // Offset into this chunk
+    if (got < n && pos < t->len)
+    {
+        size_t k = t->len - pos < n - got ? t->len - pos : n - got;
+        memcpy(buf + got, t->buf + pos, k);
+        got += k;
+        pos = t->len;
+    }
+    if (got < n)
+        got += read_tree(t->right, pos - t->len, buf + got, n - got);
+    return got;
+}
+
+// Copy up to n bytes starting at pos without serializing the document.
+// Returns the number of bytes copied.
+size_t document_read(const document_t *doc, size_t pos, char *buf, size_t n)
+{
+    if (!doc || pos >= doc->length)
+        return 0;
+    return read_tree(doc->root, pos, buf, n);
+}
+
+// Count the newlines of borrowed chunks not yet scanned, so that subtree
+// totals can be trusted. Each chunk is scanned at most once.
+static void count_lines(doc_node_t *t)
+{
+    if (!t || t->nl_size != DOC_NL_UNKNOWN)
+        return;
+    count_lines(t->left);
+    count_lines(t->right);
+    if (t->nl == DOC_NL_UNKNOWN)
+        t->nl = scan_newlines(t->buf, t->len);
+    node_update(t);
+}
+
+size_t document_line_count(document_t *doc)
+{
+    count_lines(doc->root);
+    return node_lines(doc->root) + 1;
+}
+
+// Line number (from 0) of the line containing pos
+size_t document_line_at(document_t *doc, size_t pos)
+{
+    count_lines(doc->root);
+    size_t line = 0;
+    const doc_node_t *t = doc->root;
+    while (t)
+    {
+        size_t ls = node_size(t->left);
+        if (t->left && pos <= ls)
+        {
+            t = t->left;
+            continue;
+        }
+        line += node_lines(t->left);
+        size_t off = pos - ls;
+        if (off <= t->len)
+            return line + scan_newlines(t->buf, off);
+        line += t->nl;
+        pos = off - t->len;
+        t = t->right;
+    }
+    return line;
+}
+
+// Offset of the first byte of a line (from 0); the document length if the
+// document has fewer lines
+size_t document_line_start(document_t *doc, size_t line)
+{
+    count_lines(doc->root);
+    if (line == 0)
+        return 0;
+    if (line > node_lines(doc->root))
+        return doc->length;
+
+    // Find the line-th newline
+    size_t base = 0;
+    const doc_node_t *t = doc->root;
+    while (t)
+    {
+        size_t ll = node_lines(t->left);
+        if (line <= ll)
+        {
+            t = t->left;
+            continue;
+        }
+        base += node_size(t->left);
+        if (line <= ll + t->nl)
+            return base + (scan_nth_newline(t->buf, t->len, line - ll) - t->buf) + 1;
+        line -= ll + t->nl;
+        base += t->len;
+        t = t->right;
+    }
+    return doc->length;
+}
+
 void document_serialize(document_t *doc, char **out, size_t *len)
 {
-    *len = doc->length;
-    *out = malloc(doc->length + 1);
-    doc_node_t *cur = doc->head;
-    for (size_t i = 0; i < doc->length; ++i)
+    const doc_snapshot_t *snap = document_snapshot(doc);
+    *len = snap->len;
+    *out = malloc(snap->len + 1);
+    memcpy(*out, snap->data, snap->len + 1);
+    document_snapshot_release(snap);
+}
+
+// Return a reference to the serialized text at the current revision,
+// rebuilding the cache only if edits have made it stale. The caller must
+// hold whatever lock guards doc, and release the snapshot when done.
+const doc_snapshot_t *document_snapshot(document_t *doc)
+{
+    doc_snapshot_t *s = doc->cache;
+    if (!s || s->revision != doc->revision)
     {
-        (*out)[i] = cur->c;
-        cur = cur->next;
+        if (s && s->cap < doc->length + 1)
+        {
+            document_snapshot_release(s);
+            s = NULL;
+        }
+        if (!s)
+            s = snapshot_alloc(doc->length);
+        if (!s)
+            abort();
+        serialize_tree(doc->root, s->data);
+        s->len = doc->length;
+        s->data[s->len] = 0;
+        s->revision = doc->revision;
+        doc->cache = s;
     }
-    (*out)[doc->length] = 0;
-}
\ No newline at end of file
+    doc->cache_moved = 0;
+    atomic_fetch_add(&s->refs, 1);
+    return s;
+}
+
+void document_snapshot_release(const doc_snapshot_t *snap)
+{
+    doc_snapshot_t *s = (doc_snapshot_t *)snap;
+    if (s && atomic_fetch_sub(&s->refs, 1) == 1)
+        free(s);
+}
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include "epoch.h"
+
+// Run at thread exit: free the slot for the next thread to enter
+static void reader_release(void *arg)
+{
+    epoch_reader_t *r = arg;
+    atomic_store(&r->active, 0);
+    r->depth = 0;
+    pthread_mutex_lock(&r->epoch->mutex);
+    r->owned = false;
+    pthread_mutex_unlock(&r->epoch->mutex);
+}
+
+int epoch_init(epoch_t *e)
+{
+    atomic_init(&e->global, 1);
+    e->readers = NULL;
+    e->retired = NULL;
+    if (pthread_mutex_init(&e->mutex, NULL) != 0)
+        return -1;
+    return pthread_key_create(&e->key, reader_release) == 0 ? 0 : -1;
+}
+
+// This thread's slot, taking over a released one or making one on first use
+static epoch_reader_t *reader_get(epoch_t *e)
+{
+    epoch_reader_t *r = pthread_getspecific(e->key);
+    if (r)
+        return r;
+    pthread_mutex_lock(&e->mutex);
+    for (r = e->readers; r && r->owned; r = r->next)
+        ;
+    if (!r)
+    {
+        r = aligned_alloc(_Alignof(epoch_reader_t), sizeof(epoch_reader_t));
+        if (!r)
+            abort();
+        atomic_init(&r->active, 0);
+        r->depth = 0;
+        r->epoch = e;
+        r->next = e->readers;
+        e->readers = r;
+    }
+    r->owned = true;
+    pthread_mutex_unlock(&e->mutex);
+    pthread_setspecific(e->key, r);
+    return r;
+}
+
+// Announce the epoch before loading any published pointer. Both are
+// sequentially consistent, so a writer that sees this reader as outside
+// also knows the reader will load the pointer it has just replaced.
+void epoch_enter(epoch_t *e)
+{
+    epoch_reader_t *r = reader_get(e);
+    if (r->depth++ == 0)
+        atomic_store(&r->active, atomic_load(&e->global));
+}
+
+void epoch_exit(epoch_t *e)
+{
+    epoch_reader_t *r = pthread_getspecific(e->key);
+    if (--r->depth == 0)
+        atomic_store(&r->active, 0);
+}
+
+// Hand over an object already unpublished, to be released once no reader
+// can still hold it. Advances the epoch so later readers are told apart.
+void epoch_retire(epoch_t *e, void *ptr, void (*release)(void *))
+{
+    epoch_retired_t *r = malloc(sizeof(epoch_retired_t));
+    if (!r)
+        abort();
+    r->ptr = ptr;
+    r->release = release;
+    pthread_mutex_lock(&e->mutex);
+    r->epoch = atomic_fetch_add(&e->global, 1);
+    r->next = e->retired;
+    e->retired = r;
+    pthread_mutex_unlock(&e->mutex);
+}
+
+// Release every retired object older than the oldest epoch a reader is in.
+// The releases run after the mutex is dropped, so they may retire in turn.
+void epoch_reclaim(epoch_t *e)
+{
+    epoch_retired_t *done = NULL;
+    pthread_mutex_lock(&e->mutex);
+    unsigned long oldest = atomic_load(&e->global);
+    for (epoch_reader_t *r = e->readers; r; r = r->next)
+    {
+        unsigned long a = atomic_load(&r->active);
+        if (a != 0 && a < oldest)
+            oldest = a;
+    }
+
+    epoch_retired_t **link = &e->retired;
+    while (*link)
+    {
+        epoch_retired_t *r = *link;
+        if (r->epoch < oldest)
+        {
+            *link = r->next;
+            r->next = done;
+            done = r;
+        }
+        else
+        {
+            link = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&e->mutex);
+
+    while (done)
+    {
+        epoch_retired_t *r = done;
+        done = r->next;
+        r->release(r->ptr);
+        free(r);
+    }
+}
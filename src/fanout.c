@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fanout.h"
+
+// Default for fanout_t.tee_min: below this a plain write per client is as
+// cheap as staging + tee
+#define FANOUT_TEE_MIN 4096
+
+// Bytes staged per round. Matches the default FIFO capacity: a bigger chunk
+// cannot be tee'd whole into a client pipe and falls back to write()
+#define FANOUT_CHUNK 65536
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write what fd takes without blocking, if it is non-blocking. Returns the
+// bytes written; stops short on a full FIFO or an error.
+static size_t write_some(int fd, const char *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+int fanout_init(fanout_t *f)
+{
+    if (pipe2(f->pipe_fd, O_CLOEXEC) < 0)
+        return -1;
+    int size = fcntl(f->pipe_fd[1], F_GETPIPE_SZ);
+    f->chunk = size > 0 && size < FANOUT_CHUNK ? (size_t)size : FANOUT_CHUNK;
+    f->tee_min = FANOUT_TEE_MIN;
+    f->null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (f->null_fd < 0)
+    {
+        close(f->pipe_fd[0]);
+        close(f->pipe_fd[1]);
+        return -1;
+    }
+    return 0;
+}
+
+void fanout_destroy(fanout_t *f)
+{
+    close(f->pipe_fd[0]);
+    close(f->pipe_fd[1]);
+    close(f->null_fd);
+}
+
+// The plain loop: one write per client, each copying the payload again.
+// Returns the number of clients that received all of it; if sent is not
+// NULL, sent[i] is set to the bytes fds[i] took.
+int fanout_send_copy(const int *fds, int nfds, const char *buf, size_t len, size_t *sent)
+{
+    int delivered = 0;
+    for (int i = 0; i < nfds; i++)
+    {
+        size_t n = write_some(fds[i], buf, len);
+        if (sent)
+            sent[i] = n;
+        if (n == len)
+            delivered++;
+    }
+    return delivered;
+}
+
+// Stage the payload once per pipe-sized chunk and tee it into each client.
+// A client whose FIFO only takes part of a chunk gets the remainder by
+// write(), since tee always starts again from the front of the staging pipe.
+// Non-blocking FIFOs are never waited on: a client whose FIFO fills up is
+// skipped for the rest of the payload. Returns the number of clients that
+// received all of it; if sent is not NULL, sent[i] is set to the bytes
+// fds[i] took.
+int fanout_send(fanout_t *f, const int *fds, int nfds, const char *buf, size_t len, size_t *sent)
+{
+    if (len < f->tee_min || nfds < 2)
+        return fanout_send_copy(fds, nfds, buf, len, sent);
+
+    int delivered = 0;
+    size_t took[nfds];
+    for (int i = 0; i < nfds; i++)
+        took[i] = 0;
+
+    for (size_t off = 0; off < len; off += f->chunk)
+    {
+        size_t n = len - off < f->chunk ? len - off : f->chunk;
+        if (write_all(f->pipe_fd[1], buf + off, n) < 0)
+            return fanout_send_copy(fds, nfds, buf, len, sent);
+
+        for (int i = 0; i < nfds; i++)
+        {
+            if (took[i] < off)
+                continue; // Fell behind on an earlier chunk
+            // SPLICE_F_NONBLOCK: tee would otherwise wait on a full FIFO
+            // even if it was opened non-blocking
+            ssize_t t = tee(f->pipe_fd[0], fds[i], n, SPLICE_F_NONBLOCK);
+            if (t < 0 && errno != EINVAL && errno != EAGAIN)
+                continue;
+            if (t < 0)
+                t = 0; // Not a pipe, or full: write() what it takes
+            took[i] += t;
+            if ((size_t)t < n)
+                took[i] += write_some(fds[i], buf + off + t, n - t);
+        }
+
+        // Drop the staged chunk
+        size_t left = n;
+        while (left > 0)
+        {
+            ssize_t d = splice(f->pipe_fd[0], NULL, f->null_fd, NULL, left, 0);
+            if (d <= 0)
+            {
+                char scratch[4096];
+                d = read(f->pipe_fd[0], scratch, left < sizeof(scratch) ? left : sizeof(scratch));
+                if (d <= 0)
+                    break;
+            }
+            left -= d;
+        }
+    }
+
+    for (int i = 0; i < nfds; i++)
+    {
+        if (sent)
+            sent[i] = took[i];
+        if (took[i] == len)
+            delivered++;
+    }
+    return delivered;
+}
@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include "fanout.h"
+
+// Compares the tee fan-out against the per-client write loop. Each simulated
+// client is a pipe drained by a single consumer thread that splices into
+// /dev/null, so the numbers reflect the broadcaster's cost only.
+
+typedef struct
+{
+    int epfd;
+    int null_fd;
+    volatile int stop;
+} drainer_t;
+
+static void *drain(void *arg)
+{
+    drainer_t *d = arg;
+    struct epoll_event events[64];
+    while (!d->stop)
+    {
+        int n = epoll_wait(d->epfd, events, 64, 10);
+        for (int i = 0; i < n; i++)
+            splice(events[i].data.fd, NULL, d->null_fd, NULL, 1 << 20, SPLICE_F_NONBLOCK);
+    }
+    return NULL;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double run(fanout_t *f, int use_tee, const int *fds, int nfds, const char *buf, size_t len, int iters)
+{
+    double start = now_ns();
+    for (int i = 0; i < iters; i++)
+    {
+        if (use_tee)
+            fanout_send(f, fds, nfds, buf, len, NULL);
+        else
+            fanout_send_copy(fds, nfds, buf, len, NULL);
+    }
+    return (now_ns() - start) / iters;
+}
+
+int main(void)
+{
+    const size_t sizes[] = {256, 4096, 65536, 1 << 20};
+    const int client_counts[] = {1, 8, 64};
+
+    fanout_t f;
+    if (fanout_init(&f) < 0)
+    {
+        perror("fanout_init");
+        return 1;
+    }
+    f.tee_min = 0; // Measure tee at every size
+
+    printf("%-10s %-8s %14s %14s %8s\n", "payload", "clients", "write ns/op", "tee ns/op", "speedup");
+    for (size_t c = 0; c < sizeof(client_counts) / sizeof(client_counts[0]); c++)
+    {
+        int nfds = client_counts[c];
+        int fds[64], rfds[64];
+        drainer_t d = {.epfd = epoll_create1(0), .null_fd = open("/dev/null", O_WRONLY), .stop = 0};
+        for (int i = 0; i < nfds; i++)
+        {
+            int p[2];
+            if (pipe(p) < 0)
+            {
+                perror("pipe");
+                return 1;
+            }
+            fds[i] = p[1];
+            rfds[i] = p[0];
+            struct epoll_event ev = {.events = EPOLLIN, .data.fd = p[0]};
+            epoll_ctl(d.epfd, EPOLL_CTL_ADD, p[0], &ev);
+        }
+        pthread_t tid;
+        pthread_create(&tid, NULL, drain, &d);
+
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            size_t len = sizes[s];
+            char *buf = malloc(len);
+            memset(buf, 'x', len);
+            int iters = (int)((64u << 20) / (len * nfds)) + 1;
+
+            run(&f, 0, fds, nfds, buf, len, iters / 10 + 1); // Warm up
+            double copy_ns = run(&f, 0, fds, nfds, buf, len, iters);
+            double tee_ns = run(&f, 1, fds, nfds, buf, len, iters);
+            printf("%-10zu %-8d %14.0f %14.0f %7.2fx\n", len, nfds, copy_ns, tee_ns, copy_ns / tee_ns);
+            free(buf);
+        }
+
+        d.stop = 1;
+        pthread_join(tid, NULL);
+        for (int i = 0; i < nfds; i++)
+        {
+            close(fds[i]);
+            close(rfds[i]);
+        }
+        close(d.epfd);
+        close(d.null_fd);
+    }
+
+    fanout_destroy(&f);
+    return 0;
+}
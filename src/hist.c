@@ -0,0 +1,61 @@
+#include "hist.h"
+
+static unsigned bucket_of(uint64_t v)
+{
+    if (v < (1u << HIST_SUB_BITS))
+        return v;
+    unsigned e = 63 - __builtin_clzll(v); // Highest set bit, >= HIST_SUB_BITS
+    unsigned sub = (v >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1);
+    return (e - HIST_SUB_BITS + 1) << HIST_SUB_BITS | sub;
+}
+
+// Middle of the range of values a bucket holds
+static uint64_t bucket_value(unsigned b)
+{
+    if (b < (1u << HIST_SUB_BITS))
+        return b;
+    unsigned e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = b & ((1u << HIST_SUB_BITS) - 1);
+    uint64_t width = (uint64_t)1 << (e - HIST_SUB_BITS);
+    return (((uint64_t)1 << HIST_SUB_BITS) + sub) * width + width / 2;
+}
+
+void hist_add(hist_t *h, uint64_t v)
+{
+    h->buckets[bucket_of(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+void hist_merge(hist_t *into, const hist_t *from)
+{
+    for (unsigned b = 0; b < HIST_BUCKETS; b++)
+        into->buckets[b] += from->buckets[b];
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+// Value at quantile q (0.5 for the median), or 0 if nothing was recorded
+uint64_t hist_quantile(const hist_t *h, double q)
+{
+    if (h->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += h->buckets[b];
+        if (seen > rank)
+        {
+            uint64_t v = bucket_value(b);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
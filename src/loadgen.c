@@ -0,0 +1,595 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "protocol.h"
+#include "hist.h"
+
+// Load generator. Spawns one process per synthetic client, each connecting
+// through the same SIGRTMIN / FIFO_C2S_<pid> / FIFO_S2C_<pid> handshake as
+// the real client. Writers send a scripted mix of inserts, deletes and
+// formatting at a fixed rate; viewers only read. Each writer times every
+// command from its write to the broadcast carrying its EDIT line. Results
+// are merged from a shared mapping once every client has finished and
+// printed as JSON.
+//
+// Writers connect as lg_w<i> and viewers as lg_v<i>. They must be listed in
+// the roles file the server reads. With -f, any missing from that file are
+// appended for the run (the server reloads it) and removed again at exit;
+// without it no file is touched. Point -f at the roles file of a scratch
+// server, since the users it adds can write.
+
+// Define real-time signals if not available
+#ifndef SIGRTMIN
+#define SIGRTMIN 34
+#endif
+
+#define CONNECT_TIMEOUT_S 5
+#define DRAIN_MS 3000       // How long writers wait for their last EDITs
+#define PENDING_MAX 1024    // Commands a writer can have in flight
+
+typedef struct
+{
+    pid_t server;
+    int writers;
+    int viewers;
+    double rate;        // Commands per second per writer
+    int duration;       // Seconds of load
+    int stagger_us;     // Between client spawns; 0 connects all at once
+    int mix[3];         // Percent inserts, deletes, formatting
+    const char *roles;  // Roles file to add users to, or NULL
+} config_t;
+
+// Lines appended to the roles file, to be cut off again at exit
+typedef struct
+{
+    long size; // File size before
+    char *text;
+    size_t len;
+} roles_added_t;
+
+// One client's results, in memory shared with the parent
+typedef struct
+{
+    bool connected;
+    bool rejected;      // Server refused the connection
+    uint64_t bytes;     // Received from the server
+    uint64_t sent;      // Commands sent
+    uint64_t applied;   // EDIT lines seen for our commands
+    uint64_t failed;    // Of those, rejected by the server
+    uint64_t lost;      // Commands whose EDIT never arrived
+    uint64_t resyncs;   // Snapshots received after the first
+    hist_t connect;     // ns from SIGRTMIN to the initial snapshot
+    hist_t latency;     // ns from command write to its broadcast
+} result_t;
+
+typedef struct
+{
+    char cmd[64];
+    uint64_t sent_at;
+} pending_t;
+
+// Per-process session state
+typedef struct
+{
+    const config_t *cfg;
+    result_t *res;
+    char username[32];
+    bool writer;
+    int fd_c2s;
+    int fd_s2c;
+    framer_t framer;
+    size_t doc_len;     // As of the last block or snapshot
+    unsigned long seq;
+    unsigned int rng;
+    pending_t pending[PENDING_MAX];
+    size_t pending_head, pending_count;
+} session_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static size_t random_below(session_t *s, size_t n)
+{
+    return n ? (size_t)rand_r(&s->rng) % n : 0;
+}
+
+// Pick the next scripted command, valid against the document as last seen
+static void next_command(session_t *s, char *cmd, size_t size)
+{
+    static const char *const formats[] = {"BOLD", "ITALIC", "CODE"};
+    size_t len = s->doc_len;
+    int roll = random_below(s, 100);
+    if (roll < s->cfg->mix[0] || len < 8)
+    {
+        // The text is unique, so this command's EDIT line is unambiguous
+        snprintf(cmd, size, "i %zu %s.%lu", random_below(s, len + 1), s->username, s->seq);
+    }
+    else if (roll < s->cfg->mix[0] + s->cfg->mix[1])
+    {
+        size_t n = 1 + random_below(s, 8);
+        snprintf(cmd, size, "d %zu %zu", random_below(s, len - n + 1), n);
+    }
+    else if (random_below(s, 4) == 0)
+    {
+        snprintf(cmd, size, "HEADING %zu %zu", 1 + random_below(s, 3), random_below(s, len + 1));
+    }
+    else
+    {
+        size_t n = 1 + random_below(s, 8);
+        snprintf(cmd, size, "%s %zu %zu", formats[random_below(s, 3)], random_below(s, len - n + 1), n);
+    }
+    s->seq++;
+}
+
+static void send_command(session_t *s)
+{
+    char line[80];
+    next_command(s, line, sizeof(line) - 1);
+    size_t n = strlen(line);
+    if (s->pending_count == PENDING_MAX)
+    {
+        // Oldest never came back
+        s->pending_head = (s->pending_head + 1) % PENDING_MAX;
+        s->pending_count--;
+        s->res->lost++;
+    }
+    pending_t *p = &s->pending[(s->pending_head + s->pending_count) % PENDING_MAX];
+    snprintf(p->cmd, sizeof(p->cmd), "%s", line);
+    line[n++] = '\n';
+    p->sent_at = now_ns();
+    if (write(s->fd_c2s, line, n) == (ssize_t)n)
+    {
+        s->pending_count++;
+        s->res->sent++;
+    }
+}
+
+// Skip n space-separated fields of s; NULL if it has fewer
+static const char *skip_fields(const char *s, int n)
+{
+    while (n-- > 0)
+    {
+        s = strchr(s, ' ');
+        if (!s)
+            return NULL;
+        s++;
+    }
+    return s;
+}
+
+// Whether an EDIT line's command is one we sent. The server rebases a
+// command that raced a version boundary and rewrites its positions, so only
+// what a rebase keeps is compared: the verb, and for an insert its text,
+// which is unique. Every command sent here has three fields.
+static bool same_command(const char *sent, const char *echoed)
+{
+    size_t verb = strcspn(sent, " ");
+    if (strncmp(sent, echoed, verb) != 0 || echoed[verb] != ' ')
+        return false;
+    if (verb != 1 || sent[0] != 'i')
+        return true;
+    const char *text = skip_fields(sent, 2);
+    const char *echoed_text = skip_fields(echoed, 2);
+    size_t len = strlen(text);
+    return echoed_text && strncmp(text, echoed_text, len) == 0 && echoed_text[len] == ' ';
+}
+
+// Match "EDIT <user> <command> <result>" against our commands in flight.
+// Commands come back in the order they were sent, so any still pending
+// ahead of the match were dropped by the server.
+static void match_edit(session_t *s, const char *line, uint64_t now)
+{
+    size_t ulen = strlen(s->username);
+    if (strncmp(line + 5, s->username, ulen) != 0 || line[5 + ulen] != ' ')
+        return;
+    const char *rest = line + 6 + ulen;
+    const char *result = skip_fields(rest, 3);
+    if (!result)
+        return;
+    for (size_t i = 0; i < s->pending_count; i++)
+    {
+        pending_t *p = &s->pending[(s->pending_head + i) % PENDING_MAX];
+        if (!same_command(p->cmd, rest))
+            continue;
+        hist_add(&s->res->latency, now - p->sent_at);
+        s->res->applied++;
+        if (strcmp(result, "SUCCESS") != 0)
+            s->res->failed++;
+        s->res->lost += i;
+        s->pending_head = (s->pending_head + i + 1) % PENDING_MAX;
+        s->pending_count -= i + 1;
+        return;
+    }
+}
+
+static void handle_block(session_t *s, char *block, uint64_t now)
+{
+    char *saveptr;
+    for (char *line = strtok_r(block, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr))
+    {
+        size_t length;
+        if (strncmp(line, "EDIT ", 5) == 0)
+        {
+            if (s->writer)
+                match_edit(s, line, now);
+        }
+        else if (sscanf(line, "LENGTH %zu", &length) == 1)
+        {
+            s->doc_len = length;
+        }
+    }
+}
+
+// Read whatever has arrived and handle every complete message.
+// Returns false once the server has closed the FIFO.
+static bool receive(session_t *s)
+{
+    ssize_t n = framer_fill(&s->framer, s->fd_s2c);
+    if (n <= 0)
+        return n < 0 && errno == EAGAIN;
+    s->res->bytes += n;
+    uint64_t now = now_ns();
+    frame_t frame;
+    while (framer_next(&s->framer, &frame) == 1)
+    {
+        if (frame.type == MSG_VERSION)
+            handle_block(s, frame.text, now);
+        else if (frame.type == MSG_SNAPSHOT)
+        {
+            s->doc_len = frame.len;
+            s->res->resyncs++;
+        }
+    }
+    return true;
+}
+
+// Handshake as the real client does, then wait for the initial snapshot
+static int connect_session(session_t *s)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGRTMIN + 1);
+    uint64_t start = now_ns();
+    kill(s->cfg->server, SIGRTMIN);
+    struct timespec timeout = {CONNECT_TIMEOUT_S, 0};
+    if (sigtimedwait(&set, NULL, &timeout) < 0)
+        return -1;
+
+    char fifo_c2s[64], fifo_s2c[64];
+    snprintf(fifo_c2s, sizeof(fifo_c2s), "FIFO_C2S_%d", getpid());
+    snprintf(fifo_s2c, sizeof(fifo_s2c), "FIFO_S2C_%d", getpid());
+    s->fd_s2c = open(fifo_s2c, O_RDONLY);
+    s->fd_c2s = s->fd_s2c < 0 ? -1 : open(fifo_c2s, O_WRONLY);
+    if (s->fd_c2s < 0)
+        return -1;
+    char hello[40];
+    int n = snprintf(hello, sizeof(hello), "%s\n", s->username);
+    if (write(s->fd_c2s, hello, n) != n)
+        return -1;
+
+    frame_t frame;
+    int got = 0;
+    while (got == 0)
+    {
+        ssize_t r = framer_fill(&s->framer, s->fd_s2c);
+        if (r <= 0)
+            return -1;
+        s->res->bytes += r;
+        got = framer_next(&s->framer, &frame);
+    }
+    if (got != 1 || frame.type != MSG_SNAPSHOT)
+    {
+        s->res->rejected = true;
+        return -1;
+    }
+    hist_add(&s->res->connect, now_ns() - start);
+    s->doc_len = frame.len;
+    s->res->connected = true;
+    fcntl(s->fd_s2c, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+// One synthetic client: connect, run for the configured duration, then
+// give outstanding commands DRAIN_MS to come back
+static void run_client(const config_t *cfg, int index, result_t *res)
+{
+    session_t *s = calloc(1, sizeof(session_t));
+    if (!s || framer_init(&s->framer, 65536) < 0)
+        return;
+    s->cfg = cfg;
+    s->res = res;
+    s->fd_c2s = s->fd_s2c = -1;
+    s->writer = index < cfg->writers;
+    s->rng = getpid();
+    if (s->writer)
+        snprintf(s->username, sizeof(s->username), "lg_w%d", index);
+    else
+        snprintf(s->username, sizeof(s->username), "lg_v%d", index - cfg->writers);
+
+    if (connect_session(s) == 0)
+    {
+        uint64_t interval = cfg->rate > 0 ? (uint64_t)(1e9 / cfg->rate) : 0;
+        uint64_t start = now_ns();
+        uint64_t stop = start + (uint64_t)cfg->duration * 1000000000u;
+        uint64_t drained = stop + (uint64_t)DRAIN_MS * 1000000u;
+        // Spread writers across the first interval rather than in lockstep
+        uint64_t next = start + (interval ? random_below(s, interval) : 0);
+        while (1)
+        {
+            uint64_t now = now_ns();
+            if (now >= drained || (now >= stop && s->pending_count == 0))
+                break;
+            if (s->writer && interval && now < stop && now >= next)
+            {
+                send_command(s);
+                next += interval;
+                continue;
+            }
+
+            uint64_t until = s->writer && interval && now < stop ? next : drained;
+            if (!s->writer && now >= stop)
+                break;
+            struct pollfd pfd = {.fd = s->fd_s2c, .events = POLLIN};
+            int wait_ms = (int)((until - now + 999999) / 1000000);
+            if (poll(&pfd, 1, wait_ms) > 0 && !receive(s))
+                break;
+        }
+        res->lost += s->pending_count;
+    }
+
+    if (s->fd_c2s >= 0)
+        close(s->fd_c2s);
+    if (s->fd_s2c >= 0)
+        close(s->fd_s2c);
+    framer_free(&s->framer);
+    free(s);
+}
+
+// Append lg_w<i> write and lg_v<i> read lines for any not yet listed.
+// Returns how many were added, or -1.
+static int ensure_roles(const config_t *cfg, roles_added_t *added_text)
+{
+    FILE *f = fopen(cfg->roles, "a+");
+    if (!f)
+        return -1;
+    int total = cfg->writers + cfg->viewers;
+    char *listed = calloc(total, 1);
+    FILE *out = open_memstream(&added_text->text, &added_text->len);
+    if (!listed || !out)
+    {
+        free(listed);
+        if (out)
+            fclose(out);
+        fclose(f);
+        return -1;
+    }
+    char line[256];
+    bool ended = true; // The file ends in a newline, or is empty
+    rewind(f);
+    while (fgets(line, sizeof(line), f))
+    {
+        ended = line[strlen(line) - 1] == '\n';
+        char kind;
+        int i;
+        if (sscanf(line, " lg_%c%d", &kind, &i) != 2 || i < 0)
+            continue;
+        if (kind == 'w' && i < cfg->writers && strstr(line, " write"))
+            listed[i] = 1;
+        else if (kind == 'v' && i < cfg->viewers && strstr(line, " read"))
+            listed[cfg->writers + i] = 1;
+    }
+    int added = 0;
+    for (int i = 0; i < total; i++)
+    {
+        if (listed[i])
+            continue;
+        if (!ended)
+        {
+            fputc('\n', out);
+            ended = true;
+        }
+        if (i < cfg->writers)
+            fprintf(out, "lg_w%d write\n", i);
+        else
+            fprintf(out, "lg_v%d read\n", i - cfg->writers);
+        added++;
+    }
+    free(listed);
+    int rc = fclose(out) == 0 ? added : -1;
+    fseek(f, 0, SEEK_END);
+    added_text->size = ftell(f);
+    if (rc > 0 && fwrite(added_text->text, 1, added_text->len, f) != added_text->len)
+        rc = -1;
+    if (fclose(f) != 0)
+        rc = -1;
+    return rc;
+}
+
+// Cut the lines ensure_roles added, provided they are still the end of the
+// file; anything edited meanwhile is left alone
+static void remove_roles(const config_t *cfg, const roles_added_t *added_text)
+{
+    FILE *f = fopen(cfg->roles, "r");
+    char *tail = malloc(added_text->len + 1);
+    bool intact = f && tail && fseek(f, 0, SEEK_END) == 0 &&
+                  ftell(f) == added_text->size + (long)added_text->len &&
+                  fseek(f, added_text->size, SEEK_SET) == 0 &&
+                  fread(tail, 1, added_text->len + 1, f) == added_text->len &&
+                  memcmp(tail, added_text->text, added_text->len) == 0;
+    if (f)
+        fclose(f);
+    free(tail);
+    if (!intact || truncate(cfg->roles, added_text->size) < 0)
+        fprintf(stderr, "%s changed during the run; loadgen users left in it\n", cfg->roles);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-w WRITERS] [-v VIEWERS] [-r RATE] [-d SECONDS] [-s STAGGER_US]\n"
+            "          [-x INSERT,DELETE,FORMAT] [-f ROLES_FILE] <server_pid>\n",
+            prog);
+    exit(1);
+}
+
+static void print_hist_ms(const char *name, const hist_t *h)
+{
+    printf("  \"%s\": {\"count\": %llu, \"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, "
+           "\"max\": %.3f},\n",
+           name, (unsigned long long)h->count, h->count ? h->sum / 1e6 / h->count : 0.0,
+           hist_quantile(h, 0.5) / 1e6, hist_quantile(h, 0.99) / 1e6, hist_quantile(h, 0.999) / 1e6,
+           h->max / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    config_t cfg = {.writers = 4, .viewers = 4, .rate = 10, .duration = 10, .mix = {60, 20, 20}};
+    int opt;
+    while ((opt = getopt(argc, argv, "w:v:r:d:s:x:f:")) != -1)
+    {
+        if (opt == 'w')
+            cfg.writers = atoi(optarg);
+        else if (opt == 'v')
+            cfg.viewers = atoi(optarg);
+        else if (opt == 'r')
+            cfg.rate = atof(optarg);
+        else if (opt == 'd')
+            cfg.duration = atoi(optarg);
+        else if (opt == 's')
+            cfg.stagger_us = atoi(optarg);
+        else if (opt == 'x')
+        {
+            if (sscanf(optarg, "%d,%d,%d", &cfg.mix[0], &cfg.mix[1], &cfg.mix[2]) != 3 ||
+                cfg.mix[0] + cfg.mix[1] + cfg.mix[2] != 100)
+            {
+                fprintf(stderr, "-x takes three percentages adding up to 100\n");
+                exit(1);
+            }
+        }
+        else if (opt == 'f')
+            cfg.roles = optarg;
+        else
+            usage(argv[0]);
+    }
+    if (argc - optind != 1 || cfg.writers < 0 || cfg.viewers < 0 || cfg.duration <= 0)
+        usage(argv[0]);
+    cfg.server = atoi(argv[optind]);
+    int total = cfg.writers + cfg.viewers;
+
+    roles_added_t added_text = {0};
+    int added = cfg.roles ? ensure_roles(&cfg, &added_text) : 0;
+    if (added < 0)
+    {
+        perror("Failed to update roles file");
+        exit(1);
+    }
+    if (added > 0)
+    {
+        fprintf(stderr, "Added %d loadgen users to %s for this run\n", added, cfg.roles);
+        usleep(200000); // Let the server reload it
+    }
+
+    result_t *results = mmap(NULL, total * sizeof(result_t), PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+
+    // Children inherit the mask, so the server's answer cannot arrive
+    // before it is blocked
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGRTMIN + 1);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t *pids = calloc(total, sizeof(pid_t));
+    for (int i = 0; i < total; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] == 0)
+        {
+            run_client(&cfg, i, &results[i]);
+            char fifo[64];
+            snprintf(fifo, sizeof(fifo), "FIFO_C2S_%d", getpid());
+            unlink(fifo);
+            snprintf(fifo, sizeof(fifo), "FIFO_S2C_%d", getpid());
+            unlink(fifo);
+            _exit(0);
+        }
+        if (pids[i] < 0)
+        {
+            perror("fork");
+            total = i;
+            break;
+        }
+        if (cfg.stagger_us > 0)
+            usleep(cfg.stagger_us);
+    }
+    for (int i = 0; i < total; i++)
+        waitpid(pids[i], NULL, 0);
+
+    // Merge and report
+    static hist_t connect, latency;
+    uint64_t sent = 0, applied = 0, failed = 0, lost = 0, resyncs = 0;
+    uint64_t bytes_min = UINT64_MAX, bytes_max = 0, bytes_total = 0;
+    int connected = 0, rejected = 0;
+    for (int i = 0; i < total; i++)
+    {
+        result_t *r = &results[i];
+        hist_merge(&connect, &r->connect);
+        hist_merge(&latency, &r->latency);
+        sent += r->sent;
+        applied += r->applied;
+        failed += r->failed;
+        lost += r->lost;
+        connected += r->connected;
+        rejected += r->rejected;
+        if (!r->connected)
+            continue;
+        resyncs += r->resyncs;
+        bytes_total += r->bytes;
+        bytes_min = r->bytes < bytes_min ? r->bytes : bytes_min;
+        bytes_max = r->bytes > bytes_max ? r->bytes : bytes_max;
+    }
+
+    printf("{\n");
+    printf("  \"writers\": %d, \"viewers\": %d, \"rate\": %.1f, \"duration_s\": %d,\n", cfg.writers,
+           cfg.viewers, cfg.rate, cfg.duration);
+    printf("  \"connected\": %d, \"rejected\": %d, \"failed_to_connect\": %d,\n", connected, rejected,
+           total - connected - rejected);
+    printf("  \"commands\": {\"sent\": %llu, \"applied\": %llu, \"rejected\": %llu, \"lost\": %llu, "
+           "\"per_s\": %.1f},\n",
+           (unsigned long long)sent, (unsigned long long)applied, (unsigned long long)failed,
+           (unsigned long long)lost, (double)applied / cfg.duration);
+    print_hist_ms("connect_ms", &connect);
+    print_hist_ms("command_to_broadcast_ms", &latency);
+    printf("  \"snapshots_after_connect\": %llu,\n", (unsigned long long)resyncs);
+    printf("  \"bytes_received\": {\"min\": %llu, \"mean\": %.0f, \"max\": %llu, \"per_client\": [",
+           (unsigned long long)(connected ? bytes_min : 0), connected ? (double)bytes_total / connected : 0.0,
+           (unsigned long long)bytes_max);
+    for (int i = 0; i < total; i++)
+        printf("%s%llu", i ? ", " : "", (unsigned long long)results[i].bytes);
+    printf("]}\n}\n");
+    if (added > 0)
+        remove_roles(&cfg, &added_text);
+    free(added_text.text);
+    return connected == total ? 0 : 1;
+}
@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "outq.h"
+
+// Messages handed to one writev when flushing
+#define OUTQ_FLUSH_IOV 16
+
+void outq_init(outq_t *q)
+{
+    q->head = q->tail = NULL;
+    q->bytes = q->backlog = 0;
+    q->streams = 0;
+}
+
+static void msg_free(outq_msg_t *m)
+{
+    if (m->kind == OUTQ_STREAM)
+        m->release(m->stream);
+    free(m);
+}
+
+void outq_free(outq_t *q)
+{
+    while (q->head)
+    {
+        outq_msg_t *m = q->head;
+        q->head = m->next;
+        msg_free(m);
+    }
+    outq_init(q);
+}
+
+static size_t iov_total(const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    return total;
+}
+
+// Count n unsent bytes of m in or out of the queue totals
+static void account_add(outq_t *q, const outq_msg_t *m, size_t n)
+{
+    q->bytes += n;
+    if (m->kind == OUTQ_BLOCK)
+        q->backlog += n;
+}
+
+static void account_sub(outq_t *q, const outq_msg_t *m, size_t n)
+{
+    q->bytes -= n;
+    if (m->kind == OUTQ_BLOCK)
+        q->backlog -= n;
+}
+
+// Queue a message of which the first sent bytes have already been written
+int outq_push(outq_t *q, outq_kind_t kind, unsigned long version, const struct iovec *iov, int iovcnt,
+              size_t sent)
+{
+    size_t len = iov_total(iov, iovcnt);
+    outq_msg_t *m = malloc(sizeof(outq_msg_t) + len);
+    if (!m)
+        return -1;
+    m->next = NULL;
+    m->kind = kind;
+    m->version = version;
+    m->len = len;
+    m->sent = sent;
+    m->stream = NULL;
+    size_t off = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(m->data + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+
+    if (q->tail)
+        q->tail->next = m;
+    else
+        q->head = m;
+    q->tail = m;
+    account_add(q, m, len - sent);
+    return 0;
+}
+
+// Send a message, writing what the FIFO takes now if nothing is queued ahead
+// of it and queueing the rest. Sets *done_version when a block or snapshot
+// went out whole. Returns -1 if the FIFO failed or the queue could not grow.
+int outq_write(outq_t *q, int fd, outq_kind_t kind, unsigned long version, const struct iovec *iov,
+               int iovcnt, unsigned long *done_version)
+{
+    size_t sent = 0;
+    if (!q->head)
+    {
+        ssize_t n;
+        do
+            n = writev(fd, iov, iovcnt);
+        while (n < 0 && errno == EINTR);
+        if (n < 0 && errno != EAGAIN)
+            return -1;
+        sent = n > 0 ? (size_t)n : 0;
+        if (sent == iov_total(iov, iovcnt))
+        {
+            if (kind != OUTQ_REPLY)
+                *done_version = version;
+            return 0;
+        }
+    }
+    return outq_push(q, kind, version, iov, iovcnt, sent);
+}
+
+// Write as much of the queue as the FIFO takes. Returns 1 once the queue is
+// empty or a stream is at its head, 0 if the FIFO filled up first, -1 if it
+// failed.
+int outq_flush(outq_t *q, int fd, unsigned long *done_version)
+{
+    while (q->head && q->head->kind != OUTQ_STREAM)
+    {
+        struct iovec iov[OUTQ_FLUSH_IOV];
+        int iovcnt = 0;
+        for (outq_msg_t *m = q->head; m && m->kind != OUTQ_STREAM && iovcnt < OUTQ_FLUSH_IOV; m = m->next)
+        {
+            iov[iovcnt].iov_base = m->data + m->sent;
+            iov[iovcnt].iov_len = m->len - m->sent;
+            iovcnt++;
+        }
+
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        size_t left = n;
+        while (left > 0)
+        {
+            outq_msg_t *m = q->head;
+            size_t take = m->len - m->sent < left ? m->len - m->sent : left;
+            m->sent += take;
+            left -= take;
+            account_sub(q, m, take);
+            if (m->sent < m->len)
+                break;
+            if (m->kind != OUTQ_REPLY)
+                *done_version = m->version;
+            q->head = m->next;
+            if (!q->head)
+                q->tail = NULL;
+            free(m);
+        }
+        if ((size_t)n < iov_total(iov, iovcnt))
+            return 0;
+    }
+    return 1;
+}
+
+// Drop every block and snapshot not yet started, ahead of a fresh snapshot
+// that replaces them. A message already partly written is kept so the
+// stream stays framed, and replies, streamed or not, are kept since nothing
+// supersedes them.
+// Returns the number of bytes dropped.
+size_t outq_drop_stale(outq_t *q)
+{
+    size_t dropped = 0;
+    outq_msg_t **link = &q->head;
+    q->tail = NULL;
+    while (*link)
+    {
+        outq_msg_t *m = *link;
+        if (m->sent == 0 && (m->kind == OUTQ_BLOCK || m->kind == OUTQ_SNAPSHOT))
+        {
+            *link = m->next;
+            account_sub(q, m, m->len);
+            dropped += m->len;
+            free(m);
+        }
+        else
+        {
+            q->tail = m;
+            link = &m->next;
+        }
+    }
+    return dropped;
+}
+
+// Queue a placeholder for a streamed reply; release frees the stream if the
+// queue is dropped before it is done
+int outq_push_stream(outq_t *q, void *stream, void (*release)(void *))
+{
+    outq_msg_t *m = calloc(1, sizeof(outq_msg_t));
+    if (!m)
+        return -1;
+    m->kind = OUTQ_STREAM;
+    m->stream = stream;
+    m->release = release;
+    if (q->tail)
+        q->tail->next = m;
+    else
+        q->head = m;
+    q->tail = m;
+    q->streams++;
+    return 0;
+}
+
+// The stream whose turn it is to be written, or NULL if there is none
+void *outq_stream(const outq_t *q)
+{
+    return q->head && q->head->kind == OUTQ_STREAM ? q->head->stream : NULL;
+}
+
+// Queue the next piece of the stream at the head, ahead of its placeholder
+int outq_push_piece(outq_t *q, const char *data, size_t len)
+{
+    outq_msg_t *m = malloc(sizeof(outq_msg_t) + len);
+    if (!m)
+        return -1;
+    m->next = q->head;
+    m->kind = OUTQ_REPLY;
+    m->version = 0;
+    m->len = len;
+    m->sent = 0;
+    m->stream = NULL;
+    memcpy(m->data, data, len);
+    q->head = m;
+    if (!q->tail)
+        q->tail = m;
+    account_add(q, m, len);
+    return 0;
+}
+
+// Remove the placeholder of the stream at the head, which has been produced
+// in full, and release the stream
+void outq_end_stream(outq_t *q)
+{
+    outq_msg_t *m = q->head;
+    q->head = m->next;
+    if (!q->head)
+        q->tail = NULL;
+    q->streams--;
+    msg_free(m);
+}
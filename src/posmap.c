@@ -0,0 +1,403 @@
+#include <stdlib.h>
+#include <string.h>
+#include "posmap.h"
+
+// Grow an array to hold at least n elements; the map cannot be left half
+// updated, so running out of memory is fatal
+static void *grow(void *arr, size_t *cap, size_t n, size_t elem)
+{
+    if (n <= *cap)
+        return arr;
+    size_t new_cap = *cap ? *cap : 16;
+    while (new_cap < n)
+        new_cap *= 2;
+    arr = realloc(arr, new_cap * elem);
+    if (!arr)
+        abort();
+    *cap = new_cap;
+    return arr;
+}
+
+static unsigned int next_priority(posmap_t *m)
+{
+    // xorshift32
+    unsigned int x = m->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    m->seed = x;
+    return x;
+}
+
+// Nodes are referred to by index, since the pool moves as it grows; a
+// pointer into it is only held where nothing is allocated
+
+static size_t node_size(const posmap_t *m, size_t t)
+{
+    return t ? m->nodes[t].size : 0;
+}
+
+static void node_update(posmap_t *m, size_t t)
+{
+    posmap_node_t *n = &m->nodes[t];
+    const posmap_node_t *l = n->left ? &m->nodes[n->left] : NULL;
+    const posmap_node_t *r = n->right ? &m->nodes[n->right] : NULL;
+    size_t own = n->kind == PIECE_BASE ? n->base : POSMAP_NONE;
+    n->size = (l ? l->size : 0) + n->len + (r ? r->size : 0);
+    n->first_base = l && l->first_base != POSMAP_NONE ? l->first_base
+                    : own != POSMAP_NONE              ? own
+                    : r                               ? r->first_base
+                                                      : POSMAP_NONE;
+    n->last_base = r && r->last_base != POSMAP_NONE ? r->last_base
+                   : own != POSMAP_NONE             ? own
+                   : l                              ? l->last_base
+                                                    : POSMAP_NONE;
+}
+
+static size_t node_new(posmap_t *m, piece_kind_t kind, size_t base, size_t len)
+{
+    m->nodes = grow(m->nodes, &m->cap, m->count + 1, sizeof(posmap_node_t));
+    size_t t = m->count++;
+    m->nodes[t] = (posmap_node_t){.kind = kind, .base = base, .len = len, .prio = next_priority(m)};
+    node_update(m, t);
+    return t;
+}
+
+// Reuse node t as a lone piece
+static size_t node_reset(posmap_t *m, size_t t, size_t base, size_t len)
+{
+    m->nodes[t].base = base;
+    m->nodes[t].len = len;
+    m->nodes[t].left = 0;
+    m->nodes[t].right = 0;
+    node_update(m, t);
+    return t;
+}
+
+static size_t merge(posmap_t *m, size_t a, size_t b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (m->nodes[a].prio > m->nodes[b].prio)
+    {
+        size_t r = merge(m, m->nodes[a].right, b);
+        m->nodes[a].right = r;
+        node_update(m, a);
+        return a;
+    }
+    size_t l = merge(m, a, m->nodes[b].left);
+    m->nodes[b].left = l;
+    node_update(m, b);
+    return b;
+}
+
+// Split t at current offset cur: pieces ending at or before cur go to *l and
+// the rest to *r, cutting in two a piece that straddles cur
+static void split(posmap_t *m, size_t t, size_t cur, size_t *l, size_t *r)
+{
+    if (!t)
+    {
+        *l = *r = 0;
+        return;
+    }
+    size_t left_size = node_size(m, m->nodes[t].left);
+    size_t a, b;
+    if (cur <= left_size)
+    {
+        split(m, m->nodes[t].left, cur, &a, &b);
+        m->nodes[t].left = b;
+        node_update(m, t);
+        *l = a;
+        *r = t;
+    }
+    else if (cur >= left_size + m->nodes[t].len)
+    {
+        split(m, m->nodes[t].right, cur - left_size - m->nodes[t].len, &a, &b);
+        m->nodes[t].right = a;
+        node_update(m, t);
+        *l = t;
+        *r = b;
+    }
+    else
+    {
+        posmap_node_t n = m->nodes[t];
+        size_t k = cur - left_size;
+        size_t tail = node_new(m, n.kind, n.kind == PIECE_BASE ? n.base + k : n.base, n.len - k);
+        m->nodes[t].len = k;
+        m->nodes[t].right = 0;
+        node_update(m, t);
+        *l = t;
+        *r = merge(m, tail, n.right);
+    }
+}
+
+// Split t where before() turns false: the pieces it holds for go to *l, the
+// rest to *r. before() must hold for a prefix of the pieces in order.
+static void split_where(posmap_t *m, size_t t, bool (*before)(const posmap_node_t *, size_t), size_t pos,
+                        size_t *l, size_t *r)
+{
+    if (!t)
+    {
+        *l = *r = 0;
+        return;
+    }
+    size_t a, b;
+    if (before(&m->nodes[t], pos))
+    {
+        split_where(m, m->nodes[t].right, before, pos, &a, &b);
+        m->nodes[t].right = a;
+        node_update(m, t);
+        *l = t;
+        *r = b;
+    }
+    else
+    {
+        split_where(m, m->nodes[t].left, before, pos, &a, &b);
+        m->nodes[t].left = b;
+        node_update(m, t);
+        *l = a;
+        *r = t;
+    }
+}
+
+void posmap_init(posmap_t *m)
+{
+    memset(m, 0, sizeof(*m));
+    m->seed = 0x9e3779b9u;
+}
+
+void posmap_free(posmap_t *m)
+{
+    free(m->nodes);
+    free(m->cuts);
+    memset(m, 0, sizeof(*m));
+}
+
+// Start a new version over a document of base_len bytes: the identity map
+void posmap_reset(posmap_t *m, size_t base_len)
+{
+    m->count = 1;
+    m->root = 0;
+    m->ncuts = 0;
+    m->base_len = base_len;
+    m->length = base_len;
+    if (base_len > 0)
+        m->root = node_new(m, PIECE_BASE, 0, base_len);
+}
+
+// Whether a piece lies wholly before base cursor pos. Text inserted at the
+// same cursor counts as before it, so later insertions land after earlier ones.
+static bool piece_before(const posmap_node_t *p, size_t pos)
+{
+    if (p->kind == PIECE_BASE)
+        return p->base + p->len <= pos;
+    return p->base <= pos;
+}
+
+// Whether a piece lies wholly before a deletion starting at base cursor pos
+static bool before_deletion(const posmap_node_t *p, size_t pos)
+{
+    if (p->kind == PIECE_BASE)
+        return p->base + p->len <= pos;
+    return p->base < pos;
+}
+
+// Whether a piece not before a deletion reaches into one ending at base
+// cursor pos, and so may lose text to it
+static bool reaches_deletion(const posmap_node_t *p, size_t pos)
+{
+    if (p->kind == PIECE_BASE)
+        return p->base < pos;
+    return p->base <= pos;
+}
+
+// Current offset of base cursor pos
+size_t posmap_translate(const posmap_t *m, size_t pos)
+{
+    // First piece not wholly before pos
+    size_t found = 0, found_cur = 0, offset = 0;
+    for (size_t t = m->root; t;)
+    {
+        const posmap_node_t *n = &m->nodes[t];
+        size_t left_size = node_size(m, n->left);
+        if (piece_before(n, pos))
+        {
+            offset += left_size + n->len;
+            t = n->right;
+        }
+        else
+        {
+            found = t;
+            found_cur = offset + left_size;
+            t = n->left;
+        }
+    }
+    if (!found)
+        return m->length;
+    const posmap_node_t *p = &m->nodes[found];
+    if (p->kind == PIECE_BASE && p->base < pos)
+        return found_cur + (pos - p->base);
+    return found_cur;
+}
+
+// Whether base cursor pos falls strictly inside text deleted in this version.
+// If so, [start, end) is the deleted base range around it. Base text only
+// ever leaves the map by deletion, so that range is the gap between the
+// surviving base runs either side of pos.
+bool posmap_deleted(const posmap_t *m, size_t pos, size_t *start, size_t *end)
+{
+    // Last base run starting before pos; base runs are in base order
+    size_t before = 0;
+    for (size_t t = m->root; t;)
+    {
+        const posmap_node_t *n = &m->nodes[t];
+        if (n->right && m->nodes[n->right].first_base < pos)
+            t = n->right;
+        else if (n->kind == PIECE_BASE && n->base < pos)
+        {
+            before = t;
+            break;
+        }
+        else
+            t = n->left;
+    }
+    size_t gap_start = before ? m->nodes[before].base + m->nodes[before].len : 0;
+    if (gap_start >= pos)
+        return false;
+
+    // First base run starting at or after pos
+    size_t after = 0;
+    for (size_t t = m->root; t;)
+    {
+        const posmap_node_t *n = &m->nodes[t];
+        const posmap_node_t *l = n->left ? &m->nodes[n->left] : NULL;
+        if (l && l->last_base != POSMAP_NONE && l->last_base >= pos)
+            t = n->left;
+        else if (n->kind == PIECE_BASE && n->base >= pos)
+        {
+            after = t;
+            break;
+        }
+        else
+            t = n->right;
+    }
+    size_t gap_end = after ? m->nodes[after].base : m->base_len;
+    if (pos >= gap_end)
+        return false;
+    *start = gap_start;
+    *end = gap_end;
+    return true;
+}
+
+// Base cursor that current offset cur belongs to, for edits located by
+// scanning the current text rather than by a base position
+size_t posmap_anchor(const posmap_t *m, size_t cur)
+{
+    for (size_t t = m->root; t;)
+    {
+        const posmap_node_t *n = &m->nodes[t];
+        size_t left_size = node_size(m, n->left);
+        if (cur < left_size)
+        {
+            t = n->left;
+        }
+        else if (cur < left_size + n->len)
+        {
+            if (n->kind == PIECE_BASE)
+                return n->base + (cur - left_size);
+            return n->base;
+        }
+        else
+        {
+            cur -= left_size + n->len;
+            t = n->right;
+        }
+    }
+    return m->base_len;
+}
+
+// Record len bytes inserted at current offset cur, tied to base cursor anchor
+void posmap_insert(posmap_t *m, size_t cur, size_t len, piece_kind_t kind, size_t anchor)
+{
+    if (len == 0)
+        return;
+    size_t l, r;
+    split(m, m->root, cur, &l, &r);
+    size_t t = node_new(m, kind, anchor, len);
+    m->root = merge(m, merge(m, l, t), r);
+    m->length += len;
+}
+
+static void add_cut(posmap_t *m, size_t start, size_t end)
+{
+    if (m->ncuts > 0 && m->cuts[m->ncuts - 1].end == start)
+    {
+        m->cuts[m->ncuts - 1].end = end;
+        return;
+    }
+    m->cuts = grow(m->cuts, &m->cuts_cap, m->ncuts + 1, sizeof(posmap_span_t));
+    m->cuts[m->ncuts++] = (posmap_span_t){start, end};
+}
+
+// Walk subtree t in order, cutting what deleting base [start, end) removes
+// and merging what survives onto *kept. *cur is the current offset reached.
+static void cut_range(posmap_t *m, size_t t, size_t start, size_t end, size_t *cur, size_t *kept)
+{
+    if (!t)
+        return;
+    size_t right = m->nodes[t].right;
+    cut_range(m, m->nodes[t].left, start, end, cur, kept);
+
+    posmap_node_t p = m->nodes[t];
+    size_t orig_cur = *cur;
+    *cur += p.len;
+    if (p.kind == PIECE_BASE && p.base < end && p.base + p.len > start)
+    {
+        // Keep the parts of the run outside [start, end)
+        size_t cut_from = p.base > start ? p.base : start;
+        size_t cut_to = p.base + p.len < end ? p.base + p.len : end;
+        add_cut(m, orig_cur + (cut_from - p.base), orig_cur + (cut_to - p.base));
+        size_t tail_len = p.base + p.len - cut_to;
+        if (cut_from > p.base)
+            *kept = merge(m, *kept, node_reset(m, t, p.base, cut_from - p.base));
+        if (tail_len > 0)
+        {
+            size_t tail = cut_from > p.base ? node_new(m, PIECE_BASE, cut_to, tail_len)
+                                            : node_reset(m, t, cut_to, tail_len);
+            *kept = merge(m, *kept, tail);
+        }
+    }
+    else if ((p.kind == PIECE_PREFIX && p.base >= start && p.base < end) ||
+             (p.kind == PIECE_SUFFIX && p.base > start && p.base <= end))
+    {
+        add_cut(m, orig_cur, orig_cur + p.len); // A marker of deleted text
+    }
+    else
+    {
+        *kept = merge(m, *kept, node_reset(m, t, p.base, p.len));
+    }
+    cut_range(m, right, start, end, cur, kept);
+}
+
+// Delete base text [start, end) together with the formatting markers that
+// belong to it. Text INSERTed inside the range is kept. The current ranges to
+// remove from the document are left in m->cuts, in ascending order. Only the
+// pieces reaching into the range are visited.
+void posmap_delete(posmap_t *m, size_t start, size_t end)
+{
+    m->ncuts = 0;
+    if (start >= end)
+        return;
+    size_t before, rest, inside, after;
+    split_where(m, m->root, before_deletion, start, &before, &rest);
+    split_where(m, rest, reaches_deletion, end, &inside, &after);
+
+    size_t cur = node_size(m, before);
+    size_t inside_len = node_size(m, inside);
+    size_t kept = 0;
+    cut_range(m, inside, start, end, &cur, &kept);
+    m->length -= inside_len - node_size(m, kept);
+    m->root = merge(m, merge(m, before, kept), after);
+}
@@ -1,15 +1,241 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include "protocol.h"
 
-int send_document(int fd, const char *role, unsigned long version, const char *doc, size_t len)
+// Header of a snapshot message, "role\nversion\nlen\n"; the len document
+// bytes follow it
+int document_header(char *buf, size_t size, const char *role, unsigned long version, size_t len)
 {
-    char buf[128];
-    int n = snprintf(buf, sizeof(buf), "%s\n%lu\n%zu\n", role, version, len);
-    if (write(fd, buf, n) != n)
+    return snprintf(buf, size, "%s\n%lu\n%zu\n", role, version, len);
+}
+
+// Framer states
+enum
+{
+    FR_START,        // First line of a message
+    FR_VERSION_NEXT, // Line after "VERSION n": a block, or a DOC? reply
+    FR_BLOCK,        // Lines of a VERSION block, up to END
+    FR_SNAP_VERSION, // Snapshot version line
+    FR_SNAP_LEN,     // Snapshot length line
+    FR_BODY,         // Length-framed body bytes
+    FR_DONE          // Message handed out; reset on the next call
+};
+
+int framer_init(framer_t *f, size_t cap)
+{
+    memset(f, 0, sizeof(*f));
+    f->cap = 1;
+    while (f->cap < cap)
+        f->cap *= 2;
+    f->ring = malloc(f->cap);
+    return f->ring ? 0 : -1;
+}
+
+void framer_free(framer_t *f)
+{
+    free(f->ring);
+    free(f->msg);
+}
+
+static int msg_reserve(framer_t *f, size_t extra)
+{
+    if (f->msg_len + extra + 1 <= f->msg_cap)
+        return 0;
+    size_t cap = f->msg_cap ? f->msg_cap : 256;
+    while (cap < f->msg_len + extra + 1)
+        cap *= 2;
+    char *msg = realloc(f->msg, cap);
+    if (!msg)
         return -1;
-    if (write(fd, doc, len) != (ssize_t)len)
+    f->msg = msg;
+    f->msg_cap = cap;
+    return 0;
+}
+
+// Contiguous unread bytes at the ring's read position
+static size_t ring_segment(const framer_t *f, const char **p)
+{
+    size_t off = f->rpos & (f->cap - 1);
+    size_t avail = f->wpos - f->rpos;
+    *p = f->ring + off;
+    return avail < f->cap - off ? avail : f->cap - off;
+}
+
+// Read once from fd. While a body is pending and the ring is empty, the
+// bytes go straight into the message buffer instead of through the ring.
+ssize_t framer_fill(framer_t *f, int fd)
+{
+    if (f->state == FR_BODY && f->body_left > 0 && f->rpos == f->wpos)
+    {
+        ssize_t n = read(fd, f->msg + f->msg_len, f->body_left);
+        if (n > 0)
+        {
+            f->msg_len += n;
+            f->body_left -= n;
+        }
+        return n;
+    }
+
+    size_t used = f->wpos - f->rpos;
+    size_t off = f->wpos & (f->cap - 1);
+    size_t room = f->cap - used < f->cap - off ? f->cap - used : f->cap - off;
+    if (room == 0)
+    {
+        errno = ENOBUFS;
         return -1;
+    }
+    ssize_t n = read(fd, f->ring + off, room);
+    if (n > 0)
+        f->wpos += n;
+    return n;
+}
+
+// Move ring bytes into msg up to and including the next newline.
+// Returns 1 once a whole line has been taken, 0 if more input is needed.
+static int take_line(framer_t *f)
+{
+    const char *p;
+    size_t n;
+    while ((n = ring_segment(f, &p)) > 0)
+    {
+        const char *nl = memchr(p, '\n', n);
+        size_t take = nl ? (size_t)(nl - p) + 1 : n;
+        if (msg_reserve(f, take) < 0)
+            return -1;
+        memcpy(f->msg + f->msg_len, p, take);
+        f->msg_len += take;
+        f->rpos += take;
+        if (nl)
+            return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+static void begin_body(framer_t *f, msg_type_t type, size_t len)
+{
+    f->frame.type = type;
+    f->body_start = f->msg_len;
+    f->body_left = len;
+    f->state = FR_BODY;
+}
+
+// Produce the next complete message. Returns 1 with *out filled in, 0 if
+// more input is needed, or -1 if out of memory.
+int framer_next(framer_t *f, frame_t *out)
+{
+    if (f->state == FR_DONE)
+    {
+        f->state = FR_START;
+        f->msg_len = 0;
+        f->line_start = 0;
+    }
+
+    while (1)
+    {
+        if (f->state == FR_BODY)
+        {
+            if (msg_reserve(f, f->body_left) < 0)
+                return -1;
+            const char *p;
+            size_t n;
+            while (f->body_left > 0 && (n = ring_segment(f, &p)) > 0)
+            {
+                size_t take = n < f->body_left ? n : f->body_left;
+                memcpy(f->msg + f->msg_len, p, take);
+                f->msg_len += take;
+                f->rpos += take;
+                f->body_left -= take;
+            }
+            if (f->body_left > 0)
+                return 0;
+            f->msg[f->msg_len] = '\0';
+            f->frame.text = f->msg + f->body_start;
+            f->frame.len = f->msg_len - f->body_start;
+            f->state = FR_DONE;
+            *out = f->frame;
+            return 1;
+        }
+
+        int r = take_line(f);
+        if (r <= 0)
+            return r;
+        char *line = f->msg + f->line_start;
+        size_t line_len = f->msg_len - f->line_start - 1;
+        f->msg[f->msg_len] = '\0';
+
+        switch (f->state)
+        {
+        case FR_START:
+            if (line_len == 0)
+            {
+                // Blank separator line
+                f->msg_len = 0;
+                continue;
+            }
+            memset(&f->frame, 0, sizeof(f->frame));
+            if (strncmp(line, "VERSION ", 8) == 0)
+            {
+                f->frame.version = strtoul(line + 8, NULL, 10);
+                f->state = FR_VERSION_NEXT;
+            }
+            else if (strncmp(line, "LOG (", 5) == 0)
+            {
+                begin_body(f, MSG_LOG_REPLY, strtoul(line + 5, NULL, 10));
+            }
+            else if (strncmp(line, "STATS (", 7) == 0)
+            {
+                begin_body(f, MSG_STATS_REPLY, strtoul(line + 7, NULL, 10));
+            }
+            else if ((line_len == 5 && memcmp(line, "write", 5) == 0) ||
+                     (line_len == 4 && memcmp(line, "read", 4) == 0))
+            {
+                memcpy(f->frame.role, line, line_len);
+                f->state = FR_SNAP_VERSION;
+            }
+            else
+            {
+                line[line_len] = '\0';
+                f->frame.type = MSG_REPLY;
+                f->frame.text = line;
+                f->frame.len = line_len;
+                f->state = FR_DONE;
+                *out = f->frame;
+                return 1;
+            }
+            break;
+
+        case FR_VERSION_NEXT:
+            if (strncmp(line, "DOCUMENT (", 10) == 0)
+            {
+                begin_body(f, MSG_DOC_REPLY, strtoul(line + 10, NULL, 10));
+                break;
+            }
+            f->frame.type = MSG_VERSION;
+            f->state = FR_BLOCK;
+            // fall through
+        case FR_BLOCK:
+            if (line_len == 3 && memcmp(line, "END", 3) == 0)
+            {
+                f->frame.text = f->msg;
+                f->frame.len = f->msg_len;
+                f->state = FR_DONE;
+                *out = f->frame;
+                return 1;
+            }
+            break;
+
+        case FR_SNAP_VERSION:
+            f->frame.version = strtoul(line, NULL, 10);
+            f->state = FR_SNAP_LEN;
+            break;
+
+        case FR_SNAP_LEN:
+            begin_body(f, MSG_SNAPSHOT, strtoul(line, NULL, 10));
+            break;
+        }
+        f->line_start = f->msg_len;
+    }
+}
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include "roles.h"
+#include "epoch.h"
+
+static const char *const role_names[] = {NULL, "read", "write"};
+
+typedef struct
+{
+    uint64_t hash;   // 0 marks an empty slot
+    uint32_t name;   // Offset of the NUL-terminated name in the arena
+    uint32_t role;   // Index into role_names
+} roles_slot_t;
+
+// Immutable once published: slots, then the names they point at
+typedef struct
+{
+    size_t mask;  // Slot count - 1; the slot count is a power of two
+    size_t users;
+    char *names;
+    roles_slot_t slots[];
+} roles_table_t;
+
+static _Atomic(roles_table_t *) published;
+static epoch_t table_epoch; // Lookups run inside it, so a replaced table can be freed
+
+// FNV-1a, with 0 reserved for empty slots
+static uint64_t hash_name(const char *s, size_t n)
+{
+    uint64_t h = 0xcbf29ce484222325u;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ (uint8_t)s[i]) * 0x100000001b3u;
+    return h ? h : 1;
+}
+
+static const char *skip_blank(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    return p;
+}
+
+static const char *skip_word(const char *p, const char *end)
+{
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+        p++;
+    return p;
+}
+
+// Split one line into its username and role. Returns the role's index in
+// role_names, 0 for a blank line, or -1 if the line is malformed.
+static int parse_line(const char *p, const char *end, const char **name, size_t *name_len)
+{
+    p = skip_blank(p, end);
+    if (p == end)
+        return 0;
+    *name = p;
+    p = skip_word(p, end);
+    *name_len = p - *name;
+    const char *role = skip_blank(p, end);
+    if (role == p)
+        return -1;
+    p = skip_word(role, end);
+    if (skip_blank(p, end) != end)
+        return -1;
+    for (int r = 1; r <= 2; r++)
+        if ((size_t)(p - role) == strlen(role_names[r]) && memcmp(role, role_names[r], p - role) == 0)
+            return r;
+    return -1;
+}
+
+// Find the slot holding name, or the empty slot where it belongs
+static roles_slot_t *find_slot(roles_table_t *t, const char *name, size_t n, uint64_t h)
+{
+    for (size_t i = h & t->mask;; i = (i + 1) & t->mask)
+    {
+        roles_slot_t *s = &t->slots[i];
+        if (s->hash == 0 || (s->hash == h && strncmp(t->names + s->name, name, n) == 0 &&
+                             t->names[s->name + n] == '\0'))
+            return s;
+    }
+}
+
+// Build a table from the file's contents. A user listed twice gets the role
+// on the later line.
+static roles_table_t *build_table(const char *text, size_t len)
+{
+    // Size for one user per line at most half the slots
+    size_t lines = 1;
+    for (const char *p = text; (p = memchr(p, '\n', text + len - p)) != NULL; p++)
+        lines++;
+    size_t slots = 16;
+    while (slots < lines * 2)
+        slots *= 2;
+
+    roles_table_t *t = calloc(1, sizeof(roles_table_t) + slots * sizeof(roles_slot_t));
+    char *names = malloc(len + lines);
+    if (!t || !names || len + lines > UINT32_MAX)
+    {
+        free(t);
+        free(names);
+        return NULL;
+    }
+    t->mask = slots - 1;
+    t->names = names;
+
+    size_t used = 0;
+    int lineno = 0;
+    for (const char *p = text; p < text + len;)
+    {
+        const char *nl = memchr(p, '\n', text + len - p);
+        const char *end = nl ? nl : text + len;
+        lineno++;
+
+        const char *name;
+        size_t n;
+        int role = parse_line(p, end, &name, &n);
+        if (role < 0)
+            fprintf(stderr, "roles.txt:%d: expected \"<username> read|write\"\n", lineno);
+        else if (role > 0)
+        {
+            uint64_t h = hash_name(name, n);
+            roles_slot_t *s = find_slot(t, name, n, h);
+            if (s->hash == 0)
+            {
+                memcpy(names + used, name, n);
+                names[used + n] = '\0';
+                s->hash = h;
+                s->name = used;
+                used += n + 1;
+                t->users++;
+            }
+            s->role = role;
+        }
+        p = end + 1;
+    }
+    return t;
+}
+
+static void free_table(void *arg)
+{
+    roles_table_t *t = arg;
+    if (t)
+        free(t->names);
+    free(t);
+}
+
+static roles_table_t *load_table(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return NULL;
+    char *text = NULL;
+    size_t len = 0, cap = 0;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+        if (len + n > cap)
+        {
+            cap = cap ? cap * 2 : sizeof(buf);
+            while (cap < len + n)
+                cap *= 2;
+            char *grown = realloc(text, cap);
+            if (!grown)
+            {
+                free(text);
+                fclose(f);
+                return NULL;
+            }
+            text = grown;
+        }
+        memcpy(text + len, buf, n);
+        len += n;
+    }
+    fclose(f);
+    roles_table_t *t = build_table(text ? text : "", len);
+    free(text);
+    return t;
+}
+
+// Swap in a new table and retire the old one, to be freed once no lookup
+// can still be reading it
+static void publish(roles_table_t *t)
+{
+    roles_table_t *old = atomic_exchange(&published, t);
+    if (!old)
+        return;
+    epoch_retire(&table_epoch, old, free_table);
+    epoch_reclaim(&table_epoch);
+}
+
+// Role of a user ("read" or "write"), or NULL if not listed. Lock-free: a
+// table being replaced is kept alive until no lookup is inside it.
+const char *roles_lookup(const char *username)
+{
+    epoch_enter(&table_epoch);
+    roles_table_t *t = atomic_load(&published);
+    size_t n = strlen(username);
+    const char *role = NULL;
+    if (t)
+    {
+        roles_slot_t *s = find_slot(t, username, n, hash_name(username, n));
+        if (s->hash)
+            role = role_names[s->role];
+    }
+    epoch_exit(&table_epoch);
+    return role;
+}
+
+typedef struct
+{
+    int fd;
+    char path[256];
+    char name[256]; // File name within the watched directory
+} watch_t;
+
+// Reload the table whenever the file is written or renamed into place.
+// The directory is watched rather than the file so that editors which
+// replace the file still trigger a reload.
+static void *watch_loop(void *arg)
+{
+    watch_t *w = arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1)
+    {
+        ssize_t len = read(w->fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+
+        int changed = 0;
+        for (char *p = buf; p < buf + len;)
+        {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len && strcmp(ev->name, w->name) == 0)
+                changed = 1;
+            p += sizeof(*ev) + ev->len;
+        }
+        if (!changed)
+            continue;
+
+        roles_table_t *t = load_table(w->path);
+        if (!t)
+        {
+            perror("Failed to reload roles; keeping the current ones");
+            continue;
+        }
+        printf("Reloaded %s: %zu users\n", w->path, t->users);
+        publish(t);
+    }
+    close(w->fd);
+    free(w);
+    return NULL;
+}
+
+// Load the roles file and start watching it for changes
+int roles_init(const char *path)
+{
+    if (epoch_init(&table_epoch) < 0)
+        return -1;
+    roles_table_t *t = load_table(path);
+    if (!t)
+        return -1;
+    publish(t);
+
+    watch_t *w = calloc(1, sizeof(watch_t));
+    if (!w)
+        return -1;
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    char dir[256], base[256];
+    snprintf(dir, sizeof(dir), "%s", path);
+    snprintf(base, sizeof(base), "%s", path);
+    snprintf(w->name, sizeof(w->name), "%s", basename(base));
+
+    w->fd = inotify_init1(IN_CLOEXEC);
+    pthread_t tid;
+    if (w->fd < 0 || inotify_add_watch(w->fd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+        pthread_create(&tid, NULL, watch_loop, w) != 0)
+    {
+        if (w->fd >= 0)
+            close(w->fd);
+        free(w);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
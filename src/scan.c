@@ -0,0 +1,207 @@
+#include <string.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+// Portable versions; memchr is already vectorized by the C library, so
+// these are only slow where newlines are dense
+
+static size_t newlines_scalar(const char *p, size_t n)
+{
+    size_t count = 0;
+    for (const char *q = p; (q = memchr(q, '\n', p + n - q)) != NULL; q++)
+        count++;
+    return count;
+}
+
+static const char *nth_newline_scalar(const char *p, size_t n, size_t k)
+{
+    for (const char *q = p; (q = memchr(q, '\n', p + n - q)) != NULL; q++)
+        if (--k == 0)
+            return q;
+    return NULL;
+}
+
+static size_t printable_scalar(const char *p, size_t n)
+{
+    size_t i = 0;
+    while (i < n && p[i] >= 32 && p[i] <= 126)
+        i++;
+    return i;
+}
+
+#ifdef SCAN_X86
+
+// Newlines are counted per byte lane, by subtracting each compare mask,
+// for up to 255 blocks before the lanes could wrap; then summed with SAD.
+
+__attribute__((target("avx2"))) static size_t newlines_avx2(const char *p, size_t n)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    while (n - i >= 32)
+    {
+        size_t blocks = (n - i) / 32 < 255 ? (n - i) / 32 : 255;
+        __m256i lanes = _mm256_setzero_si256();
+        for (size_t b = 0; b < blocks; b++, i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            lanes = _mm256_sub_epi8(lanes, _mm256_cmpeq_epi8(v, nl));
+        }
+        __m256i sums = _mm256_sad_epu8(lanes, _mm256_setzero_si256());
+        __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+        count += (size_t)_mm_cvtsi128_si32(half) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(half, 8));
+    }
+    return count + newlines_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2,popcnt"))) static const char *nth_newline_avx2(const char *p, size_t n, size_t k)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; n - i >= 32; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        size_t found = __builtin_popcount(mask);
+        if (found >= k)
+        {
+            while (--k > 0)
+                mask &= mask - 1;
+            return p + i + __builtin_ctz(mask);
+        }
+        k -= found;
+    }
+    return nth_newline_scalar(p + i, n - i, k);
+}
+
+// A byte is printable if, as a signed char, it is over 31 and under 127;
+// bytes from 128 up are negative and fail the first test
+__attribute__((target("avx2"))) static size_t printable_avx2(const char *p, size_t n)
+{
+    const __m256i lo = _mm256_set1_epi8(31);
+    const __m256i hi = _mm256_set1_epi8(127);
+    size_t i = 0;
+    for (; n - i >= 32; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+        unsigned bad = ~(unsigned)_mm256_movemask_epi8(ok);
+        if (bad)
+            return i + __builtin_ctz(bad);
+    }
+    return i + printable_scalar(p + i, n - i);
+}
+
+__attribute__((target("sse2"))) static size_t newlines_sse2(const char *p, size_t n)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    while (n - i >= 16)
+    {
+        size_t blocks = (n - i) / 16 < 255 ? (n - i) / 16 : 255;
+        __m128i lanes = _mm_setzero_si128();
+        for (size_t b = 0; b < blocks; b++, i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(v, nl));
+        }
+        __m128i sums = _mm_sad_epu8(lanes, _mm_setzero_si128());
+        count += (size_t)_mm_cvtsi128_si32(sums) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+    }
+    return count + newlines_scalar(p + i, n - i);
+}
+
+__attribute__((target("sse2"))) static const char *nth_newline_sse2(const char *p, size_t n, size_t k)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; n - i >= 16; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        size_t found = __builtin_popcount(mask);
+        if (found >= k)
+        {
+            while (--k > 0)
+                mask &= mask - 1;
+            return p + i + __builtin_ctz(mask);
+        }
+        k -= found;
+    }
+    return nth_newline_scalar(p + i, n - i, k);
+}
+
+__attribute__((target("sse2"))) static size_t printable_sse2(const char *p, size_t n)
+{
+    const __m128i lo = _mm_set1_epi8(31);
+    const __m128i hi = _mm_set1_epi8(127);
+    size_t i = 0;
+    for (; n - i >= 16; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmpgt_epi8(hi, v));
+        unsigned bad = ~(unsigned)_mm_movemask_epi8(ok) & 0xffff;
+        if (bad)
+            return i + __builtin_ctz(bad);
+    }
+    return i + printable_scalar(p + i, n - i);
+}
+
+#endif
+
+static size_t (*newlines_impl)(const char *, size_t) = newlines_scalar;
+static const char *(*nth_newline_impl)(const char *, size_t, size_t) = nth_newline_scalar;
+static size_t (*printable_impl)(const char *, size_t) = printable_scalar;
+
+// Runs before main, so the choice is made before any thread can scan
+__attribute__((constructor)) static void scan_select(void)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    {
+        newlines_impl = newlines_avx2;
+        nth_newline_impl = nth_newline_avx2;
+        printable_impl = printable_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        newlines_impl = newlines_sse2;
+        nth_newline_impl = nth_newline_sse2;
+        printable_impl = printable_sse2;
+    }
+#endif
+}
+
+// Inputs shorter than this, such as typed characters, are not worth a
+// vector loop or even the indirect call to one
+#define SCAN_SHORT 16
+
+// Number of newlines in p[0..n)
+size_t scan_newlines(const char *p, size_t n)
+{
+    if (n < SCAN_SHORT)
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < n; i++)
+            count += p[i] == '\n';
+        return count;
+    }
+    return newlines_impl(p, n);
+}
+
+// The k-th newline (from 1) in p[0..n), or NULL if there are fewer
+const char *scan_nth_newline(const char *p, size_t n, size_t k)
+{
+    return k > 0 ? nth_newline_impl(p, n, k) : NULL;
+}
+
+// Length of the longest prefix of p[0..n) that is printable ASCII (32-126)
+size_t scan_printable(const char *p, size_t n)
+{
+    return printable_impl(p, n);
+}
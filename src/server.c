@@ -6,12 +6,31 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdarg.h>
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <poll.h>
 #include <errno.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <stdint.h>
 #include "server.h"
 #include "document.h"
 #include "protocol.h"
+#include "command.h"
+#include "fanout.h"
+#include "spsc.h"
+#include "vlog.h"
+#include "wal.h"
+#include "roles.h"
+#include "epoch.h"
+#include "outq.h"
+#include "stats.h"
+#include "scan.h"
 #include <stdbool.h>
 
 // Define real-time signals if not available
@@ -19,608 +38,1755 @@
 #define SIGRTMIN 34
 #endif
 
-#define MAX_CLIENTS 10
+#define MAX_CLIENTS_DEFAULT 4096
 
-// Structure to hold client information
+// Edits are not applied by the thread that reads them. Each client has a
+// lock-free queue fed by the session's reader; once per tick the
+// broadcaster merges all queues by receive time, applies the batch under one
+// doc_mutex hold and broadcasts a single VERSION block for it.
+#define EDIT_QUEUE_CAPACITY 1024
+
+// A registered client. Objects belong to registry slots and are reused by
+// later clients in the same slot, once epoch reclamation says no reader can
+// still see the previous one.
 typedef struct
 {
+    int slot;                  // Registry slot; also breaks edit-merge ties
     int pid;
-    int fd_s2c; // Server to client file descriptor
-    bool connected;
+    int fd_s2c;                // Server to client file descriptor
     char username[64];
-    char role[10]; // "read" or "write"
+    char role[10];             // "read" or "write"
+    atomic_bool gone;          // Session ended; unregistered once its edits are in
+    pthread_mutex_t out_mutex; // Keeps replies and broadcasts to fd_s2c whole
+    spsc_queue_t edits;        // One producer: the client's session
+
+    // Output, all under out_mutex. fd_s2c is non-blocking: what it cannot
+    // take waits in out and the broadcaster flushes it as the client reads.
+    outq_t out;
+    pthread_cond_t out_cond;    // Signalled once out is no longer busy
+    struct session *paused;     // Reactor session waiting for out, if any
+    int paused_epfd;            // The reactor it was taken off
+    bool producing;             // The broadcaster is producing a stream piece
+    bool out_watched;           // fd_s2c is in flush_epfd
+    bool out_failed;            // Writing failed; nothing more is sent
+    unsigned long sent_version; // Last version fully written to fd_s2c
+    unsigned long resets;       // Backlogs replaced by a snapshot
 } client_t;
 
+// The clients broadcasts go to, published as an immutable array. Joins and
+// leaves copy it under client_mutex and retire the old one, so the
+// broadcaster walks it without taking any lock.
+typedef struct
+{
+    size_t count;
+    client_t *clients[];
+} client_list_t;
+
 // Global variables
 static document_t *doc;
-static unsigned long version = 0;
-static client_t clients[MAX_CLIENTS];
-static int client_count = 0;
-static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_ulong version = 0; // Read without doc_mutex to stamp queued edits
+static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER; // Registry writers
+static client_t **registry;      // Every slot's client object, by slot
+static size_t registry_len;
+static size_t registry_cap;
+static int *free_slots;          // Stack of slots free for reuse
+static size_t nfree;
+static size_t client_count = 0;
+static size_t max_clients = MAX_CLIENTS_DEFAULT;
+static _Atomic(client_list_t *) live_clients;
+static epoch_t client_epoch;
 static pthread_mutex_t doc_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int time_interval = 30; // Default interval in seconds
+static int time_interval = 1000; // Version interval in milliseconds
+static fanout_t fanout;         // Broadcast fan-out, used by the broadcaster
+
+// Outbound queues. A client whose queued blocks pass outq_limit bytes is
+// sent a fresh snapshot in their place; its session reads no more commands
+// until the queue drops under it. flush_epfd holds the FIFOs of clients with
+// output queued and is polled by the broadcaster.
+#define OUTQ_LIMIT_DEFAULT (1024 * 1024)
+#define FLUSH_MAX_EVENTS 64
+static size_t outq_limit = OUTQ_LIMIT_DEFAULT;
+static int flush_epfd;
+
+// Replies longer than this, LOG? and DOC? of a large document, are not
+// copied into the queue whole. A placeholder is queued instead and the
+// broadcaster produces the reply from the log or a view a piece at a time as
+// the client reads, so a client that stops reading holds one piece.
+#define REPLY_PIECE 65536
 
-// Cursor position tracking
 typedef struct
 {
-    int client_index;
-    int cursor_pos;
-} cursor_position_t;
-static cursor_position_t cursor_positions[MAX_CLIENTS];
+    uint64_t received;  // CLOCK_MONOTONIC ns, the merge key
+    unsigned long base_version; // Version the client was looking at
+    command_t edit;
+    char username[64];
+    char cmd[256];      // Command as received, echoed in the EDIT line
+} pending_edit_t;
+
+// Position maps, used under doc_mutex: cur_map translates positions given at
+// the version last broadcast, prev_map those given at the one before it
+static posmap_t edit_maps[2];
+static posmap_t *cur_map = &edit_maps[0];
+static posmap_t *prev_map = &edit_maps[1];
+
+// Each broadcast version is published as an immutable view, so queries and
+// client syncs read it without doc_mutex. A reader pins the view by bumping
+// its refcount inside view_epoch; the publisher retires its own reference to
+// the old view, so that is dropped only once no reader can be about to pin it.
+typedef struct
+{
+    atomic_int refs;
+    unsigned long version;
+    const doc_snapshot_t *snap;
+} doc_view_t;
+
+static _Atomic(doc_view_t *) published_view;
+static epoch_t view_epoch;
+
+static doc_view_t *view_acquire(void)
+{
+    epoch_enter(&view_epoch);
+    doc_view_t *v = atomic_load(&published_view);
+    atomic_fetch_add(&v->refs, 1);
+    epoch_exit(&view_epoch);
+    return v;
+}
 
-// Function to adjust cursors after a document edit
-void adjust_cursors(int edit_pos, int len_change)
+static void view_release(doc_view_t *v)
 {
-    pthread_mutex_lock(&client_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++)
+    if (atomic_fetch_sub(&v->refs, 1) == 1)
     {
-        if (clients[i].connected)
-        {
-            // If cursor is after edit position, adjust it
-            if (cursor_positions[i].cursor_pos > edit_pos)
-            {
-                cursor_positions[i].cursor_pos += len_change;
-                if (cursor_positions[i].cursor_pos < 0)
-                    cursor_positions[i].cursor_pos = 0;
-            }
-        }
+        document_snapshot_release(v->snap);
+        free(v);
     }
-    pthread_mutex_unlock(&client_mutex);
 }
 
+static void view_retired(void *v)
+{
+    view_release(v);
+}
+
+// Publish the document as of version ver; called by the broadcaster before
+// it loads the client list to broadcast to (see client_join)
+static void view_publish(const doc_snapshot_t *snap, unsigned long ver)
+{
+    doc_view_t *v = malloc(sizeof(doc_view_t));
+    if (!v)
+        abort();
+    atomic_init(&v->refs, 1);
+    v->version = ver;
+    v->snap = snap;
+
+    doc_view_t *old = atomic_exchange(&published_view, v);
+    if (!old)
+        return;
+    epoch_retire(&view_epoch, old, view_retired);
+    epoch_reclaim(&view_epoch);
+}
+// History of every version for LOG?, appended by the broadcaster
+#define LOG_MEMORY_DEFAULT (16 * 1024) // KiB of history kept in memory
+static vlog_t version_log;
+static size_t log_memory = LOG_MEMORY_DEFAULT;
+
+// Durability: each version's edits are group-committed to the write-ahead
+// log before it is broadcast, and a checkpoint replaces the log once it
+// outgrows checkpoint_bytes, bounding how much a restart has to replay
+#define WAL_PATH "doc.wal"
+#define CHECKPOINT_PATH "doc.ckpt"
+#define CHECKPOINT_DEFAULT 1024 // KiB of log between checkpoints
+static wal_t wal;
+static size_t checkpoint_bytes = CHECKPOINT_DEFAULT * 1024;
+
+static int kick_fd = -1;                      // eventfd: a full queue wants an early tick
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER; // Queues were drained
+
 // Forward declarations
-void broadcast_document_update(const char *username, const char *command, const char *response);
-void timed_broadcast(int signum);
 bool has_write_permission(const char *role);
 bool process_command(const char *cmd, const char *username, const char *role, char *response, size_t resp_size);
 
-void *handle_client(void *arg)
+// Bytes read from a client at a time. Whatever follows its last complete
+// command is kept for the next read, so this also bounds what a session
+// holds between reads.
+#define SESSION_INPUT 4096
+
+// Per-connection state, owned by whichever thread drives the connection
+typedef struct session
+{
+    client_t *client;
+    int fd_c2s; // Client to server file descriptor
+    char username[64];
+    const char *role;
+    char fifo_c2s[64];
+    char fifo_s2c[64];
+    char input[SESSION_INPUT]; // Read but not yet executed: a partial command
+    size_t input_len;
+    bool overlong; // The partial command is past COMMAND_MAX and is skipped
+} session_t;
+
+// A connection request accepted from the signalfd. The acceptor holds it
+// until the client has sent its username, then queues it for the pool.
+typedef struct conn
+{
+    struct conn *next;
+    pid_t pid;
+    uint64_t signalled;        // When the request was read, for connect latency
+    int fd_s2c;
+    int fd_c2s;
+    int fd_hold;               // A read end of the S2C FIFO; see accept_client
+    char hello[SESSION_INPUT]; // The username line and any commands after it
+    size_t hello_len;
+} conn_t;
+
+// Pool workers only register clients whose handshake the acceptor has
+// finished, and never wait on a client, so a few keep up with any number of
+// connects in either mode
+#define POOL_DEFAULT 4
+#define CONNECT_TIMEOUT_MS 5000
+static int pool_size = 0; // Set by -w; 0 picks POOL_DEFAULT
+static conn_t *conn_head, *conn_tail;
+static pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_cond = PTHREAD_COND_INITIALIZER;
+
+// Turn a connection away: close its FIFOs and remove them
+static void conn_close(conn_t *c)
 {
+    char fifo[64];
+    snprintf(fifo, sizeof(fifo), "FIFO_C2S_%d", c->pid);
+    unlink(fifo);
+    snprintf(fifo, sizeof(fifo), "FIFO_S2C_%d", c->pid);
+    unlink(fifo);
+    close(c->fd_c2s);
+    close(c->fd_s2c);
+    if (c->fd_hold >= 0)
+        close(c->fd_hold);
+    free(c);
+}
 
-    int client_pid = *(int *)arg;
-    free(arg);
-    char fifo_c2s[64], fifo_s2c[64];
-    printf("Client PID: %d\n", client_pid);
-    snprintf(fifo_c2s, sizeof(fifo_c2s), "FIFO_C2S_%d", client_pid);
-    snprintf(fifo_s2c, sizeof(fifo_s2c), "FIFO_S2C_%d", client_pid);
-    if (mkfifo(fifo_c2s, 0666) == -1 && errno != EEXIST)
-    {
-        perror("Failed to create client-to-server FIFO");
-        return NULL;
-    }
-    if (mkfifo(fifo_s2c, 0666) == -1 && errno != EEXIST)
-    {
-        perror("Failed to create server-to-client FIFO");
-        unlink(fifo_c2s);
-        return NULL;
-    }
+// Hot-path metrics (see stats.h), answered by STATS? and, with -s, dumped
+// to a file every STATS_DUMP_SECONDS
+enum
+{
+    STAT_CONNECT, // From the request being read to the first document byte
+    STAT_DOC_WAIT,
+    STAT_DOC_HOLD,
+    STAT_CLIENT_WAIT,
+    STAT_CLIENT_HOLD,
+    STAT_SERIALIZE, // Rebuilding the document snapshot
+    STAT_SERIALIZE_BYTES,
+    STAT_BROADCAST, // Fanning one version block out to every client
+    STAT_DOC_QUERY, // Commands other than edits, from here to STAT_OTHER
+    STAT_SYNC,
+    STAT_LOG,
+    STAT_LAG,
+    STAT_PERM,
+    STAT_STATS,
+    STAT_QUIT,
+    STAT_OTHER,
+    STAT_EDIT, // Applying an edit, one per command type from CMD_INSERT
+    STAT_COUNT = STAT_EDIT + CMD_COUNT - CMD_INSERT
+};
+
+#define STATS_DUMP_SECONDS 10
+static const char *stats_path; // -s STATS_FILE
+static char edit_stat_names[CMD_COUNT - CMD_INSERT][32];
+static stats_metric_t stat_metrics[STAT_COUNT] = {
+    [STAT_CONNECT] = {"connect", "ns"},
+    [STAT_DOC_WAIT] = {"doc_mutex.wait", "ns"},
+    [STAT_DOC_HOLD] = {"doc_mutex.hold", "ns"},
+    [STAT_CLIENT_WAIT] = {"client_mutex.wait", "ns"},
+    [STAT_CLIENT_HOLD] = {"client_mutex.hold", "ns"},
+    [STAT_SERIALIZE] = {"serialize", "ns"},
+    [STAT_SERIALIZE_BYTES] = {"serialize.bytes", "B"},
+    [STAT_BROADCAST] = {"broadcast", "ns"},
+    [STAT_DOC_QUERY] = {"cmd.DOC?", "ns"},
+    [STAT_SYNC] = {"cmd.SYNC?", "ns"},
+    [STAT_LOG] = {"cmd.LOG?", "ns"},
+    [STAT_LAG] = {"cmd.LAG?", "ns"},
+    [STAT_PERM] = {"cmd.PERM?", "ns"},
+    [STAT_STATS] = {"cmd.STATS?", "ns"},
+    [STAT_QUIT] = {"cmd.QUIT", "ns"},
+    [STAT_OTHER] = {"cmd.other", "ns"},
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
 
-    int fd_s2c = open(fifo_s2c, O_WRONLY); // Open for writing first
-    if (fd_s2c < 0)
+// Name the per-type edit metrics and start recording
+static int stats_start(void)
+{
+    for (int t = CMD_INSERT; t < CMD_COUNT; t++)
     {
-        perror("Failed to open server-to-client FIFO");
-        unlink(fifo_c2s);
-        unlink(fifo_s2c);
-        return NULL;
+        char *name = edit_stat_names[t - CMD_INSERT];
+        snprintf(name, sizeof(edit_stat_names[0]), "cmd.%s", command_name(t));
+        stat_metrics[STAT_EDIT + t - CMD_INSERT] = (stats_metric_t){name, "ns"};
     }
+    return stats_init(stat_metrics, STAT_COUNT);
+}
 
-    int fd_c2s = open(fifo_c2s, O_RDONLY); // Open for reading second
-    if (fd_c2s < 0)
-    {
-        perror("Failed to open client-to-server FIFO");
-        close(fd_s2c);
-        unlink(fifo_c2s);
-        unlink(fifo_s2c);
-        return NULL;
-    }
+// doc_mutex and client_mutex are taken through these, which record how long
+// each acquisition waited and then how long the lock was held
+static uint64_t lock_timed(pthread_mutex_t *m, int wait_metric)
+{
+    uint64_t start = monotonic_ns();
+    pthread_mutex_lock(m);
+    uint64_t locked = monotonic_ns();
+    stats_record(wait_metric, locked - start);
+    return locked;
+}
 
-    char username[64] = {0};
-    read(fd_c2s, username, sizeof(username) - 1);
-    username[strcspn(username, "\n")] = 0;
+static void unlock_timed(pthread_mutex_t *m, int hold_metric, uint64_t locked)
+{
+    stats_record(hold_metric, monotonic_ns() - locked);
+    pthread_mutex_unlock(m);
+}
 
-    // Only "bob" and "ryan" are write, "eve" is read
-    const char *role = (!strcmp(username, "bob") || !strcmp(username, "ryan")) ? "write" : (!strcmp(username, "eve") ? "read" : NULL);
-    if (!role)
-    {
-        write(fd_s2c, "Reject UNAUTHORISED\n", 20);
-        sleep(1);
-        close(fd_c2s);
-        close(fd_s2c);
-        unlink(fifo_c2s);
-        unlink(fifo_s2c);
-        return NULL;
-    }
+// Snapshot the document, timing the serialization if the cached one is
+// stale. Must be called with doc_mutex held.
+static const doc_snapshot_t *snapshot_timed(void)
+{
+    if (doc->cache && doc->cache->revision == doc->revision)
+        return document_snapshot(doc);
+    uint64_t start = monotonic_ns();
+    const doc_snapshot_t *snap = document_snapshot(doc);
+    stats_record(STAT_SERIALIZE, monotonic_ns() - start);
+    stats_record(STAT_SERIALIZE_BYTES, snap->len);
+    return snap;
+}
+
+// Grow an array to hold at least n elements
+static void *grow_array(void *arr, size_t *cap, size_t n, size_t elem)
+{
+    if (n <= *cap)
+        return arr;
+    size_t new_cap = *cap ? *cap : 64;
+    while (new_cap < n)
+        new_cap *= 2;
+    arr = realloc(arr, new_cap * elem);
+    if (!arr)
+        abort();
+    *cap = new_cap;
+    return arr;
+}
+
+// Output to a client. All of these are called with the client's out_mutex
+// held; whatever fd_s2c cannot take now is queued, and the FIFO is watched
+// until the queue has drained.
+
+// Whether the client's session should read no more commands for now: its
+// queue is over the limit, or it has a streamed reply still to read. Replies
+// never wait for the queue, so this is what bounds it.
+static bool output_busy(const client_t *c)
+{
+    return !c->out_failed && (c->out.bytes > outq_limit || c->out.streams > 0);
+}
 
-    // Register client in the global array
-    int client_index = -1;
-    pthread_mutex_lock(&client_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++)
+static void watch_output(client_t *c)
+{
+    bool want = c->out.head != NULL;
+    if (want != c->out_watched)
     {
-        if (!clients[i].connected)
-        {
-            client_index = i;
-            clients[i].pid = client_pid;
-            clients[i].fd_s2c = fd_s2c;
-            clients[i].connected = true;
-            strncpy(clients[i].username, username, sizeof(clients[i].username) - 1);
-            strncpy(clients[i].role, role, sizeof(clients[i].role) - 1);
-            client_count++;
-            break;
-        }
+        struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+        epoll_ctl(flush_epfd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, c->fd_s2c, &ev);
+        c->out_watched = want;
     }
-    pthread_mutex_unlock(&client_mutex);
-
-    if (client_index == -1)
+    if (output_busy(c))
+        return;
+    if (c->paused)
     {
-        write(fd_s2c, "Reject SERVER_FULL\n", 19);
-        close(fd_c2s);
-        close(fd_s2c);
-        unlink(fifo_c2s);
-        unlink(fifo_s2c);
-        return NULL;
+        // Back onto the reactor it was taken off (see session_pause)
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c->paused};
+        epoll_ctl(c->paused_epfd, EPOLL_CTL_ADD, c->paused->fd_c2s, &ev);
+        c->paused = NULL;
     }
+    pthread_cond_broadcast(&c->out_cond);
+}
+
+// The client stopped reading for good; drop its output from here on. A
+// stream piece being produced keeps the queue until the broadcaster is done.
+static void fail_output(client_t *c)
+{
+    c->out_failed = true;
+    if (!c->producing)
+        outq_free(&c->out);
+    watch_output(c);
+}
+
+static void client_send(client_t *c, outq_kind_t kind, unsigned long ver, const struct iovec *iov, int iovcnt)
+{
+    if (c->out_failed)
+        return;
+    if (outq_write(&c->out, c->fd_s2c, kind, ver, iov, iovcnt, &c->sent_version) < 0)
+        fail_output(c);
+    else
+        watch_output(c);
+}
 
-    // Send role and document
-    pthread_mutex_lock(&doc_mutex);
-    char *docstr;
-    size_t doclen;
-    document_serialize(doc, &docstr, &doclen);
-    send_document(fd_s2c, role, version, docstr, doclen);
-    free(docstr);
-    pthread_mutex_unlock(&doc_mutex);
+static void send_snapshot(client_t *c, const char *role, const doc_view_t *v)
+{
+    char header[128];
+    int n = document_header(header, sizeof(header), role, v->version, v->snap->len);
+    struct iovec iov[2] = {{header, n}, {v->snap->data, v->snap->len}};
+    client_send(c, OUTQ_SNAPSHOT, v->version, iov, 2);
+}
+
+// A client that has fallen more than outq_limit behind gets the current
+// document instead of the versions it has yet to read; its replica is
+// replaced whole, as after SYNC?. Called by the broadcaster after publishing.
+static void reset_backlog(client_t *c)
+{
+    size_t behind = c->out.backlog;
+    outq_drop_stale(&c->out);
+    doc_view_t *v = view_acquire();
+    printf("Client %d (%s) is %lu versions, %zu bytes behind; sending version %lu whole\n",
+           c->pid, c->username, v->version - c->sent_version, behind, v->version);
+    send_snapshot(c, c->role, v);
+    view_release(v);
+    c->resets++;
+}
 
-    // Command loop
-    char cmd[256];
-    while (read(fd_c2s, cmd, sizeof(cmd) - 1) > 0)
+// Queue the rest of a broadcast block the FIFO took sent bytes of
+static void queue_block(client_t *c, unsigned long ver, const char *msg, size_t len, size_t sent)
+{
+    if (c->out_failed)
+        return;
+    struct iovec iov = {(void *)msg, len};
+    if (outq_push(&c->out, OUTQ_BLOCK, ver, &iov, 1, sent) < 0)
     {
-        // Process the command
-        cmd[sizeof(cmd) - 1] = '\0';
+        fail_output(c);
+        return;
+    }
+    if (c->out.backlog > outq_limit)
+        reset_backlog(c);
+    watch_output(c);
+}
 
-        // Remove trailing newline if present
-        size_t cmd_len = strlen(cmd);
-        if (cmd_len > 0 && cmd[cmd_len - 1] == '\n')
-        {
-            cmd[cmd_len - 1] = '\0';
-        }
+// Take out_mutex for a reply, so no broadcast can split it. This never
+// waits for the queue to drain, which would stall every session on a
+// reactor; a busy client's session is held back before its next read instead.
+static void reply_begin(client_t *c)
+{
+    pthread_mutex_lock(&c->out_mutex);
+}
+
+static void reply_end(client_t *c)
+{
+    pthread_mutex_unlock(&c->out_mutex);
+}
 
-        printf("Received command from %s: %s\n", username, cmd);
+static void send_reply(session_t *s, const char *text, size_t len)
+{
+    struct iovec iov = {(void *)text, len};
+    reply_begin(s->client);
+    client_send(s->client, OUTQ_REPLY, 0, &iov, 1);
+    reply_end(s->client);
+}
 
-        // Create response buffer
-        char response[512] = {0};
+// A reply streamed from the log (LOG?) or from a view (DOC?), behind a
+// header already queued. Only the broadcaster touches it once it is queued.
+typedef struct
+{
+    doc_view_t *view;       // DOC?: the version being sent; NULL for LOG?
+    size_t off;             // DOC?: document bytes produced
+    unsigned long next;     // LOG?: next version to look for
+    unsigned long to;       // LOG?: last version
+    vlog_reader_t reader;   // LOG?: the version being produced
+    size_t text_off;        // LOG?: bytes of it produced
+    size_t left;            // Bytes of the reply still to produce
+} reply_stream_t;
+
+static void stream_release(void *arg)
+{
+    reply_stream_t *st = arg;
+    if (st->view)
+        view_release(st->view);
+    vlog_reader_free(&st->reader);
+    free(st);
+}
 
-        // Execute the command if permissions allow
-        if (strncmp(cmd, "i ", 2) == 0 || strncmp(cmd, "d ", 2) == 0 ||
-            strncmp(cmd, "BOLD", 4) == 0 || strncmp(cmd, "ITALIC", 6) == 0 ||
-            strncmp(cmd, "HEADING", 7) == 0 || strncmp(cmd, "LIST", 4) == 0)
+// Produce up to REPLY_PIECE bytes of a stream into buf, without holding any
+// lock but the log's. The reply ends in a newline; if the log could not
+// supply every version it promised, the rest is padded with newlines.
+static size_t stream_produce(reply_stream_t *st, char *buf)
+{
+    size_t n = 0;
+    while (n < REPLY_PIECE && st->left > 0)
+    {
+        const char *src = NULL;
+        size_t avail = 0;
+        if (st->view)
         {
-            // These commands require write permission
-            if (strcmp(role, "write") == 0)
-            {
-                pthread_mutex_lock(&doc_mutex);
-                bool success = process_command(cmd, username, role, response, sizeof(response));
-                if (success)
-                {
-                    // Increase version only for successful write operations
-                    version++;
-                }
-                pthread_mutex_unlock(&doc_mutex);
-
-                // Broadcast to all clients
-                broadcast_document_update(username, cmd, success ? "SUCCESS" : response);
-            }
-            else
-            {
-                // Read-only user tried to modify document
-                snprintf(response, sizeof(response),
-                         "Reject UNAUTHORISED %c write read\n", cmd[0]);
-                write(fd_s2c, response, strlen(response));
-            }
+            src = st->view->snap->data + st->off;
+            avail = st->view->snap->len - st->off;
         }
         else
         {
-            // Other commands (read operations, etc.)
-            pthread_mutex_lock(&doc_mutex);
-            bool success = process_command(cmd, username, role, response, sizeof(response));
-            pthread_mutex_unlock(&doc_mutex);
+            if (st->text_off == st->reader.text_len && st->next <= st->to)
+            {
+                unsigned long v = st->next;
+                if (vlog_next(&version_log, &v) && v <= st->to && vlog_format(&version_log, v, &st->reader))
+                    st->next = v + 1;
+                else
+                    st->next = st->to + 1; // vlog_format left text_len 0
+                st->text_off = 0;
+            }
+            src = st->reader.text + st->text_off;
+            avail = st->reader.text_len - st->text_off;
+        }
 
-            // For queries like DOC?, just send response to this client
-            write(fd_s2c, response, strlen(response));
+        size_t take = avail < st->left - 1 ? avail : st->left - 1;
+        if (take > REPLY_PIECE - n)
+            take = REPLY_PIECE - n;
+        if (take == 0)
+        {
+            buf[n++] = '\n';
+            st->left--;
+            continue;
         }
+        memcpy(buf + n, src, take);
+        n += take;
+        st->left -= take;
+        if (st->view)
+            st->off += take;
+        else
+            st->text_off += take;
     }
-
-    // Client disconnected, clean up
-    pthread_mutex_lock(&client_mutex);
-    clients[client_index].connected = false;
-    client_count--;
-    pthread_mutex_unlock(&client_mutex);
-
-    close(fd_c2s);
-    close(fd_s2c);
-    unlink(fifo_c2s);
-    unlink(fifo_s2c);
-    return NULL;
+    return n;
 }
 
-void sigrtmin_handler(int sig, siginfo_t *si, void *unused)
+// Queue a streamed reply behind the client's other output
+static void queue_stream(client_t *c, reply_stream_t *st)
 {
-    // Suppress warnings for unused parameters
-    (void)sig;
-    (void)unused;
-
-    int *pid = malloc(sizeof(int));
-    *pid = si->si_pid;
-    pthread_t tid;
-    pthread_create(&tid, NULL, handle_client, pid);
-    kill(*pid, SIGRTMIN + 1);
+    if (c->out_failed)
+    {
+        stream_release(st);
+        return;
+    }
+    if (outq_push_stream(&c->out, st, stream_release) < 0)
+    {
+        stream_release(st);
+        fail_output(c);
+        return;
+    }
+    watch_output(c);
 }
 
-// Timer signal handler for broadcasting document updates at regular intervals
-void timed_broadcast(int signum)
+// Write queued output to every client whose FIFO has room again; called by
+// the broadcaster when flush_epfd is readable. A streamed reply that reaches
+// the head of a queue is continued here, its next piece produced with
+// out_mutex released so the client's broadcasts and session never wait on
+// the log.
+static void flush_clients(void)
 {
-    (void)signum; // Suppress unused parameter warning
-
-    pthread_mutex_lock(&doc_mutex);
-    // Increment the version to signal a new document state
-    version++;
+    static char piece[REPLY_PIECE];
+    struct epoll_event events[FLUSH_MAX_EVENTS];
+    int n = epoll_wait(flush_epfd, events, FLUSH_MAX_EVENTS, 0);
+    for (int i = 0; i < n; i++)
+    {
+        client_t *c = events[i].data.ptr;
+        pthread_mutex_lock(&c->out_mutex);
+        int rc;
+        reply_stream_t *st;
+        while ((rc = outq_flush(&c->out, c->fd_s2c, &c->sent_version)) > 0 &&
+               (st = outq_stream(&c->out)) != NULL)
+        {
+            c->producing = true;
+            pthread_mutex_unlock(&c->out_mutex);
+            size_t len = stream_produce(st, piece);
+            pthread_mutex_lock(&c->out_mutex);
+            c->producing = false;
+            if (c->out_failed)
+                break;
+            if (st->left == 0)
+                outq_end_stream(&c->out);
+            if (len > 0 && outq_push_piece(&c->out, piece, len) < 0)
+            {
+                rc = -1;
+                break;
+            }
+        }
+        if (rc < 0 || c->out_failed)
+            fail_output(c);
+        else
+            watch_output(c);
+        pthread_mutex_unlock(&c->out_mutex);
+    }
+}
 
-    // Broadcast the updated document to all clients
-    char *docstr;
-    size_t doclen;
-    document_serialize(doc, &docstr, &doclen);
+// Epoch callback for a departed client: no reader can reach it any more, so
+// its FIFO can be closed and its slot handed out again
+static void client_release(void *arg)
+{
+    client_t *c = arg;
+    outq_free(&c->out);
+    close(c->fd_s2c);
+    free_slots[nfree++] = c->slot;
+}
 
-    // Create update message for periodic broadcast
-    char header[128];
-    snprintf(header, sizeof(header), "VERSION %lu\nAUTO_UPDATE\nEND\n", version);
+// Register a client, taking a free slot if there is one. The client is
+// returned with out_mutex held: it is live from here on, and the broadcaster
+// must not write to it before its snapshot has gone out. Returns NULL if the
+// server is full.
+//
+// The list is published before the caller takes its view, and the
+// broadcaster publishes each view before loading the list. Either the
+// broadcaster sees this client, or the view taken here is already the new
+// version; no version is missed between snapshot and broadcasts.
+static client_t *client_join(int pid, int fd_s2c, const char *username, const char *role)
+{
+    uint64_t locked = lock_timed(&client_mutex, STAT_CLIENT_WAIT);
+    epoch_reclaim(&client_epoch); // Frees slots of clients that have left
+    if (client_count >= max_clients)
+    {
+        unlock_timed(&client_mutex, STAT_CLIENT_HOLD, locked);
+        return NULL;
+    }
 
-    pthread_mutex_lock(&client_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++)
+    client_t *c;
+    if (nfree > 0)
     {
-        if (clients[i].connected)
+        c = registry[free_slots[--nfree]];
+    }
+    else
+    {
+        c = calloc(1, sizeof(client_t));
+        if (!c || spsc_init(&c->edits, EDIT_QUEUE_CAPACITY) < 0)
         {
-            // Send timed update to each connected client
-            write(clients[i].fd_s2c, header, strlen(header));
-            send_document(clients[i].fd_s2c, clients[i].role, version, docstr, doclen);
+            free(c);
+            unlock_timed(&client_mutex, STAT_CLIENT_HOLD, locked);
+            return NULL;
         }
+        pthread_mutex_init(&c->out_mutex, NULL);
+        pthread_cond_init(&c->out_cond, NULL);
+        outq_init(&c->out);
+        size_t cap = registry_cap;
+        registry = grow_array(registry, &registry_cap, registry_len + 1, sizeof(client_t *));
+        free_slots = grow_array(free_slots, &cap, registry_cap, sizeof(int));
+        c->slot = registry_len;
+        registry[registry_len++] = c;
     }
-    pthread_mutex_unlock(&client_mutex);
+    c->pid = pid;
+    c->fd_s2c = fd_s2c;
+    snprintf(c->username, sizeof(c->username), "%s", username);
+    snprintf(c->role, sizeof(c->role), "%s", role);
+    atomic_store(&c->gone, false);
+    c->out_watched = false;
+    c->out_failed = false;
+    c->paused = NULL;
+    c->producing = false;
+    c->sent_version = 0;
+    c->resets = 0;
+    pthread_mutex_lock(&c->out_mutex);
+
+    client_list_t *old = atomic_load(&live_clients);
+    client_list_t *list = malloc(sizeof(client_list_t) + (old->count + 1) * sizeof(client_t *));
+    if (!list)
+        abort();
+    memcpy(list->clients, old->clients, old->count * sizeof(client_t *));
+    list->clients[old->count] = c;
+    list->count = old->count + 1;
+    atomic_store(&live_clients, list);
+    epoch_retire(&client_epoch, old, free);
+    client_count++;
+    unlock_timed(&client_mutex, STAT_CLIENT_HOLD, locked);
+    return c;
+}
 
-    free(docstr);
-    pthread_mutex_unlock(&doc_mutex);
+// A client can be unregistered once its session has ended and every edit
+// it queued has been applied
+static bool client_done(client_t *c)
+{
+    return atomic_load(&c->gone) && !spsc_peek(&c->edits);
 }
 
-// Broadcast document update to all connected clients
-void broadcast_document_update(const char *username, const char *command, const char *response)
+// Drop finished clients from the live list; called by the broadcaster,
+// outside its epoch, so their objects can be reclaimed
+static void reap_clients(void)
 {
-    char *docstr;
-    size_t doclen;
-    document_serialize(doc, &docstr, &doclen);
+    static client_t **done;
+    static size_t done_cap;
+
+    uint64_t locked = lock_timed(&client_mutex, STAT_CLIENT_WAIT);
+    client_list_t *old = atomic_load(&live_clients);
+    client_list_t *list = malloc(sizeof(client_list_t) + old->count * sizeof(client_t *));
+    if (!list)
+        abort();
+    done = grow_array(done, &done_cap, old->count, sizeof(client_t *));
+    size_t ndone = 0;
+    list->count = 0;
+    for (size_t i = 0; i < old->count; i++)
+    {
+        client_t *c = old->clients[i];
+        if (client_done(c))
+            done[ndone++] = c;
+        else
+            list->clients[list->count++] = c;
+    }
+
+    // Output still queued for a departed client is dropped. Only this
+    // thread polls flush_epfd, so none of them can turn up there again.
+    for (size_t i = 0; i < ndone; i++)
+    {
+        pthread_mutex_lock(&done[i]->out_mutex);
+        fail_output(done[i]);
+        pthread_mutex_unlock(&done[i]->out_mutex);
+    }
+
+    // Unpublish before retiring, so no reader that enters later finds them
+    atomic_store(&live_clients, list);
+    epoch_retire(&client_epoch, old, free);
+    for (size_t i = 0; i < ndone; i++)
+        epoch_retire(&client_epoch, done[i], client_release);
+    client_count -= ndone;
+    epoch_reclaim(&client_epoch);
+    unlock_timed(&client_mutex, STAT_CLIENT_HOLD, locked);
+}
 
-    // Create update message
-    char header[256];
-    snprintf(header, sizeof(header), "VERSION %lu\nEDIT %s %s %s\nEND\n",
-             version, username, command, response);
+// Queue an edit for the next tick. A full queue asks the broadcaster for an
+// early tick and waits for it to drain rather than dropping the edit.
+static void enqueue_edit(client_t *c, pending_edit_t *e)
+{
+    spsc_queue_t *q = &c->edits;
+    if (spsc_push(q, e))
+        return;
+    pthread_mutex_lock(&drain_mutex);
+    while (!spsc_push(q, e))
+    {
+        // If the kick is lost, the next timer tick drains the queue instead
+        uint64_t one = 1;
+        if (write(kick_fd, &one, sizeof(one)) < 0)
+            perror("Failed to kick the broadcaster");
+        pthread_cond_wait(&drain_cond, &drain_mutex);
+    }
+    pthread_mutex_unlock(&drain_mutex);
+}
 
-    pthread_mutex_lock(&client_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++)
+// Send versions [from, to] of the history as one length-framed reply,
+// "LOG (len bytes):\n" followed by each version's block as broadcast.
+// Heartbeats carry no history and are left out. The length comes from the
+// log's index; the blocks are streamed behind the header by the broadcaster
+// (see flush_clients), so the range is never held in memory at once.
+static void send_log(session_t *s, unsigned long from, unsigned long to)
+{
+    char header[64];
+    size_t total = vlog_text_size(&version_log, from, to);
+    int n = snprintf(header, sizeof(header), "LOG (%zu bytes):\n", total);
+    if (total == 0)
     {
-        if (clients[i].connected)
-        {
-            // Send update to each connected client
-            write(clients[i].fd_s2c, header, strlen(header));
-            send_document(clients[i].fd_s2c, clients[i].role, version, docstr, doclen);
-        }
+        header[n++] = '\n';
+        send_reply(s, header, n);
+        return;
     }
-    pthread_mutex_unlock(&client_mutex);
 
-    free(docstr);
+    reply_stream_t *st = calloc(1, sizeof(reply_stream_t));
+    if (!st)
+    {
+        send_reply(s, "Reject LOG_UNAVAILABLE\n", 23);
+        return;
+    }
+    st->next = from;
+    st->to = to;
+    st->left = total + 1; // And the closing newline
+    struct iovec iov = {header, n};
+    reply_begin(s->client);
+    client_send(s->client, OUTQ_REPLY, 0, &iov, 1);
+    queue_stream(s->client, st);
+    reply_end(s->client);
 }
 
-// Check if user has write permission
-bool has_write_permission(const char *role)
+// Which metric times a command; edits are timed as they are applied
+static int command_metric(const char *cmd)
 {
-    return (role != NULL && strcmp(role, "write") == 0);
+    if (command_type(cmd) != CMD_NONE)
+        return -1;
+    if (strcmp(cmd, "DOC?") == 0)
+        return STAT_DOC_QUERY;
+    if (strcmp(cmd, "SYNC?") == 0)
+        return STAT_SYNC;
+    if (strncmp(cmd, "LOG?", 4) == 0)
+        return STAT_LOG;
+    if (strcmp(cmd, "LAG?") == 0)
+        return STAT_LAG;
+    if (strcmp(cmd, "PERM?") == 0)
+        return STAT_PERM;
+    if (strcmp(cmd, "STATS?") == 0)
+        return STAT_STATS;
+    if (strcmp(cmd, "QUIT") == 0)
+        return STAT_QUIT;
+    return STAT_OTHER;
 }
 
-// Process a client command
-bool process_command(const char *cmd, const char *username, const char *role, char *response, size_t resp_size)
+// Carry out one command on behalf of a session
+static void dispatch_command(session_t *s, char *cmd)
 {
-    // Check for insert command: i <position> <text>
-    if (strncmp(cmd, "i ", 2) == 0)
+    // Remove trailing newline if present
+    size_t cmd_len = strlen(cmd);
+    if (cmd_len > 0 && cmd[cmd_len - 1] == '\n')
     {
-        if (!has_write_permission(role))
-        {
-            snprintf(response, resp_size, "Reject UNAUTHORISED INSERT write read");
-            return false;
-        }
+        cmd[--cmd_len] = '\0';
+    }
+    // Anything longer, or with control or non-ASCII bytes, is refused whole
+    if (cmd_len >= COMMAND_MAX || scan_printable(cmd, cmd_len) != cmd_len)
+    {
+        send_reply(s, "Reject INVALID_COMMAND\n", 23);
+        return;
+    }
+
+    printf("Received command from %s: %s\n", s->username, cmd);
+
+    // Roles may change while connected; a user dropped from roles.txt
+    // keeps read access for the rest of the session
+    const char *role = roles_lookup(s->username);
+    s->role = role ? role : "read";
+    if (strcmp(s->client->role, s->role) != 0)
+    {
+        // Snapshots the broadcaster sends carry the role too
+        pthread_mutex_lock(&s->client->out_mutex);
+        snprintf(s->client->role, sizeof(s->client->role), "%s", s->role);
+        pthread_mutex_unlock(&s->client->out_mutex);
+    }
+
+    // Create response buffer
+    char response[512] = {0};
 
-        int position;
-        char text[256];
-        if (sscanf(cmd, "i %d %[^\n]", &position, text) == 2)
+    // Execute the command if permissions allow
+    if (command_type(cmd) != CMD_NONE)
+    {
+        // These commands require write permission
+        if (strcmp(s->role, "write") == 0)
         {
-            if (position < 0 || position > (int)doc->length)
+            // Parsed here, applied and broadcast at the next tick
+            pending_edit_t *e = malloc(sizeof(pending_edit_t));
+            if (!e || !command_parse(cmd, &e->edit))
             {
-                snprintf(response, resp_size, "Reject INVALID_POSITION");
-                return false;
+                free(e);
+                send_reply(s, "Reject UNKNOWN_COMMAND\n", 23);
+                return;
             }
-
-            document_insert(doc, position, text);
-            adjust_cursors(position, strlen(text));
-            return true;
+            e->received = monotonic_ns();
+            e->base_version = version;
+            snprintf(e->username, sizeof(e->username), "%s", s->username);
+            snprintf(e->cmd, sizeof(e->cmd), "%s", cmd);
+            enqueue_edit(s->client, e);
+        }
+        else
+        {
+            // Read-only user tried to modify document
+            snprintf(response, sizeof(response),
+                     "Reject UNAUTHORISED %c write read\n", cmd[0]);
+            send_reply(s, response, strlen(response));
         }
     }
-
-    // Check for delete command: d <position> <count>
-    else if (strncmp(cmd, "d ", 2) == 0)
+    else if (strcmp(cmd, "SYNC?") == 0)
     {
-        if (!has_write_permission(role))
+        // Full snapshot for a client whose replica has diverged. Taken under
+        // out_mutex so it is the latest version broadcast to this client.
+        reply_begin(s->client);
+        doc_view_t *v = view_acquire();
+        send_snapshot(s->client, s->role, v);
+        reply_end(s->client);
+        view_release(v);
+    }
+    else if (strncmp(cmd, "LOG?", 4) == 0 && (cmd[4] == '\0' || cmd[4] == ' '))
+    {
+        // LOG? for the whole history, or LOG? <from> <to> for a range
+        unsigned long from = 1, to = vlog_last(&version_log);
+        char extra;
+        if (cmd[4] == ' ' && (sscanf(cmd + 5, "%lu %lu %c", &from, &to, &extra) != 2 || from > to))
         {
-            snprintf(response, resp_size, "Reject UNAUTHORISED DELETE write read");
-            return false;
+            send_reply(s, "Reject INVALID_RANGE\n", 21);
+            return;
         }
-
-        int position, count;
-        if (sscanf(cmd, "d %d %d", &position, &count) == 2)
+        unsigned long last = vlog_last(&version_log);
+        send_log(s, from, to < last ? to : last);
+    }
+    else if (strcmp(cmd, "LAG?") == 0)
+    {
+        // How far this client's output trails the broadcasts; the answer
+        // itself waits behind whatever is queued
+        client_t *c = s->client;
+        pthread_mutex_lock(&c->out_mutex);
+        int n = snprintf(response, sizeof(response), "LAG %lu versions, %zu bytes queued, %lu resets\n",
+                         version - c->sent_version, c->out.bytes, c->resets);
+        pthread_mutex_unlock(&c->out_mutex);
+        send_reply(s, response, n);
+    }
+    else if (strcmp(cmd, "STATS?") == 0)
+    {
+        // Every metric merged over all threads, length-framed like LOG?
+        size_t len;
+        char *text = stats_report(&len);
+        if (!text)
         {
-            if (position < 0 || position >= (int)doc->length)
-            {
-                snprintf(response, resp_size, "Reject INVALID_POSITION");
-                return false;
-            }
-
-            document_delete(doc, position, count);
-            adjust_cursors(position, -count);
-            return true;
+            send_reply(s, "Reject STATS_UNAVAILABLE\n", 25);
+            return;
         }
+        int n = snprintf(response, sizeof(response), "STATS (%zu bytes):\n", len);
+        struct iovec iov[3] = {{response, n}, {text, len}, {"\n", 1}};
+        reply_begin(s->client);
+        client_send(s->client, OUTQ_REPLY, 0, iov, 3);
+        reply_end(s->client);
+        free(text);
     }
-
-    // Check for BOLD command
-    else if (strncmp(cmd, "BOLD ", 5) == 0)
+    else if (strcmp(cmd, "DOC?") == 0)
     {
-        if (!has_write_permission(role))
+        // The whole document, length-framed so it can exceed one read. A
+        // long one is streamed from the view, which the stream keeps.
+        doc_view_t *v = view_acquire();
+        int n = snprintf(response, sizeof(response), "VERSION %lu\nDOCUMENT (%zu bytes):\n",
+                         v->version, v->snap->len);
+        reply_stream_t *st = v->snap->len < REPLY_PIECE ? NULL : calloc(1, sizeof(reply_stream_t));
+        if (st)
         {
-            snprintf(response, resp_size, "Reject UNAUTHORISED BOLD write read");
-            return false;
+            st->view = v;
+            st->left = v->snap->len + 1;
+            struct iovec iov = {response, n};
+            reply_begin(s->client);
+            client_send(s->client, OUTQ_REPLY, 0, &iov, 1);
+            queue_stream(s->client, st);
+            reply_end(s->client);
         }
-
-        int position, length;
-        if (sscanf(cmd, "BOLD %d %d", &position, &length) == 2)
+        else
         {
-            if (position < 0 || position >= (int)doc->length ||
-                position + length > (int)doc->length)
-            {
-                snprintf(response, resp_size, "Reject INVALID_POSITION");
-                return false;
-            }
-
-            // Get the text to be made bold
-            char *docstr;
-            size_t doclen;
-            document_serialize(doc, &docstr, &doclen);
-
-            // Extract the text to be made bold
-            char text_to_bold[256];
-            strncpy(text_to_bold, docstr + position, length);
-            text_to_bold[length] = '\0';
-
-            // Delete the original text
-            document_delete(doc, position, length);
+            struct iovec iov[3] = {{response, n}, {v->snap->data, v->snap->len}, {"\n", 1}};
+            reply_begin(s->client);
+            client_send(s->client, OUTQ_REPLY, 0, iov, 3);
+            reply_end(s->client);
+            view_release(v);
+        }
+    }
+    else
+    {
+        // Other commands (read operations, etc.)
+        process_command(cmd, s->username, s->role, response, sizeof(response) - 1);
+
+        // Replies are newline-terminated so clients can frame them
+        size_t len = strlen(response);
+        if (len == 0 || response[len - 1] != '\n')
+            response[len++] = '\n';
+        send_reply(s, response, len);
+    }
+}
 
-            // Create bold text with ** markers
-            char bold_text[512];
-            snprintf(bold_text, sizeof(bold_text), "**%s**", text_to_bold);
+// Execute one command received from a session, timed by its type
+static void execute_command(session_t *s, char *cmd)
+{
+    uint64_t start = monotonic_ns();
+    dispatch_command(s, cmd); // Strips the newline
+    int metric = command_metric(cmd);
+    if (metric >= 0)
+        stats_record(metric, monotonic_ns() - start);
+}
 
-            // Insert the bold text
-            document_insert(doc, position, bold_text);
+// Execute every complete command in a session's input, in order. A read
+// may end anywhere, so a trailing partial command is kept for the next one.
+// A command that runs to COMMAND_MAX bytes without a newline is refused once
+// the newline arrives; the bytes up to it are dropped as they come in.
+static void session_execute(session_t *s)
+{
+    size_t start = 0;
+    char *nl;
+    while ((nl = memchr(s->input + start, '\n', s->input_len - start)) != NULL)
+    {
+        *nl = '\0';
+        if (s->overlong)
+            send_reply(s, "Reject INVALID_COMMAND\n", 23);
+        else if (nl > s->input + start) // Blank lines are skipped
+            execute_command(s, s->input + start);
+        s->overlong = false;
+        start = nl + 1 - s->input;
+    }
 
-            free(docstr);
-            return true;
-        }
+    size_t rest = s->input_len - start;
+    if (rest >= COMMAND_MAX)
+    {
+        s->overlong = true;
+        rest = 0;
     }
+    memmove(s->input, s->input + start, rest);
+    s->input_len = rest;
+}
 
-    // Check for ITALIC command
-    else if (strncmp(cmd, "ITALIC ", 7) == 0)
+// Read what a session has sent and execute each command in it. Clients may
+// pipeline any number of commands per write. Returns false once the client
+// has disconnected.
+static bool session_read(session_t *s)
+{
+    ssize_t nread = read(s->fd_c2s, s->input + s->input_len, sizeof(s->input) - s->input_len);
+    if (nread <= 0)
     {
-        if (!has_write_permission(role))
+        // A last command may come without its newline
+        if (s->input_len > 0 && !s->overlong)
         {
-            snprintf(response, resp_size, "Reject UNAUTHORISED ITALIC write read");
-            return false;
+            s->input[s->input_len] = '\0';
+            execute_command(s, s->input);
         }
+        return false;
+    }
+    s->input_len += nread;
+    session_execute(s);
+    return true;
+}
 
-        int position, length;
-        if (sscanf(cmd, "ITALIC %d %d", &position, &length) == 2)
-        {
-            if (position < 0 || position >= (int)doc->length ||
-                position + length > (int)doc->length)
-            {
-                snprintf(response, resp_size, "Reject INVALID_POSITION");
-                return false;
-            }
+// Client disconnected, clean up. The client stays registered until the
+// broadcaster has applied what it queued, and its FIFO to us stays open
+// until no broadcast can still be writing to it.
+static void close_session(session_t *s)
+{
+    atomic_store(&s->client->gone, true);
+    close(s->fd_c2s);
+    unlink(s->fifo_c2s);
+    unlink(s->fifo_s2c);
+    free(s);
+}
 
-            // Get the text to be made italic
-            char *docstr;
-            size_t doclen;
-            document_serialize(doc, &docstr, &doclen);
+// Thread-per-client mode: one blocking reader thread per session
+#define SESSION_STACK_SIZE (256 * 1024)
 
-            // Extract the text to be made italic
-            char text_to_italic[256];
-            strncpy(text_to_italic, docstr + position, length);
-            text_to_italic[length] = '\0';
+// Block until the client has read enough of its output to take more
+static void session_wait(session_t *s)
+{
+    client_t *c = s->client;
+    pthread_mutex_lock(&c->out_mutex);
+    while (output_busy(c))
+        pthread_cond_wait(&c->out_cond, &c->out_mutex);
+    pthread_mutex_unlock(&c->out_mutex);
+}
 
-            // Delete the original text
-            document_delete(doc, position, length);
+static void *session_loop(void *arg)
+{
+    session_t *s = arg;
+    do
+        session_wait(s);
+    while (session_read(s));
+    close_session(s);
+    return NULL;
+}
 
-            // Create italic text with * markers
-            char italic_text[512];
-            snprintf(italic_text, sizeof(italic_text), "*%s*", text_to_italic);
+// Reactor mode: a fixed set of threads, each multiplexing many sessions over
+// its own epoll instance, instead of one blocking reader thread per client.
+#define REACTOR_MAX_THREADS 64
+#define REACTOR_MAX_EVENTS 64
 
-            // Insert the italic text
-            document_insert(doc, position, italic_text);
+static int reactor_threads = 0; // 0 selects thread-per-client mode
+static int reactor_epfd[REACTOR_MAX_THREADS];
+static atomic_uint reactor_next;
 
-            free(docstr);
-            return true;
-        }
+// Take a session whose client is busy off its reactor, rather than block the
+// thread; watch_output puts it back once the client has read enough
+static void session_pause(session_t *s, int epfd)
+{
+    client_t *c = s->client;
+    pthread_mutex_lock(&c->out_mutex);
+    if (output_busy(c))
+    {
+        c->paused = s;
+        c->paused_epfd = epfd;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd_c2s, NULL);
     }
+    pthread_mutex_unlock(&c->out_mutex);
+}
 
-    // Check for HEADING command
-    else if (strncmp(cmd, "HEADING ", 8) == 0)
+static void *reactor_loop(void *arg)
+{
+    int epfd = *(int *)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    while (1)
     {
-        if (!has_write_permission(role))
+        int n = epoll_wait(epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
         {
-            snprintf(response, resp_size, "Reject UNAUTHORISED HEADING write read");
-            return false;
+            perror("epoll_wait");
+            return NULL;
         }
-
-        int level, position, length;
-        if (sscanf(cmd, "HEADING %d %d %d", &level, &position, &length) == 3)
+        for (int i = 0; i < n; i++)
         {
-            if (level < 1 || level > 6)
+            session_t *s = events[i].data.ptr;
+            if (!session_read(s))
             {
-                snprintf(response, resp_size, "Reject INVALID_HEADING_LEVEL");
-                return false;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd_c2s, NULL);
+                close_session(s);
             }
-
-            if (position < 0 || position >= (int)doc->length ||
-                position + length > (int)doc->length)
+            else
             {
-                snprintf(response, resp_size, "Reject INVALID_POSITION");
-                return false;
+                session_pause(s, epfd);
             }
+        }
+    }
+    return NULL;
+}
 
-            // Get the text to be made heading
-            char *docstr;
-            size_t doclen;
-            document_serialize(doc, &docstr, &doclen);
+static int reactor_start(void)
+{
+    for (int i = 0; i < reactor_threads; i++)
+    {
+        reactor_epfd[i] = epoll_create1(EPOLL_CLOEXEC);
+        if (reactor_epfd[i] < 0)
+            return -1;
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, reactor_loop, &reactor_epfd[i]) != 0)
+            return -1;
+        pthread_detach(tid);
+    }
+    return 0;
+}
 
-            // Extract the text to be made heading
-            char text_to_heading[256];
-            strncpy(text_to_heading, docstr + position, length);
-            text_to_heading[length] = '\0';
+// Hand a connected session to a reactor thread, round-robin
+static int reactor_add(session_t *s)
+{
+    int epfd = reactor_epfd[atomic_fetch_add(&reactor_next, 1) % reactor_threads];
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd_c2s, &ev);
+}
 
-            // Delete the original text
-            document_delete(doc, position, length);
+// Tell a client it is turned away. It may not be reading; the connection
+// is closed either way.
+static void send_reject(int fd, const char *reason)
+{
+    if (write(fd, reason, strlen(reason)) < 0)
+        perror("Failed to send reject");
+}
 
-            // Create heading text with # markers
-            char heading_text[512];
-            char hashes[7] = "######"; // Max 6 #'s
-            hashes[level] = '\0';      // Truncate to required level
+// Finish a connection the acceptor has handed over: check the client's
+// role and send the document, then serve the session (or hand it to a
+// reactor thread). Nothing here waits on the client.
+void *handle_client(void *arg)
+{
+    conn_t *conn = arg;
+    int client_pid = conn->pid;
+    uint64_t signalled = conn->signalled;
+    int fd_s2c = conn->fd_s2c;
+    int fd_c2s = conn->fd_c2s;
+    char fifo_c2s[64], fifo_s2c[64];
+    printf("Client PID: %d\n", client_pid);
+    snprintf(fifo_c2s, sizeof(fifo_c2s), "FIFO_C2S_%d", client_pid);
+    snprintf(fifo_s2c, sizeof(fifo_s2c), "FIFO_S2C_%d", client_pid);
 
-            snprintf(heading_text, sizeof(heading_text), "%s %s", hashes, text_to_heading);
+    // Sessions read blocking, as in thread-per-client mode they must
+    fcntl(fd_c2s, F_SETFL, fcntl(fd_c2s, F_GETFL) & ~O_NONBLOCK);
 
-            // Insert the heading text
-            document_insert(doc, position, heading_text);
+    // The username line; anything read past it is the first commands
+    char *hello = conn->hello;
+    size_t hello_len = conn->hello_len;
+    hello[hello_len] = '\0';
+    size_t name_len = strcspn(hello, "\n");
+    char username[64];
+    snprintf(username, sizeof(username), "%.*s", (int)name_len, hello);
+    size_t ahead = name_len < hello_len ? hello_len - name_len - 1 : 0;
 
-            free(docstr);
-            return true;
-        }
+    const char *role = roles_lookup(username);
+    if (!role)
+    {
+        send_reject(fd_s2c, "Reject UNAUTHORISED\n");
+        conn_close(conn);
+        return NULL;
     }
 
-    // Check for LIST command (ordered or unordered)
-    else if (strncmp(cmd, "LIST ", 5) == 0)
+    // Register the client and send it the current document. It is
+    // registered with out_mutex held, so no broadcast of a later version can
+    // reach it ahead of its initial snapshot.
+    client_t *client = client_join(client_pid, fd_s2c, username, role);
+    if (client)
     {
-        if (!has_write_permission(role))
-        {
-            snprintf(response, resp_size, "Reject UNAUTHORISED LIST write read");
-            return false;
-        }
+        doc_view_t *view = view_acquire();
+        uint64_t first_byte = monotonic_ns();
+        client->sent_version = view->version;
+        send_snapshot(client, role, view);
+        pthread_mutex_unlock(&client->out_mutex);
+        view_release(view);
+        stats_record(STAT_CONNECT, first_byte - signalled);
+    }
+    else
+    {
+        send_reject(fd_s2c, "Reject SERVER_FULL\n");
+        conn_close(conn);
+        return NULL;
+    }
 
-        char type;
-        int position, count;
-        if (sscanf(cmd, "LIST %c %d %d", &type, &position, &count) == 3)
-        {
-            if (position < 0 || position >= (int)doc->length)
-            {
-                snprintf(response, resp_size, "Reject INVALID_POSITION");
-                return false;
-            }
+    session_t *s = calloc(1, sizeof(session_t));
+    s->client = client;
+    s->fd_c2s = fd_c2s;
+    s->role = role;
+    snprintf(s->username, sizeof(s->username), "%s", username);
+    snprintf(s->fifo_c2s, sizeof(s->fifo_c2s), "%s", fifo_c2s);
+    snprintf(s->fifo_s2c, sizeof(s->fifo_s2c), "%s", fifo_s2c);
+    memcpy(s->input, hello + name_len + 1, ahead);
+    s->input_len = ahead;
+    free(conn);
+    session_execute(s);
+
+    // In reactor mode this thread's job ends here
+    if (reactor_threads > 0 && reactor_add(s) == 0)
+        return NULL;
 
-            // Get the document text
-            char *docstr;
-            size_t doclen;
-            document_serialize(doc, &docstr, &doclen);
+    // Otherwise the session gets a thread of its own, freeing the worker
+    // for the next handshake
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, SESSION_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t tid;
+    if (pthread_create(&tid, &attr, session_loop, s) != 0)
+    {
+        perror("Failed to start session thread");
+        close_session(s);
+    }
+    pthread_attr_destroy(&attr);
+    return NULL;
+}
 
-            // Find line starts based on position
-            int line_starts[100]; // Assuming max 100 lines for simplicity
-            int line_count = 0;
+// Worker pool: connections the acceptor has finished with are registered on
+// pre-spawned threads rather than a thread created per connection
+static void *worker_loop(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&conn_mutex);
+        while (!conn_head)
+            pthread_cond_wait(&conn_cond, &conn_mutex);
+        conn_t *c = conn_head;
+        conn_head = c->next;
+        if (!conn_head)
+            conn_tail = NULL;
+        pthread_mutex_unlock(&conn_mutex);
+        handle_client(c);
+    }
+    return NULL;
+}
 
-            // Find start of current line
-            int curr_pos = position;
-            while (curr_pos > 0 && docstr[curr_pos - 1] != '\n')
-                curr_pos--;
+static int pool_start(void)
+{
+    if (pool_size == 0)
+        pool_size = POOL_DEFAULT;
+    for (int i = 0; i < pool_size; i++)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_loop, NULL) != 0)
+            return -1;
+        pthread_detach(tid);
+    }
+    return 0;
+}
 
-            line_starts[line_count++] = curr_pos;
+// Handshakes in progress, owned by the acceptor: each waits for its
+// username on the client-to-server FIFO, watched on acceptor_epfd. One that
+// has not sent it CONNECT_TIMEOUT_MS after its request is dropped on a tick
+// of handshake_timer, so a stalled or hostile client costs an entry here,
+// never a thread.
+static conn_t *handshakes;
+static int acceptor_epfd;
+static int signal_fd; // Connection requests
+static int handshake_timer;
+static bool handshake_timer_armed;
+
+// Take a handshake off the list, which it must be on
+static void handshake_unlink(conn_t *c)
+{
+    conn_t **link = &handshakes;
+    while (*link != c)
+        link = &(*link)->next;
+    *link = c->next;
+    c->next = NULL;
+}
 
-            // Find next 'count-1' line starts
-            curr_pos = position;
-            while (line_count < count && curr_pos < (int)doclen)
-            {
-                if (docstr[curr_pos] == '\n')
-                    line_starts[line_count++] = curr_pos + 1;
-                curr_pos++;
-            }
+// Closing its FIFO also takes it out of acceptor_epfd
+static void handshake_drop(conn_t *c, const char *why)
+{
+    fprintf(stderr, "Client %d: %s\n", c->pid, why);
+    handshake_unlink(c);
+    conn_close(c);
+}
 
-            // Apply list formatting to each line
-            for (int i = 0; i < line_count; i++)
-            {
-                int line_pos = line_starts[i];
+// Tick while there are handshakes to time out. The timer is only re-armed
+// when that changes, so a stream of connects cannot keep pushing it back.
+static void handshake_timer_update(void)
+{
+    bool want = handshakes != NULL;
+    if (want == handshake_timer_armed)
+        return;
+    long period = want ? CONNECT_TIMEOUT_MS / 10 : 0;
+    struct itimerspec t = {
+        .it_interval = {period / 1000, (period % 1000) * 1000000L},
+        .it_value = {period / 1000, (period % 1000) * 1000000L},
+    };
+    timerfd_settime(handshake_timer, 0, &t, NULL);
+    handshake_timer_armed = want;
+}
 
-                // Create list marker
-                char marker[10];
-                if (type == 'O' || type == 'o') // Ordered list
-                    snprintf(marker, sizeof(marker), "%d. ", i + 1);
-                else // Unordered list
-                    strcpy(marker, "- ");
+// Read what the client has sent of its username line, which may take more
+// than one read. Once it is in (or the client has closed its FIFO after
+// some of it), the connection goes to the pool.
+static void handshake_read(conn_t *c)
+{
+    size_t room = sizeof(c->hello) - 1 - c->hello_len;
+    ssize_t n = read(c->fd_c2s, c->hello + c->hello_len, room);
+    if (n < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+            handshake_drop(c, "failed to read username");
+        return;
+    }
+    if (n == 0 && c->hello_len == 0)
+    {
+        handshake_drop(c, "disconnected before sending a username");
+        return;
+    }
+    c->hello_len += n;
+    if (n > 0 && (size_t)n < room && !memchr(c->hello + c->hello_len - n, '\n', n))
+        return;
+
+    // The client opened its end of the S2C FIFO before this one, so the
+    // FIFO no longer needs ours
+    handshake_unlink(c);
+    epoll_ctl(acceptor_epfd, EPOLL_CTL_DEL, c->fd_c2s, NULL);
+    close(c->fd_hold);
+    c->fd_hold = -1;
+    pthread_mutex_lock(&conn_mutex);
+    if (conn_tail)
+        conn_tail->next = c;
+    else
+        conn_head = c;
+    conn_tail = c;
+    pthread_cond_signal(&conn_cond);
+    pthread_mutex_unlock(&conn_mutex);
+}
+
+// Drop handshakes past their deadline
+static void handshake_tick(void)
+{
+    uint64_t expirations;
+    if (read(handshake_timer, &expirations, sizeof(expirations)) < 0)
+        return;
+    uint64_t now = monotonic_ns();
+    conn_t *next;
+    for (conn_t *c = handshakes; c; c = next)
+    {
+        next = c->next;
+        if (now - c->signalled > (uint64_t)CONNECT_TIMEOUT_MS * 1000000)
+            handshake_drop(c, "did not connect in time");
+    }
+}
+
+// Accept one connection request: create the client's FIFOs, open them and
+// only then tell the client to. A FIFO cannot be opened non-blocking for
+// writing before it has a reader, and gives no event when one arrives, so
+// the acceptor holds a read end of the S2C FIFO itself until the username
+// is in. The client's blocking opens then return at once, and nothing here
+// waits for them. The S2C FIFO is left non-blocking; see client_t.
+static void accept_client(pid_t pid, uint64_t signalled)
+{
+    char fifo_c2s[64], fifo_s2c[64];
+    snprintf(fifo_c2s, sizeof(fifo_c2s), "FIFO_C2S_%d", pid);
+    snprintf(fifo_s2c, sizeof(fifo_s2c), "FIFO_S2C_%d", pid);
+    if (mkfifo(fifo_c2s, 0666) == -1 && errno != EEXIST)
+    {
+        perror("Failed to create client-to-server FIFO");
+        return;
+    }
+    if (mkfifo(fifo_s2c, 0666) == -1 && errno != EEXIST)
+    {
+        perror("Failed to create server-to-client FIFO");
+        unlink(fifo_c2s);
+        return;
+    }
 
-                // Insert marker at line start
-                document_insert(doc, line_pos, marker);
+    conn_t *c = malloc(sizeof(conn_t));
+    if (!c)
+    {
+        unlink(fifo_c2s);
+        unlink(fifo_s2c);
+        return;
+    }
+    c->pid = pid;
+    c->signalled = signalled;
+    c->hello_len = 0;
+    c->fd_hold = open(fifo_s2c, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    c->fd_s2c = c->fd_hold < 0 ? -1 : open(fifo_s2c, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    c->fd_c2s = open(fifo_c2s, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+    if (c->fd_s2c < 0 || c->fd_c2s < 0 || epoll_ctl(acceptor_epfd, EPOLL_CTL_ADD, c->fd_c2s, &ev) < 0)
+    {
+        perror("Failed to open client FIFOs");
+        conn_close(c);
+        return;
+    }
+    c->next = handshakes;
+    handshakes = c;
+
+    kill(pid, SIGRTMIN + 1);
+}
 
-                // Update other line positions after insertion
-                for (int j = i + 1; j < line_count; j++)
-                    line_starts[j] += strlen(marker);
+// Acceptor: connection requests arrive as SIGRTMIN, blocked in every thread
+// and read here from a signalfd, so no work happens in a signal handler.
+// Real-time signals queue, so a burst of connects is not coalesced. The
+// same thread drives every handshake up to the username.
+static void acceptor_loop(void)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    struct signalfd_siginfo si[16];
+    while (1)
+    {
+        handshake_timer_update();
+        int n = epoll_wait(acceptor_epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to wait for connection requests");
+            return;
+        }
+        // The tick goes last, as it may drop handshakes with events here
+        bool tick = false;
+        for (int i = 0; i < n; i++)
+        {
+            void *tag = events[i].data.ptr;
+            if (tag == &handshake_timer)
+            {
+                tick = true;
             }
+            else if (tag == &signal_fd)
+            {
+                ssize_t got = read(signal_fd, si, sizeof(si));
+                uint64_t now = monotonic_ns();
+                for (ssize_t k = 0; k < got / (ssize_t)sizeof(si[0]); k++)
+                    accept_client(si[k].ssi_pid, now);
+            }
+            else
+            {
+                handshake_read(tag);
+            }
+        }
+        if (tick)
+            handshake_tick();
+    }
+}
 
-            free(docstr);
-            return true;
+static int acceptor_start(sigset_t *accept_set)
+{
+    signal_fd = signalfd(-1, accept_set, SFD_CLOEXEC);
+    acceptor_epfd = epoll_create1(EPOLL_CLOEXEC);
+    handshake_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (signal_fd < 0 || acceptor_epfd < 0 || handshake_timer < 0)
+        return -1;
+    struct epoll_event sig_ev = {.events = EPOLLIN, .data.ptr = &signal_fd};
+    struct epoll_event timer_ev = {.events = EPOLLIN, .data.ptr = &handshake_timer};
+    if (epoll_ctl(acceptor_epfd, EPOLL_CTL_ADD, signal_fd, &sig_ev) < 0 ||
+        epoll_ctl(acceptor_epfd, EPOLL_CTL_ADD, handshake_timer, &timer_ev) < 0)
+        return -1;
+    return 0;
+}
+
+// Send a version block to every client on the list. Clients with nothing
+// queued get it straight from a single fan-out of the payload, and are held
+// under out_mutex meanwhile so no reply can land inside it; only the
+// broadcaster takes more than one, so there is no lock order to get wrong.
+// Clients still working through a backlog have it queued behind that
+// instead, and none of them is ever waited on.
+static void broadcast(const client_list_t *list, unsigned long ver, const char *msg, size_t len)
+{
+    static client_t **locked;
+    static int *fds;
+    static size_t *sent;
+    static size_t locked_cap, fds_cap, sent_cap;
+    locked = grow_array(locked, &locked_cap, list->count, sizeof(client_t *));
+    fds = grow_array(fds, &fds_cap, list->count, sizeof(int));
+    sent = grow_array(sent, &sent_cap, list->count, sizeof(size_t));
+
+    int nfds = 0;
+    for (size_t i = 0; i < list->count; i++)
+    {
+        client_t *c = list->clients[i];
+        if (atomic_load(&c->gone))
+            continue;
+        pthread_mutex_lock(&c->out_mutex);
+        if (c->out.head || c->out_failed)
+        {
+            queue_block(c, ver, msg, len, 0);
+            pthread_mutex_unlock(&c->out_mutex);
+            continue;
         }
+        locked[nfds] = c;
+        fds[nfds++] = c->fd_s2c;
     }
+    fanout_send(&fanout, fds, nfds, msg, len, sent);
+    for (int i = 0; i < nfds; i++)
+    {
+        client_t *c = locked[i];
+        if (sent[i] == len)
+            c->sent_version = ver;
+        else
+            queue_block(c, ver, msg, len, sent[i]);
+        pthread_mutex_unlock(&c->out_mutex);
+    }
+}
 
-    // Check for DOC? command
-    else if (strcmp(cmd, "DOC?\n") == 0 || strcmp(cmd, "DOC?") == 0)
+// Append formatted text to a growable buffer
+static void block_append(char **buf, size_t *len, size_t *cap, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void block_append(char **buf, size_t *len, size_t *cap, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if (*len + n + 1 > *cap)
     {
-        char *docstr;
-        size_t doclen;
-        document_serialize(doc, &docstr, &doclen);
-        snprintf(response, resp_size, "VERSION %lu\nDOCUMENT (%zu bytes):\n%s",
-                 version, doclen, docstr);
-        free(docstr);
-        return true;
+        size_t new_cap = *cap ? *cap : 4096;
+        while (*len + n + 1 > new_cap)
+            new_cap *= 2;
+        char *grown = realloc(*buf, new_cap);
+        if (!grown)
+            return;
+        *buf = grown;
+        *cap = new_cap;
     }
+    va_start(ap, fmt);
+    vsnprintf(*buf + *len, *cap - *len, fmt, ap);
+    va_end(ap);
+    *len += n;
+}
 
-    // Check for PERM? command
-    else if (strcmp(cmd, "PERM?\n") == 0 || strcmp(cmd, "PERM?") == 0)
+// Apply one queued edit; must be called with doc_mutex held. An edit that
+// was queued just before the last version went out is rebased onto it first,
+// and its EDIT line shows the rebased positions so replicas replay the same.
+static bool apply_edit(pending_edit_t *e, char *response, size_t resp_size)
+{
+    if (e->base_version + 1 == version)
     {
-        snprintf(response, resp_size, "PERMISSIONS %s: %s", username, role);
-        return true;
+        if (!command_rebase(prev_map, &e->edit, response, resp_size))
+            return false;
+        command_format(&e->edit, e->cmd, sizeof(e->cmd));
+    }
+    else if (e->base_version != version)
+    {
+        snprintf(response, resp_size, "Reject OUTDATED_VERSION");
+        return false;
     }
+    return command_apply(doc, cur_map, &e->edit, response, resp_size);
+}
 
-    // Check for LOG? command
-    else if (strcmp(cmd, "LOG?\n") == 0 || strcmp(cmd, "LOG?") == 0)
+// Min-heap of clients keyed by the receive time of their queue's head, ties
+// broken by slot so the merge order is deterministic
+static bool edit_before(client_t *a, client_t *b)
+{
+    const pending_edit_t *ea = spsc_peek(&a->edits);
+    const pending_edit_t *eb = spsc_peek(&b->edits);
+    if (ea->received != eb->received)
+        return ea->received < eb->received;
+    return a->slot < b->slot;
+}
+
+static void heap_sift_down(client_t **heap, size_t n, size_t i)
+{
+    while (1)
+    {
+        size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && edit_before(heap[l], heap[min]))
+            min = l;
+        if (r < n && edit_before(heap[r], heap[min]))
+            min = r;
+        if (min == i)
+            return;
+        client_t *tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+// Merge every client queue in receive order and apply the edits, appending
+// one EDIT line per edit to the block and to the version's log record.
+// Must be called with doc_mutex held.
+static void apply_pending_edits(const client_list_t *list, char **block, size_t *len, size_t *cap,
+                                vlog_record_t *rec)
+{
+    static client_t **heap;
+    static size_t heap_cap;
+    heap = grow_array(heap, &heap_cap, list->count, sizeof(client_t *));
+    size_t n = 0;
+    for (size_t i = 0; i < list->count; i++)
+        if (spsc_peek(&list->clients[i]->edits))
+            heap[n++] = list->clients[i];
+    for (size_t i = n / 2; i-- > 0;)
+        heap_sift_down(heap, n, i);
+
+    while (n > 0)
+    {
+        spsc_queue_t *q = &heap[0]->edits;
+        pending_edit_t *e = spsc_peek(q);
+        char response[256] = {0};
+        uint64_t start = monotonic_ns();
+        bool success = apply_edit(e, response, sizeof(response));
+        stats_record(STAT_EDIT + e->edit.type - CMD_INSERT, monotonic_ns() - start);
+        block_append(block, len, cap, "EDIT %s %s %s\n", e->username, e->cmd, success ? "SUCCESS" : response);
+        vlog_record_add(rec, e->username, e->cmd, success ? "SUCCESS" : response);
+        if (success)
+            wal_add(&wal, e->cmd);
+        spsc_pop(q);
+        free(e);
+
+        if (!spsc_peek(q))
+            heap[0] = heap[--n];
+        heap_sift_down(heap, n, 0);
+    }
+}
+
+// One tick: apply everything queued since the last one as a single version.
+// Every timer tick issues a version, as a bare heartbeat if nothing was
+// queued; an early tick requested by a full queue only runs if there are edits.
+// The client list is read inside an epoch, so clients can come and go without
+// the broadcaster taking client_mutex.
+static void run_tick(bool timer)
+{
+    static char *block = NULL;
+    static size_t block_cap = 0;
+    static vlog_record_t rec;
+
+    char *edits = NULL;
+    size_t edits_len = 0, edits_cap = 0;
+
+    epoch_enter(&client_epoch);
+    client_list_t *list = atomic_load(&live_clients);
+    bool pending = false;
+    for (size_t i = 0; i < list->count && !pending; i++)
+        pending = spsc_peek(&list->clients[i]->edits) != NULL;
+    if (!pending && !timer)
+    {
+        epoch_exit(&client_epoch);
+        return;
+    }
+
+    uint64_t locked = lock_timed(&doc_mutex, STAT_DOC_WAIT);
+    posmap_t *last = prev_map;
+    prev_map = cur_map;
+    cur_map = last;
+    posmap_reset(cur_map, doc->length);
+    vlog_record_reset(&rec);
+    apply_pending_edits(list, &edits, &edits_len, &edits_cap, &rec);
+    version++;
+    vlog_append(&version_log, &rec, doc->length);
+    if (wal_commit(&wal, version) < 0 && !wal.failed)
+        perror("Failed to write WAL");
+
+    size_t block_len = 0;
+    if (edits_len > 0)
+        block_append(&block, &block_len, &block_cap, "VERSION %lu\n%sLENGTH %zu\nEND\n",
+                     version, edits, doc->length);
+    else
+        block_append(&block, &block_len, &block_cap, "VERSION %lu\nEND\n", version);
+    free(edits);
+    const doc_snapshot_t *snap = snapshot_timed();
+
+    // Publish, then broadcast to the clients live now; one that joined
+    // after the view went out has it in its snapshot (see client_join)
+    unlock_timed(&doc_mutex, STAT_DOC_HOLD, locked);
+    view_publish(snap, version);
+    list = atomic_load(&live_clients);
+    uint64_t start = monotonic_ns();
+    broadcast(list, version, block, block_len);
+    stats_record(STAT_BROADCAST, monotonic_ns() - start);
+    bool departed = false;
+    for (size_t i = 0; i < list->count && !departed; i++)
+        departed = client_done(list->clients[i]);
+    epoch_exit(&client_epoch);
+
+    pthread_mutex_lock(&drain_mutex);
+    pthread_cond_broadcast(&drain_cond);
+    pthread_mutex_unlock(&drain_mutex);
+    if (departed)
+        reap_clients();
+
+    // The view just published matches the log, which only this thread
+    // appends to; doc_mutex keeps QUIT from clearing the log meanwhile. A
+    // log that could not be rolled back is replaced by a checkpoint at once.
+    if (wal.size >= checkpoint_bytes || wal.failed)
     {
-        snprintf(response, resp_size, "Connected clients:\n");
+        doc_view_t *v = view_acquire();
+        locked = lock_timed(&doc_mutex, STAT_DOC_WAIT);
+        if (wal_checkpoint(&wal, v->version, v->snap->data, v->snap->len) < 0)
+            perror("Failed to write checkpoint");
+        unlock_timed(&doc_mutex, STAT_DOC_HOLD, locked);
+        view_release(v);
+    }
+}
 
-        pthread_mutex_lock(&client_mutex);
-        for (int i = 0; i < MAX_CLIENTS; i++)
+// Broadcaster thread: ticks on a timerfd every time_interval milliseconds,
+// or early when a session finds its edit queue full. In between it flushes
+// queued output to clients as their FIFOs drain.
+static void *broadcaster_loop(void *arg)
+{
+    int timer_fd = *(int *)arg;
+    struct pollfd pfds[3] = {
+        {.fd = timer_fd, .events = POLLIN},
+        {.fd = kick_fd, .events = POLLIN},
+        {.fd = flush_epfd, .events = POLLIN},
+    };
+    while (1)
+    {
+        if (poll(pfds, 3, -1) < 0)
         {
-            if (clients[i].connected)
-            {
-                char client_info[128];
-                snprintf(client_info, sizeof(client_info),
-                         "- Client %d: %s (%s)\n",
-                         i, clients[i].username, clients[i].role);
-                strncat(response, client_info, resp_size - strlen(response) - 1);
-            }
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return NULL;
         }
-        pthread_mutex_unlock(&client_mutex);
 
+        // Missed expirations collapse into one tick: the next version simply
+        // carries everything queued since the last one
+        uint64_t count;
+        bool timer = (pfds[0].revents & POLLIN) && read(timer_fd, &count, sizeof(count)) == sizeof(count);
+        bool kick = (pfds[1].revents & POLLIN) && read(kick_fd, &count, sizeof(count)) == sizeof(count);
+        if (pfds[2].revents & POLLIN)
+            flush_clients();
+        if (timer || kick)
+            run_tick(timer);
+    }
+    return NULL;
+}
+
+// Dumps the stats to stats_path every STATS_DUMP_SECONDS, replacing it whole
+static void *stats_loop(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        sleep(STATS_DUMP_SECONDS);
+        if (stats_dump(stats_path) < 0)
+            perror("Failed to write stats");
+    }
+    return NULL;
+}
+
+// Runs on its own thread so QUIT's reply is sent before the process exits
+static void *shutdown_server(void *arg)
+{
+    (void)arg;
+    if (stats_path && stats_dump(stats_path) < 0)
+        perror("Failed to write stats");
+    exit(0);
+}
+
+// Check if user has write permission
+bool has_write_permission(const char *role)
+{
+    return (role != NULL && strcmp(role, "write") == 0);
+}
+
+// Process a client command
+bool process_command(const char *cmd, const char *username, const char *role, char *response, size_t resp_size)
+{
+    // Check for PERM? command
+    if (strcmp(cmd, "PERM?\n") == 0 || strcmp(cmd, "PERM?") == 0)
+    {
+        snprintf(response, resp_size, "PERMISSIONS %s: %s", username, role);
         return true;
     }
 
@@ -633,31 +1799,31 @@ bool process_command(const char *cmd, const char *username, const char *role, ch
             return false;
         }
 
-        // Serialize the document
-        char *docstr;
-        size_t doclen;
-        document_serialize(doc, &docstr, &doclen);
-
-        // Save to doc.md
-        FILE *f = fopen("doc.md", "w");
-        if (f)
+        // Save the document as of the last logged version. doc.md is
+        // replaced by rename, never rewritten, since it may still be mapped.
+        // Once saved, the next start loads it and the log can be emptied;
+        // anything logged after this point replays on top of it.
+        uint64_t locked = lock_timed(&doc_mutex, STAT_DOC_WAIT);
+        const doc_snapshot_t *snap = snapshot_timed();
+        bool saved = wal_save("doc.md", snap->data, snap->len) == 0;
+        if (saved && wal_clear(&wal) < 0)
+            perror("Failed to clear WAL");
+        unlock_timed(&doc_mutex, STAT_DOC_HOLD, locked);
+        document_snapshot_release(snap);
+
+        if (saved)
         {
-            fwrite(docstr, 1, doclen, f);
-            fclose(f);
             snprintf(response, resp_size, "Document saved to doc.md. Server shutting down.");
 
             // Schedule server shutdown
             // We'll exit after sending the response
             pthread_t shutdown_thread;
-            pthread_create(&shutdown_thread, NULL, (void *(*)(void *))exit, (void *)0);
-
-            free(docstr);
+            pthread_create(&shutdown_thread, NULL, shutdown_server, NULL);
             return true;
         }
         else
         {
             snprintf(response, resp_size, "Failed to save document");
-            free(docstr);
             return false;
         }
     }
@@ -677,47 +1843,226 @@ bool process_command(const char *cmd, const char *username, const char *role, ch
 
 int main(int argc, char **argv)
 {
-    if (argc != 2)
+    int opt;
+    while ((opt = getopt(argc, argv, "r:m:c:w:n:q:s:")) != -1)
+    {
+        if (opt == 'r')
+        {
+            reactor_threads = atoi(optarg);
+            if (reactor_threads <= 0 || reactor_threads > REACTOR_MAX_THREADS)
+            {
+                fprintf(stderr, "REACTOR_THREADS must be between 1 and %d\n", REACTOR_MAX_THREADS);
+                exit(1);
+            }
+        }
+        else if (opt == 'm')
+        {
+            long kib = atol(optarg);
+            if (kib <= 0)
+            {
+                fprintf(stderr, "LOG_MEMORY must be a positive number of KiB\n");
+                exit(1);
+            }
+            log_memory = (size_t)kib;
+        }
+        else if (opt == 'w')
+        {
+            pool_size = atoi(optarg);
+            if (pool_size <= 0)
+            {
+                fprintf(stderr, "WORKERS must be a positive number\n");
+                exit(1);
+            }
+        }
+        else if (opt == 'c')
+        {
+            long kib = atol(optarg);
+            if (kib <= 0)
+            {
+                fprintf(stderr, "CHECKPOINT must be a positive number of KiB\n");
+                exit(1);
+            }
+            checkpoint_bytes = (size_t)kib * 1024;
+        }
+        else if (opt == 'n')
+        {
+            long n = atol(optarg);
+            if (n <= 0)
+            {
+                fprintf(stderr, "MAX_CLIENTS must be a positive number\n");
+                exit(1);
+            }
+            max_clients = (size_t)n;
+        }
+        else if (opt == 'q')
+        {
+            long kib = atol(optarg);
+            if (kib <= 0)
+            {
+                fprintf(stderr, "QUEUE must be a positive number of KiB\n");
+                exit(1);
+            }
+            outq_limit = (size_t)kib * 1024;
+        }
+        else if (opt == 's')
+        {
+            stats_path = optarg;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-r REACTOR_THREADS] [-m LOG_MEMORY_KIB] [-c CHECKPOINT_KIB] [-w WORKERS] [-n MAX_CLIENTS] [-q QUEUE_KIB] [-s STATS_FILE] <TIME_INTERVAL>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1)
     {
-        fprintf(stderr, "Usage: %s <TIME_INTERVAL>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-r REACTOR_THREADS] [-m LOG_MEMORY_KIB] [-c CHECKPOINT_KIB] [-w WORKERS] [-n MAX_CLIENTS] [-q QUEUE_KIB] [-s STATS_FILE] <TIME_INTERVAL>\n", argv[0]);
         exit(1);
     }
 
     // Parse time interval from argument
-    time_interval = atoi(argv[1]);
+    time_interval = atoi(argv[optind]);
     if (time_interval <= 0)
     {
-        fprintf(stderr, "TIME_INTERVAL must be a positive integer\n");
+        fprintf(stderr, "TIME_INTERVAL must be a positive number of milliseconds\n");
         exit(1);
     }
 
+    // Connection requests are read from a signalfd, so SIGRTMIN must be
+    // blocked before any thread starts and inherits the mask
+    sigset_t accept_set;
+    sigemptyset(&accept_set);
+    sigaddset(&accept_set, SIGRTMIN);
+    pthread_sigmask(SIG_BLOCK, &accept_set, NULL);
+
     printf("Server PID: %d\n", getpid());
-    doc = document_create();
+    if (stats_start() < 0)
+    {
+        perror("Failed to set up stats");
+        exit(1);
+    }
+    if (roles_init("roles.txt") < 0)
+    {
+        perror("Failed to load roles.txt");
+        exit(1);
+    }
+    // Pick up where the last run left off: the last checkpoint if there is
+    // one, otherwise the document saved at QUIT, mapped rather than read so
+    // startup does not grow with its size; then the log on top of either
+    if (access(CHECKPOINT_PATH, F_OK) == 0)
+    {
+        doc = document_create(); // The checkpoint holds the whole document
+    }
+    else if ((doc = document_map("doc.md")) != NULL)
+    {
+        printf("Loaded doc.md (%zu bytes)\n", doc->length);
+    }
+    else if (errno == ENOENT)
+    {
+        doc = document_create();
+    }
+    else
+    {
+        perror("Failed to open doc.md");
+        exit(1);
+    }
+    unsigned long recovered = 0;
+    if (wal_recover(WAL_PATH, CHECKPOINT_PATH, doc, &recovered) < 0)
+        exit(1);
+    if (recovered > 0)
+        printf("Recovered version %lu (%zu bytes)\n", recovered, doc->length);
+    version = recovered;
+    if (wal_open(&wal, WAL_PATH, CHECKPOINT_PATH) < 0)
+    {
+        perror("Failed to open WAL");
+        exit(1);
+    }
+    if (epoch_init(&view_epoch) < 0)
+    {
+        perror("Failed to set up views");
+        exit(1);
+    }
+    view_publish(document_snapshot(doc), version);
+    if (vlog_init(&version_log, version + 1, log_memory * 1024) < 0)
+    {
+        perror("Failed to create version log");
+        exit(1);
+    }
+    if (fanout_init(&fanout) < 0)
+    {
+        perror("Failed to set up broadcast fan-out");
+        exit(1);
+    }
 
-    // Set up signal handler for client connections
-    struct sigaction sa = {0};
-    sa.sa_flags = SA_SIGINFO;
-    sa.sa_sigaction = sigrtmin_handler;
-    sigaction(SIGRTMIN, &sa, NULL);
+    // A client that disappears mid-broadcast must not take the server down
+    signal(SIGPIPE, SIG_IGN);
 
-    // Set up timer for periodic broadcasts
-    struct sigaction sa_timer = {0};
-    sa_timer.sa_handler = timed_broadcast;
-    sigaction(SIGALRM, &sa_timer, NULL);
+    if (reactor_threads > 0 && reactor_start() < 0)
+    {
+        perror("Failed to start reactor threads");
+        exit(1);
+    }
 
-    // Configure timer interval
-    struct itimerval timer;
-    timer.it_value.tv_sec = time_interval;
-    timer.it_value.tv_usec = 0;
-    timer.it_interval.tv_sec = time_interval;
-    timer.it_interval.tv_usec = 0;
+    // Every client holds two FIFOs open, so take all the descriptors the
+    // hard limit allows
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max)
+    {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
 
-    // Start the timer
-    setitimer(ITIMER_REAL, &timer, NULL);
+    // The client list, whose edit queues the broadcaster drains once per tick
+    atomic_init(&live_clients, calloc(1, sizeof(client_list_t)));
+    if (epoch_init(&client_epoch) < 0 || !atomic_load(&live_clients))
+    {
+        perror("Failed to set up client list");
+        exit(1);
+    }
+    posmap_init(&edit_maps[0]);
+    posmap_init(&edit_maps[1]);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    kick_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    flush_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (timer_fd < 0 || kick_fd < 0 || flush_epfd < 0)
+    {
+        perror("Failed to create broadcast timer");
+        exit(1);
+    }
+    struct itimerspec timer;
+    timer.it_value.tv_sec = time_interval / 1000;
+    timer.it_value.tv_nsec = (long)(time_interval % 1000) * 1000000;
+    timer.it_interval = timer.it_value;
+    timerfd_settime(timer_fd, 0, &timer, NULL);
+
+    pthread_t broadcaster;
+    if (pthread_create(&broadcaster, NULL, broadcaster_loop, &timer_fd) != 0)
+    {
+        perror("Failed to start broadcaster thread");
+        exit(1);
+    }
+    pthread_detach(broadcaster);
+    if (stats_path)
+    {
+        pthread_t stats_thread;
+        if (pthread_create(&stats_thread, NULL, stats_loop, NULL) != 0)
+        {
+            perror("Failed to start stats thread");
+            exit(1);
+        }
+        pthread_detach(stats_thread);
+    }
 
-    while (1)
-        pause();
+    // Take connection requests and handshakes on this thread, registration
+    // on the pool
+    if (acceptor_start(&accept_set) < 0 || pool_start() < 0)
+    {
+        perror("Failed to start connection acceptor");
+        exit(1);
+    }
+    acceptor_loop();
 
+    fanout_destroy(&fanout);
     document_free(doc);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include <stdlib.h>
+#include "spsc.h"
+
+int spsc_init(spsc_queue_t *q, size_t capacity)
+{
+    size_t cap = 1;
+    while (cap < capacity)
+        cap *= 2;
+    q->slots = calloc(cap, sizeof(void *));
+    if (!q->slots)
+        return -1;
+    q->mask = cap - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return 0;
+}
+
+void spsc_destroy(spsc_queue_t *q)
+{
+    free(q->slots);
+    q->slots = NULL;
+}
+
+// Producer side. Returns false if the queue is full.
+bool spsc_push(spsc_queue_t *q, void *item)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head > q->mask)
+        return false;
+    q->slots[tail & q->mask] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// Consumer side. Returns the oldest item without removing it, or NULL.
+void *spsc_peek(spsc_queue_t *q)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail)
+        return NULL;
+    return q->slots[head & q->mask];
+}
+
+// Consumer side. Removes the item last returned by spsc_peek.
+void spsc_pop(spsc_queue_t *q)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+}
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include "stats.h"
+
+typedef struct stats_block
+{
+    struct stats_block *next;      // Every block ever made
+    struct stats_block *next_free; // Blocks whose thread has exited
+    pthread_mutex_t mutex;         // Contended only while a reader merges
+    hist_t *hists[];               // One per metric, NULL until recorded
+} stats_block_t;
+
+static const stats_metric_t *metrics;
+static int metric_count;
+static stats_block_t *blocks;
+static stats_block_t *free_blocks;
+static pthread_mutex_t blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t block_key; // Only for its destructor, run at thread exit
+static _Thread_local stats_block_t *own;
+
+static void block_release(void *arg)
+{
+    stats_block_t *b = arg;
+    pthread_mutex_lock(&blocks_mutex);
+    b->next_free = free_blocks;
+    free_blocks = b;
+    pthread_mutex_unlock(&blocks_mutex);
+    own = NULL;
+}
+
+int stats_init(const stats_metric_t *m, int count)
+{
+    metrics = m;
+    metric_count = count;
+    return pthread_key_create(&block_key, block_release) == 0 ? 0 : -1;
+}
+
+// This thread's block, taking one over or making one on first use
+static stats_block_t *block_get(void)
+{
+    if (own)
+        return own;
+    pthread_mutex_lock(&blocks_mutex);
+    stats_block_t *b = free_blocks;
+    if (b)
+    {
+        free_blocks = b->next_free;
+    }
+    else
+    {
+        b = calloc(1, sizeof(stats_block_t) + metric_count * sizeof(hist_t *));
+        if (!b)
+        {
+            pthread_mutex_unlock(&blocks_mutex);
+            return NULL;
+        }
+        pthread_mutex_init(&b->mutex, NULL);
+        b->next = blocks;
+        blocks = b;
+    }
+    pthread_mutex_unlock(&blocks_mutex);
+    pthread_setspecific(block_key, b);
+    own = b;
+    return b;
+}
+
+// Record one value. Cheap enough for every command and lock acquisition:
+// an uncontended lock of this thread's own block and a bucket increment.
+void stats_record(int metric, uint64_t value)
+{
+    stats_block_t *b = block_get();
+    if (!b)
+        return;
+    // Only this thread stores to its hists[], so it reads them unlocked
+    hist_t *h = b->hists[metric];
+    if (!h && !(h = calloc(1, sizeof(hist_t))))
+        return;
+    pthread_mutex_lock(&b->mutex);
+    b->hists[metric] = h;
+    hist_add(h, value);
+    pthread_mutex_unlock(&b->mutex);
+}
+
+// Sum one metric over every thread
+void stats_merge(int metric, hist_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&blocks_mutex);
+    for (stats_block_t *b = blocks; b; b = b->next)
+    {
+        pthread_mutex_lock(&b->mutex);
+        if (b->hists[metric])
+            hist_merge(out, b->hists[metric]);
+        pthread_mutex_unlock(&b->mutex);
+    }
+    pthread_mutex_unlock(&blocks_mutex);
+}
+
+// Every metric, one line each:
+// "name count N mean M p50 A p90 B p99 C max D unit"
+// Returns a malloc'd string, or NULL if out of memory.
+char *stats_report(size_t *len)
+{
+    hist_t *h = malloc(sizeof(hist_t));
+    char *text = NULL;
+    FILE *out = h ? open_memstream(&text, len) : NULL;
+    if (!out)
+    {
+        free(h);
+        return NULL;
+    }
+    for (int i = 0; i < metric_count; i++)
+    {
+        stats_merge(i, h);
+        fprintf(out, "%s count %llu mean %llu p50 %llu p90 %llu p99 %llu max %llu %s\n",
+                metrics[i].name, (unsigned long long)h->count,
+                (unsigned long long)(h->count ? h->sum / h->count : 0),
+                (unsigned long long)hist_quantile(h, 0.5), (unsigned long long)hist_quantile(h, 0.9),
+                (unsigned long long)hist_quantile(h, 0.99), (unsigned long long)h->max, metrics[i].unit);
+    }
+    free(h);
+    if (fclose(out) != 0)
+    {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+// Write the report to path, replacing it whole so a reader never sees half
+int stats_dump(const char *path)
+{
+    size_t len;
+    char *text = stats_report(&len);
+    if (!text)
+        return -1;
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    int rc = -1;
+    if (f)
+    {
+        bool written = fwrite(text, 1, len, f) == len;
+        if (fclose(f) == 0 && written && rename(tmp, path) == 0)
+            rc = 0;
+        else
+            unlink(tmp);
+    }
+    free(text);
+    return rc;
+}
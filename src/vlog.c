@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "vlog.h"
+
+// Bytes per arena chunk; records may straddle chunk boundaries
+#define VLOG_CHUNK 65536
+
+// Grow an array to hold at least n elements; a record cannot be left half
+// appended, so running out of memory is fatal
+static void *grow(void *arr, size_t *cap, size_t n, size_t elem)
+{
+    if (n <= *cap)
+        return arr;
+    size_t new_cap = *cap ? *cap : 16;
+    while (new_cap < n)
+        new_cap *= 2;
+    arr = realloc(arr, new_cap * elem);
+    if (!arr)
+        abort();
+    *cap = new_cap;
+    return arr;
+}
+
+int vlog_init(vlog_t *log, unsigned long first, size_t memory_limit)
+{
+    memset(log, 0, sizeof(*log));
+    char path[] = "/tmp/vlog-XXXXXX";
+    log->spill_fd = mkstemp(path);
+    if (log->spill_fd < 0)
+        return -1;
+    unlink(path);
+    pthread_rwlock_init(&log->lock, NULL);
+    log->first = first;
+    log->last = first - 1;
+    log->memory_limit = memory_limit;
+    return 0;
+}
+
+void vlog_destroy(vlog_t *log)
+{
+    for (size_t i = log->spilled; i < log->nchunks; i++)
+        free(log->chunks[i]);
+    free(log->chunks);
+    free(log->index);
+    close(log->spill_fd);
+    pthread_rwlock_destroy(&log->lock);
+}
+
+// LEB128: seven bits per byte, high bit set on all but the last
+static void put_varint(vlog_record_t *rec, uint64_t v)
+{
+    rec->data = grow(rec->data, &rec->cap, rec->len + 10, 1);
+    do
+    {
+        uint8_t b = v & 0x7f;
+        v >>= 7;
+        rec->data[rec->len++] = (char)(b | (v ? 0x80 : 0));
+    } while (v);
+}
+
+static bool get_varint(const char **p, const char *end, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7)
+    {
+        uint8_t b = (uint8_t)*(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static void put_string(vlog_record_t *rec, const char *s)
+{
+    size_t n = strlen(s);
+    put_varint(rec, n);
+    rec->data = grow(rec->data, &rec->cap, rec->len + n, 1);
+    memcpy(rec->data + rec->len, s, n);
+    rec->len += n;
+}
+
+void vlog_record_reset(vlog_record_t *rec)
+{
+    rec->len = 0;
+}
+
+// Add one edit. A successful edit stores an empty result.
+void vlog_record_add(vlog_record_t *rec, const char *user, const char *cmd, const char *result)
+{
+    put_string(rec, user);
+    put_string(rec, cmd);
+    put_string(rec, strcmp(result, "SUCCESS") == 0 ? "" : result);
+}
+
+void vlog_record_free(vlog_record_t *rec)
+{
+    free(rec->data);
+    memset(rec, 0, sizeof(*rec));
+}
+
+// Copy bytes to the end of the log, adding chunks as needed. Readers never
+// look past log->end, so the bytes need no lock; the chunk table does.
+static void append_bytes(vlog_t *log, uint64_t *end, const char *src, size_t n)
+{
+    while (n > 0)
+    {
+        size_t c = *end / VLOG_CHUNK;
+        size_t off = *end % VLOG_CHUNK;
+        if (c == log->nchunks)
+        {
+            char *chunk = malloc(VLOG_CHUNK);
+            if (!chunk)
+                abort();
+            pthread_rwlock_wrlock(&log->lock);
+            log->chunks = grow(log->chunks, &log->chunks_cap, c + 1, sizeof(char *));
+            log->chunks[log->nchunks++] = chunk;
+            pthread_rwlock_unlock(&log->lock);
+        }
+        size_t take = VLOG_CHUNK - off < n ? VLOG_CHUNK - off : n;
+        memcpy(log->chunks[c] + off, src, take);
+        *end += take;
+        src += take;
+        n -= take;
+    }
+}
+
+// Write the oldest full chunks to the spill file until the resident ones
+// fit the memory limit. The chunk being filled always stays in memory.
+static void spill(vlog_t *log)
+{
+    while (log->spilled + 1 < log->nchunks &&
+           (log->nchunks - log->spilled) * VLOG_CHUNK > log->memory_limit)
+    {
+        size_t c = log->spilled;
+        const char *p = log->chunks[c];
+        size_t left = VLOG_CHUNK;
+        off_t pos = (off_t)c * VLOG_CHUNK;
+        while (left > 0)
+        {
+            ssize_t n = pwrite(log->spill_fd, p, left, pos);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                // Keep the chunk in memory rather than lose history
+                perror("Failed to spill version log");
+                return;
+            }
+            p += n;
+            pos += n;
+            left -= n;
+        }
+
+        pthread_rwlock_wrlock(&log->lock);
+        char *chunk = log->chunks[c];
+        log->chunks[c] = NULL;
+        log->spilled++;
+        pthread_rwlock_unlock(&log->lock);
+        free(chunk);
+    }
+}
+
+// Bytes vlog_format renders a record as, worked out without rendering it
+static uint64_t text_size(unsigned long version, size_t length, const vlog_record_t *rec)
+{
+    char line[64];
+    uint64_t total = snprintf(line, sizeof(line), "VERSION %lu\n", version) +
+                     snprintf(line, sizeof(line), "LENGTH %llu\n", (unsigned long long)length) + 4;
+    const char *p = rec->data;
+    const char *end = rec->data + rec->len;
+    while (p < end)
+    {
+        total += 8; // "EDIT ", two spaces and the newline
+        for (int field = 0; field < 3; field++)
+        {
+            uint64_t n;
+            if (!get_varint(&p, end, &n))
+                return total;
+            total += field == 2 && n == 0 ? 7 : n; // An empty result reads SUCCESS
+            p += n;
+        }
+    }
+    return total;
+}
+
+// Append the next version: its edits and the document length after them.
+// A heartbeat, with no edits, is only counted.
+void vlog_append(vlog_t *log, const vlog_record_t *rec, size_t length)
+{
+    if (rec->len == 0)
+    {
+        pthread_rwlock_wrlock(&log->lock);
+        log->last++;
+        pthread_rwlock_unlock(&log->lock);
+        return;
+    }
+
+    vlog_record_t head = {0};
+    put_varint(&head, length);
+
+    uint64_t end = log->end;
+    append_bytes(log, &end, head.data, head.len);
+    append_bytes(log, &end, rec->data, rec->len);
+    vlog_record_free(&head);
+
+    uint64_t text = text_size(log->last + 1, length, rec) + (log->count ? log->index[log->count - 1].text : 0);
+    pthread_rwlock_wrlock(&log->lock);
+    log->index = grow(log->index, &log->index_cap, log->count + 1, sizeof(vlog_entry_t));
+    log->index[log->count++] = (vlog_entry_t){++log->last, log->end, text};
+    log->end = end;
+    pthread_rwlock_unlock(&log->lock);
+
+    spill(log);
+}
+
+// Last version logged, or first - 1 if none yet
+unsigned long vlog_last(vlog_t *log)
+{
+    pthread_rwlock_rdlock(&log->lock);
+    unsigned long last = log->last;
+    pthread_rwlock_unlock(&log->lock);
+    return last;
+}
+
+// Index of the first entry for version or later; called with the lock held
+static size_t find_entry(const vlog_t *log, unsigned long version)
+{
+    size_t lo = 0, hi = log->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (log->index[mid].version < version)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Move *version on to the first version from it that has edits. Returns
+// false if there is none, so callers skip heartbeats without visiting them.
+bool vlog_next(vlog_t *log, unsigned long *version)
+{
+    pthread_rwlock_rdlock(&log->lock);
+    size_t i = find_entry(log, *version);
+    bool found = i < log->count;
+    if (found)
+        *version = log->index[i].version;
+    pthread_rwlock_unlock(&log->lock);
+    return found;
+}
+
+// Bytes vlog_format gives for the versions with edits in [from, to], found
+// from the index without reading any record
+uint64_t vlog_text_size(vlog_t *log, unsigned long from, unsigned long to)
+{
+    pthread_rwlock_rdlock(&log->lock);
+    size_t i = find_entry(log, from);
+    size_t j = find_entry(log, to + 1);
+    uint64_t size = j > i ? log->index[j - 1].text - (i > 0 ? log->index[i - 1].text : 0) : 0;
+    pthread_rwlock_unlock(&log->lock);
+    return size;
+}
+
+// Copy log bytes [off, off + n) out of memory or the spill file; must be
+// called with the lock held for reading
+static bool read_bytes(vlog_t *log, uint64_t off, char *dst, size_t n)
+{
+    while (n > 0)
+    {
+        size_t c = off / VLOG_CHUNK;
+        size_t in = off % VLOG_CHUNK;
+        size_t take = VLOG_CHUNK - in < n ? VLOG_CHUNK - in : n;
+        if (c < log->spilled)
+        {
+            ssize_t got = pread(log->spill_fd, dst, take, (off_t)off);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                return false;
+            take = got;
+        }
+        else
+        {
+            memcpy(dst, log->chunks[c] + in, take);
+        }
+        off += take;
+        dst += take;
+        n -= take;
+    }
+    return true;
+}
+
+static void text_append(vlog_reader_t *r, const char *s, size_t n)
+{
+    r->text = grow(r->text, &r->text_cap, r->text_len + n + 1, 1);
+    memcpy(r->text + r->text_len, s, n);
+    r->text_len += n;
+    r->text[r->text_len] = '\0';
+}
+
+// Decode one length-prefixed string and append it to the text
+static bool text_string(vlog_reader_t *r, const char **p, const char *end)
+{
+    uint64_t n;
+    if (!get_varint(p, end, &n) || n > (uint64_t)(end - *p))
+        return false;
+    text_append(r, *p, n);
+    *p += n;
+    return true;
+}
+
+// Format a version exactly as it was broadcast into r->text. Returns false
+// if the version is not in the log.
+bool vlog_format(vlog_t *log, unsigned long version, vlog_reader_t *r)
+{
+    r->text_len = 0;
+    r->edits = 0;
+
+    // Copy the record out so the lock is not held while formatting
+    pthread_rwlock_rdlock(&log->lock);
+    if (version < log->first || version > log->last)
+    {
+        pthread_rwlock_unlock(&log->lock);
+        return false;
+    }
+    size_t i = find_entry(log, version);
+    size_t n = 0;
+    bool ok = true;
+    if (i < log->count && log->index[i].version == version)
+    {
+        uint64_t start = log->index[i].offset;
+        n = (i + 1 < log->count ? log->index[i + 1].offset : log->end) - start;
+        r->raw = grow(r->raw, &r->raw_cap, n, 1);
+        ok = read_bytes(log, start, r->raw, n);
+    }
+    pthread_rwlock_unlock(&log->lock);
+    if (!ok)
+        return false;
+
+    char line[64];
+    int len = snprintf(line, sizeof(line), "VERSION %lu\n", version);
+    text_append(r, line, len);
+    if (n == 0)
+    {
+        text_append(r, "END\n", 4); // A heartbeat
+        return true;
+    }
+
+    const char *p = r->raw;
+    const char *end = r->raw + n;
+    uint64_t length;
+    if (!get_varint(&p, end, &length))
+        return false;
+    while (p < end)
+    {
+        text_append(r, "EDIT ", 5);
+        if (!text_string(r, &p, end))
+            return false;
+        text_append(r, " ", 1);
+        if (!text_string(r, &p, end))
+            return false;
+        text_append(r, " ", 1);
+        size_t before = r->text_len;
+        if (!text_string(r, &p, end))
+            return false;
+        if (r->text_len == before)
+            text_append(r, "SUCCESS", 7);
+        text_append(r, "\n", 1);
+        r->edits++;
+    }
+    if (r->edits > 0)
+    {
+        len = snprintf(line, sizeof(line), "LENGTH %llu\n", (unsigned long long)length);
+        text_append(r, line, len);
+    }
+    text_append(r, "END\n", 4);
+    return true;
+}
+
+void vlog_reader_free(vlog_reader_t *r)
+{
+    free(r->raw);
+    free(r->text);
+    memset(r, 0, sizeof(*r));
+}
@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "wal.h"
+#include "command.h"
+#include "posmap.h"
+
+// Record header: payload length, then CRC-32 of the payload
+#define WAL_HEADER 8
+
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+    if (crc_table[1])
+        return;
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const char *p, size_t n)
+{
+    crc = ~crc;
+    while (n--)
+        crc = crc_table[(crc ^ (uint8_t)*p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read a whole file into a NUL-terminated buffer
+static char *read_file(const char *path, size_t *len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1)))
+    {
+        size_t got = 0;
+        while (got < (size_t)st.st_size)
+        {
+            ssize_t n = read(fd, buf + got, st.st_size - got);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            got += n;
+        }
+        buf[got] = '\0';
+        *len = got;
+    }
+    close(fd);
+    return buf;
+}
+
+// Flush the directory holding path, so a rename into it is durable
+static void sync_dir(const char *path)
+{
+    char dir[256] = ".";
+    const char *slash = strrchr(path, '/');
+    if (slash && (size_t)(slash - path) < sizeof(dir))
+    {
+        memcpy(dir, path, slash - path);
+        dir[slash > path ? slash - path : 1] = '\0';
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Replace path with head followed by data, so a crash leaves either the old
+// file or the new one: write a temporary, fsync it, then rename it over
+static int write_file(const char *path, const char *head, size_t head_len, const char *data, size_t len)
+{
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    if (write_all(fd, head, head_len) < 0 || write_all(fd, data, len) < 0 || fsync(fd) < 0)
+    {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    if (rename(tmp, path) < 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    sync_dir(path);
+    return 0;
+}
+
+// Replay one record's commands as a version block against doc
+static void replay_record(document_t *doc, posmap_t *map, char *cmds)
+{
+    posmap_reset(map, doc->length);
+    char *saveptr;
+    for (char *line = strtok_r(cmds, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr))
+    {
+        command_t edit;
+        char response[128];
+        if (!command_parse(line, &edit) || !command_apply(doc, map, &edit, response, sizeof(response)))
+            fprintf(stderr, "WAL: could not replay \"%s\"\n", line);
+    }
+}
+
+// Rebuild the document from the last checkpoint and the log after it.
+// *version is set to the last version recovered, and a torn record at the
+// end of the log (a crash mid-write) is cut off. Missing files are not an
+// error: there is simply nothing to recover.
+int wal_recover(const char *path, const char *checkpoint_path, document_t *doc, unsigned long *version)
+{
+    crc_init();
+
+    size_t len;
+    unsigned long checkpoint = 0;
+    char *snap = read_file(checkpoint_path, &len);
+    if (snap)
+    {
+        size_t snap_len;
+        int head;
+        if (sscanf(snap, "%lu %zu\n%n", &checkpoint, &snap_len, &head) != 2 || head + snap_len != len)
+        {
+            fprintf(stderr, "WAL: checkpoint %s is damaged\n", checkpoint_path);
+            free(snap);
+            return -1;
+        }
+        document_insert(doc, 0, snap + head);
+        *version = checkpoint;
+        free(snap);
+    }
+
+    char *log = read_file(path, &len);
+    if (!log)
+        return 0;
+    posmap_t map;
+    posmap_init(&map);
+    size_t off = 0;
+    while (len - off >= WAL_HEADER)
+    {
+        uint32_t n, crc;
+        memcpy(&n, log + off, 4);
+        memcpy(&crc, log + off + 4, 4);
+        if (n > len - off - WAL_HEADER)
+            break;
+        char *payload = log + off + WAL_HEADER;
+        if (crc32_update(0, payload, n) != crc)
+            break;
+
+        // Records up to the checkpoint are already in it
+        char saved = payload[n];
+        payload[n] = '\0';
+        char *cmds;
+        unsigned long v = strtoul(payload, &cmds, 10);
+        if (v > checkpoint)
+        {
+            replay_record(doc, &map, cmds);
+            *version = v;
+        }
+        payload[n] = saved;
+        off += WAL_HEADER + n;
+    }
+    if (off < len)
+    {
+        // Records appended after the torn one would be lost with it
+        fprintf(stderr, "WAL: discarding %zu bytes of torn record\n", len - off);
+        if (truncate(path, off) < 0)
+        {
+            perror("WAL: failed to discard torn record");
+            posmap_free(&map);
+            free(log);
+            return -1;
+        }
+    }
+    posmap_free(&map);
+    free(log);
+    return 0;
+}
+
+int wal_open(wal_t *w, const char *path, const char *checkpoint_path)
+{
+    memset(w, 0, sizeof(*w));
+    crc_init();
+    w->path = path;
+    w->checkpoint_path = checkpoint_path;
+    w->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (w->fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(w->fd, &st) == 0)
+        w->size = st.st_size;
+    return 0;
+}
+
+void wal_close(wal_t *w)
+{
+    close(w->fd);
+    free(w->buf);
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+}
+
+// Add a successful command to the current version's record
+void wal_add(wal_t *w, const char *cmd)
+{
+    size_t n = strlen(cmd);
+    if (w->len + n + 1 > w->cap)
+    {
+        size_t cap = w->cap ? w->cap : 4096;
+        while (w->len + n + 1 > cap)
+            cap *= 2;
+        char *buf = realloc(w->buf, cap);
+        if (!buf)
+            abort();
+        w->buf = buf;
+        w->cap = cap;
+    }
+    memcpy(w->buf + w->len, cmd, n);
+    w->len += n;
+    w->buf[w->len++] = '\n';
+    w->edits++;
+}
+
+// Cut a failed commit's record off again so later records are not stranded
+// behind it. If even that fails, the record may be replayed although its
+// version was not committed, and anything appended after it would be lost
+// behind a torn one, so nothing more is appended until the next checkpoint.
+static void rollback(wal_t *w)
+{
+    if (ftruncate(w->fd, w->size) < 0)
+    {
+        perror("WAL: failed to roll back a failed commit; logging stops until the next checkpoint");
+        w->failed = true;
+    }
+}
+
+// Group commit: write the version's record in one writev and fdatasync it.
+// A version with no successful edits writes nothing.
+int wal_commit(wal_t *w, unsigned long version)
+{
+    if (w->edits == 0)
+        return 0;
+    if (w->failed)
+    {
+        w->len = 0;
+        w->edits = 0;
+        return -1;
+    }
+
+    char line[32];
+    int line_len = snprintf(line, sizeof(line), "%lu\n", version);
+    uint32_t n = line_len + w->len;
+    uint32_t crc = crc32_update(crc32_update(0, line, line_len), w->buf, w->len);
+    char header[WAL_HEADER];
+    memcpy(header, &n, 4);
+    memcpy(header + 4, &crc, 4);
+
+    struct iovec iov[3] = {
+        {header, WAL_HEADER},
+        {line, line_len},
+        {w->buf, w->len},
+    };
+    size_t total = WAL_HEADER + n;
+    size_t done = 0;
+    w->len = 0;
+    w->edits = 0;
+    while (done < total)
+    {
+        // Skip what a short write already covered
+        struct iovec rest[3];
+        int cnt = 0;
+        size_t skip = done;
+        for (int i = 0; i < 3; i++)
+        {
+            if (skip >= iov[i].iov_len)
+            {
+                skip -= iov[i].iov_len;
+                continue;
+            }
+            rest[cnt].iov_base = (char *)iov[i].iov_base + skip;
+            rest[cnt].iov_len = iov[i].iov_len - skip;
+            skip = 0;
+            cnt++;
+        }
+        ssize_t wrote = writev(w->fd, rest, cnt);
+        if (wrote < 0 && errno == EINTR)
+            continue;
+        if (wrote <= 0)
+        {
+            rollback(w);
+            return -1;
+        }
+        done += wrote;
+    }
+    if (fdatasync(w->fd) < 0)
+    {
+        rollback(w);
+        return -1;
+    }
+    w->size += total;
+    return 0;
+}
+
+// Snapshot the document as of version and empty the log. The snapshot is
+// in place before the log is cut, and recovery skips records the snapshot
+// already covers, so a crash in between loses nothing.
+int wal_checkpoint(wal_t *w, unsigned long version, const char *data, size_t len)
+{
+    char head[64];
+    int head_len = snprintf(head, sizeof(head), "%lu %zu\n", version, len);
+    if (write_file(w->checkpoint_path, head, head_len, data, len) < 0)
+        return -1;
+    if (ftruncate(w->fd, 0) < 0 || fsync(w->fd) < 0)
+        return -1;
+    w->size = 0;
+    w->failed = false;
+    return 0;
+}
+
+// Drop the log and checkpoint once the document has been saved elsewhere
+int wal_clear(wal_t *w)
+{
+    if (ftruncate(w->fd, 0) < 0 || fsync(w->fd) < 0)
+        return -1;
+    w->size = 0;
+    w->failed = false;
+    if (unlink(w->checkpoint_path) < 0 && errno != ENOENT)
+        return -1;
+    sync_dir(w->checkpoint_path);
+    return 0;
+}
+
+// Durably replace the file at path with data
+int wal_save(const char *path, const char *data, size_t len)
+{
+    return write_file(path, "", 0, data, len);
+}
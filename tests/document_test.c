@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "document.h"
+#include "check.h"
+
+// Differential test of the rope: random inserts, deletes and wraps are
+// applied both to a document and to a plain string, and the two must agree
+// on the text and on every line lookup. Edits are small relative to the
+// document so chunks are split, patched in place and coalesced in turn.
+
+#define MODEL_MAX (1 << 20)
+
+static char model[MODEL_MAX];
+static size_t model_len;
+static unsigned long long rng = 88172645463325252ULL;
+
+static size_t rnd(size_t n)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return n ? rng % n : 0;
+}
+
+static void model_insert(size_t pos, const char *text)
+{
+    size_t n = strlen(text);
+    if (pos > model_len)
+        pos = model_len;
+    memmove(model + pos + n, model + pos, model_len - pos);
+    memcpy(model + pos, text, n);
+    model_len += n;
+}
+
+static void model_delete(size_t pos, size_t n)
+{
+    if (n > model_len - pos)
+        n = model_len - pos;
+    memmove(model + pos, model + pos + n, model_len - pos - n);
+    model_len -= n;
+}
+
+static void random_text(char *buf, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        buf[i] = rnd(8) == 0 ? '\n' : (char)('a' + rnd(26));
+    buf[n] = '\0';
+}
+
+// Compare the whole document against the model, through the snapshot,
+// document_read and the line lookups
+static void compare(document_t *doc)
+{
+    CHECK(doc->length == model_len);
+    const doc_snapshot_t *snap = document_snapshot(doc);
+    CHECK(snap->len == model_len && memcmp(snap->data, model, model_len) == 0);
+    CHECK(snap->data[snap->len] == '\0');
+    document_snapshot_release(snap);
+
+    size_t pos = model_len ? rnd(model_len) : 0;
+    char buf[64];
+    size_t n = document_read(doc, pos, buf, sizeof(buf));
+    size_t want = model_len - pos < sizeof(buf) ? model_len - pos : sizeof(buf);
+    CHECK(n == want && memcmp(buf, model + pos, n) == 0);
+
+    size_t lines = 1;
+    for (size_t i = 0; i < model_len; i++)
+        lines += model[i] == '\n';
+    CHECK(document_line_count(doc) == lines);
+
+    // Line of pos: the newlines before it
+    size_t line = 0, counted = 0;
+    for (size_t i = 0; i < model_len; i += 1 + rnd(97))
+    {
+        for (; counted < i; counted++)
+            line += model[counted] == '\n';
+        CHECK(document_line_at(doc, i) == line);
+    }
+    for (size_t l = 0, start = 0; l <= lines; l++)
+    {
+        CHECK(document_line_start(doc, l) == (l < lines ? start : model_len));
+        while (start < model_len && model[start] != '\n')
+            start++;
+        start++;
+    }
+}
+
+static void random_edits(document_t *doc, int rounds)
+{
+    char text[300];
+    for (int i = 0; i < rounds; i++)
+    {
+        int op = rnd(10);
+        if (op < 5 || model_len == 0)
+        {
+            size_t pos = rnd(model_len + 1);
+            random_text(text, 1 + rnd(op == 0 ? 250 : 8));
+            CHECK(document_insert(doc, pos, text) == 0);
+            model_insert(pos, text);
+        }
+        else if (op < 8)
+        {
+            size_t pos = rnd(model_len);
+            size_t n = 1 + rnd(op == 5 ? 400 : 8);
+            CHECK(document_delete(doc, pos, n) == 0);
+            model_delete(pos, n);
+        }
+        else
+        {
+            size_t start = rnd(model_len + 1);
+            size_t end = start + rnd(model_len - start + 1);
+            CHECK(document_wrap(doc, start, end, "**", "**") == 0);
+            model_insert(end, "**");
+            model_insert(start, "**");
+        }
+        if (i % 50 == 0)
+            compare(doc);
+    }
+    compare(doc);
+}
+
+static void test_edges(void)
+{
+    document_t *doc = document_create();
+    CHECK(document_delete(doc, 0, 1) == -1);
+    CHECK(document_insert(doc, 5, "abc") == 0); // Past the end appends
+    CHECK(document_insert(doc, 0, "") == 0);
+    CHECK(document_delete(doc, 1, 100) == 0);   // Clipped to the end
+    CHECK(document_wrap(doc, 1, 0, "[", "]") == -1);
+    CHECK(document_wrap(doc, 0, 2, "[", "]") == -1);
+    char *text;
+    size_t len;
+    document_serialize(doc, &text, &len);
+    CHECK(len == 1 && strcmp(text, "a") == 0);
+    free(text);
+    document_free(doc);
+}
+
+// A mapped document borrows its chunks from the file until they are edited
+static void test_mapped(void)
+{
+    char path[] = "/tmp/document_test_XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    model_len = 0;
+    char text[4097];
+    for (int i = 0; i < 64; i++)
+    {
+        random_text(text, 4096);
+        model_insert(model_len, text);
+    }
+    CHECK(write(fd, model, model_len) == (ssize_t)model_len);
+    close(fd);
+
+    document_t *doc = document_map(path);
+    CHECK(doc != NULL);
+    if (doc)
+    {
+        compare(doc);
+        random_edits(doc, 2000);
+        document_free(doc);
+    }
+    unlink(path);
+}
+
+int main(void)
+{
+    test_edges();
+
+    document_t *doc = document_create();
+    model_len = 0;
+    random_edits(doc, 20000);
+    document_free(doc);
+
+    test_mapped();
+    return check_status("document_test");
+}
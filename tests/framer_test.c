@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "protocol.h"
+#include "check.h"
+
+// Round trip through the server-to-client framer: one stream holding every
+// message type is written into a pipe in chunks of various sizes, and each
+// run must decode to the same messages however the reads split them. The
+// ring is kept small so headers and bodies straddle its wrap.
+
+#define BIG_LEN 100000
+
+typedef struct
+{
+    msg_type_t type;
+    unsigned long version;
+    const char *role;
+    const char *text;
+    size_t len;
+} expect_t;
+
+static char stream[BIG_LEN + 1024];
+static size_t stream_len;
+static char big[BIG_LEN + 1];
+static expect_t expected[16];
+static size_t nexpected;
+
+static void add(const char *wire, size_t wire_len, expect_t e)
+{
+    memcpy(stream + stream_len, wire, wire_len);
+    stream_len += wire_len;
+    if (e.text)
+        expected[nexpected++] = e;
+}
+
+static void add_str(const char *wire, expect_t e)
+{
+    add(wire, strlen(wire), e);
+}
+
+static void build_stream(void)
+{
+    for (size_t i = 0; i < BIG_LEN; i++)
+        big[i] = i % 61 == 60 ? '\n' : (char)('a' + i % 26);
+
+    char head[64];
+    int n = document_header(head, sizeof(head), "write", 3, 11);
+    add(head, n, (expect_t){0});
+    add_str("hello\nworld", (expect_t){MSG_SNAPSHOT, 3, "write", "hello\nworld", 11});
+    const char *block = "VERSION 4\nEDIT bob i 0 x SUCCESS\nEND\n";
+    add_str(block, (expect_t){MSG_VERSION, 4, "", block, strlen(block)});
+    add_str("\n", (expect_t){0});
+    add_str("VERSION 4\nDOCUMENT (6 bytes):\nxhello", (expect_t){MSG_DOC_REPLY, 4, "", "xhello", 6});
+    add_str("LOG (6 bytes):\nx\ny\nz\n", (expect_t){MSG_LOG_REPLY, 0, "", "x\ny\nz\n", 6});
+    add_str("Reject UNAUTHORISED\n", (expect_t){MSG_REPLY, 0, "", "Reject UNAUTHORISED", 19});
+    add_str("STATS (0 bytes):\n", (expect_t){MSG_STATS_REPLY, 0, "", "", 0});
+    n = snprintf(head, sizeof(head), "VERSION 5\nDOCUMENT (%d bytes):\n", BIG_LEN);
+    add(head, n, (expect_t){0});
+    add(big, BIG_LEN, (expect_t){MSG_DOC_REPLY, 5, "", big, BIG_LEN});
+    n = document_header(head, sizeof(head), "read", 6, 0);
+    add(head, n, (expect_t){MSG_SNAPSHOT, 6, "read", "", 0});
+}
+
+static void check_frame(const frame_t *f, const expect_t *e)
+{
+    CHECK(f->type == e->type);
+    CHECK(f->version == e->version);
+    CHECK(strcmp(f->role, e->role) == 0);
+    CHECK(f->len == e->len && memcmp(f->text, e->text, e->len) == 0);
+    CHECK(f->text[f->len] == '\0');
+}
+
+// Decode the stream written chunk bytes at a time
+static void run(size_t chunk)
+{
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    framer_t f;
+    CHECK(framer_init(&f, 64) == 0);
+
+    size_t got = 0;
+    for (size_t off = 0; off < stream_len;)
+    {
+        size_t n = stream_len - off < chunk ? stream_len - off : chunk;
+        CHECK(write(fds[1], stream + off, n) == (ssize_t)n);
+        off += n;
+
+        // Drain the pipe, handing out each message as it completes
+        ssize_t r;
+        while ((r = framer_fill(&f, fds[0])) > 0)
+        {
+            frame_t frame;
+            while (framer_next(&f, &frame) == 1)
+            {
+                CHECK(got < nexpected);
+                if (got < nexpected)
+                    check_frame(&frame, &expected[got]);
+                got++;
+            }
+        }
+        CHECK(r < 0 && errno == EAGAIN);
+    }
+    if (got != nexpected)
+    {
+        fprintf(stderr, "chunk %zu: %zu messages, want %zu\n", chunk, got, nexpected);
+        check_failures++;
+    }
+    framer_free(&f);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(void)
+{
+    build_stream();
+    const size_t chunks[] = {1, 2, 3, 7, 63, 64, 65, 1000, 4096};
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+        run(chunks[i]);
+    return check_status("framer_test");
+}
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "command.h"
+#include "document.h"
+#include "posmap.h"
+#include "check.h"
+
+// The position map is checked against a naive reference that keeps one
+// entry per byte of current text, and the rebase rules built on it are
+// checked through whole commands against known results.
+
+#define REF_MAX 4096
+
+typedef struct
+{
+    piece_kind_t kind;
+    size_t base; // Base offset of the byte, or base cursor of the insertion
+} ref_byte_t;
+
+static ref_byte_t ref[REF_MAX];
+static size_t ref_len;
+static size_t ref_base_len;
+static posmap_span_t ref_cuts[REF_MAX];
+static size_t ref_ncuts;
+static unsigned long long rng = 88172645463325252ULL;
+
+static size_t rnd(size_t n)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return n ? rng % n : 0;
+}
+
+static void ref_reset(size_t base_len)
+{
+    for (size_t i = 0; i < base_len; i++)
+        ref[i] = (ref_byte_t){PIECE_BASE, i};
+    ref_len = base_len;
+    ref_base_len = base_len;
+}
+
+static size_t ref_translate(size_t pos)
+{
+    for (size_t i = 0; i < ref_len; i++)
+    {
+        bool before = ref[i].kind == PIECE_BASE ? ref[i].base < pos : ref[i].base <= pos;
+        if (!before)
+            return i;
+    }
+    return ref_len;
+}
+
+static bool ref_deleted(size_t pos, size_t *start, size_t *end)
+{
+    size_t gap_start = 0, gap_end = ref_base_len;
+    for (size_t i = 0; i < ref_len; i++)
+    {
+        if (ref[i].kind != PIECE_BASE)
+            continue;
+        if (ref[i].base < pos)
+            gap_start = ref[i].base + 1;
+        else
+        {
+            gap_end = ref[i].base;
+            break;
+        }
+    }
+    if (gap_start >= pos || pos >= gap_end)
+        return false;
+    *start = gap_start;
+    *end = gap_end;
+    return true;
+}
+
+static size_t ref_anchor(size_t cur)
+{
+    return cur < ref_len ? ref[cur].base : ref_base_len;
+}
+
+static void ref_insert(size_t cur, size_t len, piece_kind_t kind, size_t anchor)
+{
+    memmove(ref + cur + len, ref + cur, (ref_len - cur) * sizeof(ref_byte_t));
+    for (size_t i = 0; i < len; i++)
+        ref[cur + i] = (ref_byte_t){kind, anchor};
+    ref_len += len;
+}
+
+// Drop base bytes in [start, end) and the markers belonging to them,
+// recording the current ranges removed as posmap_delete does
+static void ref_delete(size_t start, size_t end)
+{
+    ref_ncuts = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < ref_len; i++)
+    {
+        const ref_byte_t *b = &ref[i];
+        bool cut = (b->kind == PIECE_BASE && b->base >= start && b->base < end) ||
+                   (b->kind == PIECE_PREFIX && b->base >= start && b->base < end) ||
+                   (b->kind == PIECE_SUFFIX && b->base > start && b->base <= end);
+        if (!cut)
+            ref[kept++] = *b;
+        else if (ref_ncuts > 0 && ref_cuts[ref_ncuts - 1].end == i)
+            ref_cuts[ref_ncuts - 1].end = i + 1;
+        else
+            ref_cuts[ref_ncuts++] = (posmap_span_t){i, i + 1};
+    }
+    ref_len = kept;
+}
+
+static size_t resolve_cursor(const posmap_t *m, size_t pos)
+{
+    size_t start, end;
+    return posmap_deleted(m, pos, &start, &end) ? start : pos;
+}
+
+// Every lookup the map answers, against the reference
+static void compare(const posmap_t *m)
+{
+    CHECK(m->length == ref_len);
+    for (size_t pos = 0; pos <= ref_base_len; pos++)
+    {
+        size_t start = 0, end = 0, ref_start = 0, ref_end = 0;
+        bool deleted = posmap_deleted(m, pos, &start, &end);
+        CHECK(deleted == ref_deleted(pos, &ref_start, &ref_end));
+        CHECK(!deleted || (start == ref_start && end == ref_end));
+        CHECK(posmap_translate(m, pos) == ref_translate(pos));
+    }
+    for (size_t cur = 0; cur <= ref_len; cur++)
+        CHECK(posmap_anchor(m, cur) == ref_anchor(cur));
+}
+
+// Random versions built from the edits commands make: insertions at
+// resolved cursors, marker pairs around ranges, deletions, and line
+// prefixes placed by current offset
+static void test_differential(void)
+{
+    posmap_t m;
+    posmap_init(&m);
+    for (int round = 0; round < 300; round++)
+    {
+        size_t base = rnd(200);
+        posmap_reset(&m, base);
+        ref_reset(base);
+        for (int i = 0; i < 40 && ref_len < REF_MAX - 64; i++)
+        {
+            int op = rnd(4);
+            if (op == 0)
+            {
+                size_t pos = resolve_cursor(&m, rnd(base + 1));
+                size_t cur = posmap_translate(&m, pos);
+                size_t len = 1 + rnd(5);
+                posmap_insert(&m, cur, len, PIECE_TEXT, pos);
+                ref_insert(cur, len, PIECE_TEXT, pos);
+            }
+            else if (op == 1 && base)
+            {
+                size_t from = rnd(base), to = from + 1 + rnd(base - from);
+                size_t cur_to = posmap_translate(&m, to), cur_from = posmap_translate(&m, from);
+                posmap_insert(&m, cur_to, 2, PIECE_SUFFIX, to);
+                ref_insert(cur_to, 2, PIECE_SUFFIX, to);
+                posmap_insert(&m, cur_from, 2, PIECE_PREFIX, from);
+                ref_insert(cur_from, 2, PIECE_PREFIX, from);
+            }
+            else if (op == 2 && base)
+            {
+                size_t from = rnd(base), to = from + 1 + rnd(base - from + 3);
+                if (to > base)
+                    to = base;
+                posmap_delete(&m, from, to);
+                ref_delete(from, to);
+                CHECK(m.ncuts == ref_ncuts);
+                for (size_t k = 0; k < m.ncuts && k < ref_ncuts; k++)
+                    CHECK(m.cuts[k].start == ref_cuts[k].start && m.cuts[k].end == ref_cuts[k].end);
+            }
+            else if (op == 3)
+            {
+                size_t cur = rnd(m.length + 1);
+                size_t anchor = posmap_anchor(&m, cur);
+                size_t len = 1 + rnd(3);
+                posmap_insert(&m, cur, len, PIECE_PREFIX, anchor);
+                ref_insert(cur, len, PIECE_PREFIX, anchor);
+            }
+            CHECK(m.length == ref_len);
+        }
+        compare(&m);
+    }
+    posmap_free(&m);
+}
+
+// Apply each command in turn as one version against base and compare the
+// resulting text; want_reject names the command expected to be rejected
+static void check_version(const char *base, const char *const *cmds, const char *want, const char *want_reject)
+{
+    document_t *doc = document_create();
+    document_insert(doc, 0, base);
+    posmap_t map;
+    posmap_init(&map);
+    posmap_reset(&map, doc->length);
+    for (const char *const *c = cmds; *c; c++)
+    {
+        command_t edit;
+        char response[128] = "";
+        CHECK(command_parse(*c, &edit));
+        bool ok = command_apply(doc, &map, &edit, response, sizeof(response));
+        bool rejected = want_reject && strcmp(*c, want_reject) == 0;
+        CHECK(ok != rejected);
+        CHECK(!rejected || strcmp(response, "Reject DELETED_POSITION") == 0);
+    }
+    char *text;
+    size_t len;
+    document_serialize(doc, &text, &len);
+    if (strcmp(text, want) != 0)
+    {
+        fprintf(stderr, "\"%s\": got \"%s\", want \"%s\"\n", base, text, want);
+        check_failures++;
+    }
+    free(text);
+    posmap_free(&map);
+    document_free(doc);
+}
+
+#define CMDS(...) ((const char *const[]){__VA_ARGS__, NULL})
+
+static void test_rebase_rules(void)
+{
+    // A range end inside deleted text snaps to the deleted edge nearer the
+    // other end; a range with both ends deleted is rejected
+    check_version("hello world", CMDS("d 0 5", "BOLD 2 6"), "** wo**rld", NULL);
+    check_version("hello world", CMDS("d 6 3", "ITALIC 3 5"), "hel*lo *ld", NULL);
+    check_version("hello world", CMDS("i 3 XY", "d 0 5", "BOLD 2 6"), "XY** wo**rld", NULL);
+    check_version("hello world", CMDS("i 7 Z", "d 6 3", "ITALIC 3 5"), "hel*lo *Zld", NULL);
+    check_version("hello world", CMDS("d 0 5", "BOLD 1 3"), " world", "BOLD 1 3");
+    check_version("hello world", CMDS("d 2 6", "d 3 4"), "herld", "d 3 4");
+
+    // A cursor inside deleted text moves to where the deletion began
+    check_version("hello world", CMDS("d 2 3", "i 3 XY"), "heXY world", NULL);
+    check_version("hello world", CMDS("d 0 6", "HEADING 2 3"), "## world", NULL);
+
+    // Inserted text survives deletion around it; markers go with their text
+    check_version("hello world", CMDS("i 3 XY", "d 0 5"), "XY world", NULL);
+    check_version("hello world", CMDS("BOLD 0 5", "d 0 5"), " world", NULL);
+    check_version("hello world", CMDS("BOLD 0 5", "d 5 6"), "**hello**", NULL);
+
+    // Insertions at one cursor keep their order
+    check_version("hello world", CMDS("i 5 A", "i 5 B", "i 11 !"), "helloAB world!", NULL);
+}
+
+// Commands that raced a version boundary are rewritten against the text
+// the previous version left
+static void test_command_rebase(void)
+{
+    document_t *doc = document_create();
+    document_insert(doc, 0, "hello world");
+    posmap_t map;
+    posmap_init(&map);
+    posmap_reset(&map, doc->length);
+    command_t edit;
+    char response[128];
+    command_parse("d 0 5", &edit);
+    CHECK(command_apply(doc, &map, &edit, response, sizeof(response)));
+
+    command_parse("BOLD 2 6", &edit);
+    CHECK(command_rebase(&map, &edit, response, sizeof(response)));
+    CHECK(edit.pos == 0 && edit.len == 3);
+    command_parse("i 7 Z", &edit);
+    CHECK(command_rebase(&map, &edit, response, sizeof(response)));
+    CHECK(edit.pos == 2);
+    command_parse("i 3 Z", &edit);
+    CHECK(command_rebase(&map, &edit, response, sizeof(response)));
+    CHECK(edit.pos == 0);
+    command_parse("BOLD 1 3", &edit);
+    CHECK(!command_rebase(&map, &edit, response, sizeof(response)));
+    CHECK(strcmp(response, "Reject DELETED_POSITION") == 0);
+    command_parse("i 12 Z", &edit);
+    CHECK(!command_rebase(&map, &edit, response, sizeof(response)));
+    CHECK(strcmp(response, "Reject INVALID_POSITION") == 0);
+
+    posmap_free(&map);
+    document_free(doc);
+}
+
+int main(void)
+{
+    test_differential();
+    test_rebase_rules();
+    test_command_rebase();
+    return check_status("posmap_test");
+}
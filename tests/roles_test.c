@@ -0,0 +1,75 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "roles.h"
+#include "check.h"
+
+// Parsing of roles.txt, and the reload when the file is replaced
+
+static char dir[] = "/tmp/roles_test_XXXXXX";
+static char path[64];
+
+static void write_roles(const char *file, const char *text)
+{
+    FILE *f = fopen(file, "w");
+    CHECK(f != NULL);
+    if (!f)
+        return;
+    fputs(text, f);
+    fclose(f);
+}
+
+static bool role_is(const char *user, const char *want)
+{
+    const char *role = roles_lookup(user);
+    if (!role || !want)
+        return role == want;
+    return strcmp(role, want) == 0;
+}
+
+int main(void)
+{
+    CHECK(mkdtemp(dir) != NULL);
+    snprintf(path, sizeof(path), "%s/roles.txt", dir);
+    write_roles(path,
+                "bob write\n"
+                "\n"
+                "  eve\tread  \n"
+                "mallory admin\n"
+                "trent\n"
+                "alice read extra\n"
+                "ryan read\n"
+                "ryan write\n"
+                "\t\n"
+                "last read");
+    CHECK(roles_init(path) == 0);
+    CHECK(role_is("bob", "write"));
+    CHECK(role_is("eve", "read"));
+    CHECK(role_is("ryan", "write")); // The later line wins
+    CHECK(role_is("last", "read"));  // No trailing newline
+    CHECK(role_is("mallory", NULL));
+    CHECK(role_is("trent", NULL));
+    CHECK(role_is("alice", NULL));
+    CHECK(role_is("bo", NULL));
+    CHECK(role_is("", NULL));
+
+    // Replace the file the way an editor would, then wait for the reload
+    char tmp[80];
+    snprintf(tmp, sizeof(tmp), "%s/roles.new", dir);
+    write_roles(tmp, "bob read\ncarol write\n");
+    CHECK(rename(tmp, path) == 0);
+    struct timespec pause = {0, 10 * 1000 * 1000};
+    for (int i = 0; i < 200 && !role_is("carol", "write"); i++)
+        nanosleep(&pause, NULL);
+    CHECK(role_is("carol", "write"));
+    CHECK(role_is("bob", "read"));
+    CHECK(role_is("eve", NULL));
+
+    unlink(path);
+    rmdir(dir);
+    return check_status("roles_test");
+}
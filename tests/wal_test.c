@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "wal.h"
+#include "document.h"
+#include "check.h"
+
+// Recovery of the write-ahead log: whole records are replayed, a torn or
+// corrupt tail is cut off, and records a checkpoint already covers are
+// skipped. Each case works on its own log in a scratch directory.
+
+static char dir[] = "/tmp/wal_test_XXXXXX";
+static char log_path[64];
+static char ckpt_path[64];
+
+static void reset_files(void)
+{
+    unlink(log_path);
+    unlink(ckpt_path);
+}
+
+static off_t file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void append_file(const char *path, const char *data, size_t len)
+{
+    int fd = open(path, O_WRONLY | O_APPEND);
+    CHECK(fd >= 0 && write(fd, data, len) == (ssize_t)len);
+    if (fd >= 0)
+        close(fd);
+}
+
+// Commit one version holding the given commands
+static void commit(wal_t *w, unsigned long version, const char *const *cmds)
+{
+    for (const char *const *c = cmds; *c; c++)
+        wal_add(w, *c);
+    CHECK(wal_commit(w, version) == 0);
+}
+
+// Recover into a fresh document and compare text and version
+static void check_recover(const char *want, unsigned long want_version)
+{
+    document_t *doc = document_create();
+    unsigned long version = 0;
+    CHECK(wal_recover(log_path, ckpt_path, doc, &version) == 0);
+    char *text;
+    size_t len;
+    document_serialize(doc, &text, &len);
+    if (strcmp(text, want) != 0 || version != want_version)
+    {
+        fprintf(stderr, "recovered \"%s\" at %lu, want \"%s\" at %lu\n", text, version, want, want_version);
+        check_failures++;
+    }
+    free(text);
+    document_free(doc);
+}
+
+#define CMDS(...) ((const char *const[]){__VA_ARGS__, NULL})
+
+static void test_missing(void)
+{
+    reset_files();
+    check_recover("", 0);
+}
+
+static void test_torn_tail(void)
+{
+    reset_files();
+    wal_t w;
+    CHECK(wal_open(&w, log_path, ckpt_path) == 0);
+    commit(&w, 1, CMDS("i 0 hello"));
+    commit(&w, 2, CMDS("i 5 world", "BOLD 0 5")); // Both address "hello"
+    CHECK(wal_commit(&w, 3) == 0); // No edits, no record
+    wal_close(&w);
+    off_t good = file_size(log_path);
+
+    // A record cut short by a crash mid-write: its header promises more
+    // payload than follows
+    append_file(log_path, "\x40\0\0\0\x12\x34\x56\x78" "4\ni 0 x", 15);
+    check_recover("**helloworld**", 2);
+    CHECK(file_size(log_path) == good);
+
+    // The log stays appendable after the cut
+    CHECK(wal_open(&w, log_path, ckpt_path) == 0);
+    commit(&w, 4, CMDS("i 14 !"));
+    wal_close(&w);
+    check_recover("**helloworld**!", 4);
+}
+
+static void test_corrupt_record(void)
+{
+    reset_files();
+    wal_t w;
+    CHECK(wal_open(&w, log_path, ckpt_path) == 0);
+    commit(&w, 1, CMDS("i 0 hello"));
+    off_t good = file_size(log_path);
+    commit(&w, 2, CMDS("i 5 world"));
+    wal_close(&w);
+
+    // Flip the last byte of the second record so its CRC no longer matches
+    int fd = open(log_path, O_RDWR);
+    char c;
+    off_t last = file_size(log_path) - 1;
+    CHECK(pread(fd, &c, 1, last) == 1);
+    c ^= 1;
+    CHECK(pwrite(fd, &c, 1, last) == 1);
+    close(fd);
+
+    check_recover("hello", 1);
+    CHECK(file_size(log_path) == good);
+}
+
+static void test_checkpoint(void)
+{
+    reset_files();
+    wal_t w;
+    CHECK(wal_open(&w, log_path, ckpt_path) == 0);
+    commit(&w, 1, CMDS("i 0 hello"));
+    commit(&w, 2, CMDS("i 5 world"));
+
+    // A crash after the snapshot is written but before the log is cut
+    // leaves records the snapshot already holds; they are not replayed
+    size_t old_len = file_size(log_path);
+    char *old_log = malloc(old_len);
+    int fd = open(log_path, O_RDONLY);
+    CHECK(read(fd, old_log, old_len) == (ssize_t)old_len);
+    close(fd);
+    CHECK(wal_checkpoint(&w, 2, "helloworld", 10) == 0);
+    CHECK(file_size(log_path) == 0);
+    commit(&w, 3, CMDS("i 0 >"));
+    wal_close(&w);
+    check_recover(">helloworld", 3);
+
+    int out = open(log_path, O_WRONLY | O_TRUNC);
+    CHECK(out >= 0 && write(out, old_log, old_len) == (ssize_t)old_len);
+    close(out);
+    check_recover("helloworld", 2);
+    free(old_log);
+
+    // A snapshot whose header does not match its length is refused
+    FILE *f = fopen(ckpt_path, "w");
+    fputs("2 99\nhelloworld", f);
+    fclose(f);
+    document_t *doc = document_create();
+    unsigned long version = 0;
+    CHECK(wal_recover(log_path, ckpt_path, doc, &version) == -1);
+    document_free(doc);
+}
+
+int main(void)
+{
+    CHECK(mkdtemp(dir) != NULL);
+    snprintf(log_path, sizeof(log_path), "%s/doc.wal", dir);
+    snprintf(ckpt_path, sizeof(ckpt_path), "%s/doc.ckpt", dir);
+
+    test_missing();
+    test_torn_tail();
+    test_corrupt_record();
+    test_checkpoint();
+
+    reset_files();
+    rmdir(dir);
+    return check_status("wal_test");
+}